@@ -0,0 +1,106 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "attr_cache.h"
+#include "stats.h"
+
+AttrCache attr_cache;
+
+// Past this many entries the expired ones are swept out, and if that
+// isn't enough everything goes
+const size_t MAX_ENTRIES = 1 << 17;
+
+void AttrCache::set_timeout(unsigned seconds) {
+  std::lock_guard<std::mutex> guard(_lock);
+  _timeout_ns = seconds * 1000000000ULL;
+  _entries.clear();
+}
+
+bool AttrCache::get(const std::string& path, mongo::BSONObj* file_obj) {
+  if (!enabled())
+    return false;
+
+  std::lock_guard<std::mutex> guard(_lock);
+  auto i = _entries.find(path);
+  if (i == _entries.end())
+    return false;
+  if (i->second.expires < now_ns()) {
+    _entries.erase(i);
+    return false;
+  }
+
+  *file_obj = i->second.file_obj;
+  return true;
+}
+
+uint64_t& AttrCache::shard_generation(const std::string& path) {
+  return _generations[std::hash<std::string>()(path) % SHARDS];
+}
+
+uint64_t AttrCache::generation(const std::string& path) {
+  std::lock_guard<std::mutex> guard(_lock);
+  return shard_generation(path);
+}
+
+void AttrCache::fill(const std::string& path, const mongo::BSONObj& file_obj, uint64_t since) {
+  if (!enabled())
+    return;
+
+  std::lock_guard<std::mutex> guard(_lock);
+  if (shard_generation(path) == since)
+    store(path, file_obj);
+}
+
+void AttrCache::put(const std::string& path, const mongo::BSONObj& file_obj) {
+  if (!enabled())
+    return;
+
+  std::lock_guard<std::mutex> guard(_lock);
+  shard_generation(path)++;
+  store(path, file_obj);
+}
+
+void AttrCache::forget(const std::string& path) {
+  std::lock_guard<std::mutex> guard(_lock);
+  shard_generation(path)++;
+  _entries.erase(path);
+}
+
+void AttrCache::clear() {
+  std::lock_guard<std::mutex> guard(_lock);
+  for (uint64_t& g : _generations)
+    g++;
+  _entries.clear();
+}
+
+void AttrCache::store(const std::string& path, const mongo::BSONObj& file_obj) {
+  uint64_t now = now_ns();
+  if (_entries.size() >= MAX_ENTRIES) {
+    for (auto i = _entries.begin(); i != _entries.end();) {
+      if (i->second.expires < now)
+        i = _entries.erase(i);
+      else
+        ++i;
+    }
+    if (_entries.size() >= MAX_ENTRIES)
+      _entries.clear();
+  }
+
+  entry& e = _entries[path];
+  e.file_obj = file_obj.getOwned();
+  e.expires = now + _timeout_ns;
+}
@@ -0,0 +1,73 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ATTR_CACHE_H
+#define __ATTR_CACHE_H
+
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+
+#include <mongo/bson/bson.h>
+
+/* Files documents by path for --attr-timeout seconds, including the
+   fact that there is none. Changes made through this mount replace or
+   drop entries as they happen; other clients' changes show up once an
+   entry expires. stat, open, read and the xattr calls all share it. */
+class AttrCache {
+public:
+  AttrCache() : _timeout_ns(0), _generations() {}
+
+  void set_timeout(unsigned seconds);
+  bool enabled() const { return _timeout_ns != 0; }
+
+  //! True if path is cached; file_obj is then its files document, or
+  //  empty when there is no such file.
+  bool get(const std::string& path, mongo::BSONObj* file_obj);
+
+  //! Taken before a lookup of path and handed to fill, so a lookup that
+  //  raced with a change made here can't cache what it read before it.
+  //  Counted per shard of paths, so changes elsewhere rarely cost a fill.
+  uint64_t generation(const std::string& path);
+  void fill(const std::string& path, const mongo::BSONObj& file_obj, uint64_t since);
+
+  //! path now has file_obj as its document, as written by this mount.
+  void put(const std::string& path, const mongo::BSONObj& file_obj);
+  void forget(const std::string& path);
+  void clear();
+
+private:
+  struct entry {
+    mongo::BSONObj file_obj;
+    uint64_t expires;
+  };
+
+  enum { SHARDS = 256 };
+
+  void store(const std::string& path, const mongo::BSONObj& file_obj);
+  uint64_t& shard_generation(const std::string& path);
+
+  std::mutex _lock;
+  uint64_t _timeout_ns;
+  uint64_t _generations[SHARDS];
+  std::unordered_map<std::string, entry> _entries;
+};
+
+extern AttrCache attr_cache;
+
+#endif
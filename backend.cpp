@@ -0,0 +1,49 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <memory>
+
+#include "backend.h"
+#include "mongo_backend.h"
+#include "memory_backend.h"
+#include "options.h"
+
+namespace {
+
+std::unique_ptr<Backend> backend;
+
+}
+
+mongo::BSONObj newest_first() {
+  return BSON("version" << -1 << "_id" << -1);
+}
+
+Backend& get_backend() {
+  return *backend;
+}
+
+bool init_backend(const char* name) {
+  if (!name || strcmp(name, "mongo") == 0)
+    backend.reset(new MongoBackend());
+  else if (strcmp(name, "memory") == 0)
+    backend.reset(new MemoryBackend(gridfs_options.backend_latency));
+  else
+    return false;
+
+  return true;
+}
@@ -0,0 +1,120 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __BACKEND_H
+#define __BACKEND_H
+
+#include <string>
+#include <vector>
+#include <mongo/client/dbclient.h>
+
+/* Everything the filesystem asks of its storage. Documents keep the
+   GridFS layout whatever the backend: files documents are looked up by
+   filename, chunk documents by (files_id, n). The Mongo backend is what
+   a mount uses. The in-memory one keeps everything in this process so
+   the FUSE side can be measured without a server. */
+class Backend {
+public:
+  virtual ~Backend() {}
+
+  //! Start background work. Called from gridfs_init.
+  virtual void start() {}
+
+  //! The current files document named filename, or an empty object.
+  //  While a replacement retires the old version, two documents share
+  //  the name. The one with the highest version is current: a new OID
+  //  set by whatever made it current, a flush, a copy or a rename.
+  //  Documents without one, as other GridFS clients write them, lose to
+  //  any that have one and otherwise go by _id.
+  virtual mongo::BSONObj find_file(const std::string& filename) = 0;
+
+  //! Files documents whose name starts with dir, which is empty or ends
+  //  in '/'. With children_only, none from further down. fields is a
+  //  projection as in a Mongo query; empty returns whole documents.
+  virtual std::vector<mongo::BSONObj> list_files(const std::string& dir,
+                                                 bool children_only,
+                                                 const mongo::BSONObj& fields) = 0;
+
+  //! Files documents matching a query filter on the files collection,
+  //  in filename order, at most limit of them (0 for all). fields is a
+  //  projection as in list_files.
+  virtual std::vector<mongo::BSONObj> find_files(const mongo::BSONObj& filter, int limit,
+                                                 const mongo::BSONObj& fields) = 0;
+
+  //! Total length and number of the regular files whose name starts
+  //  with dir, which is empty or ends in '/'. Returns 0 or -errno.
+  virtual int tree_usage(const std::string& dir, long long* bytes, long long* files) = 0;
+
+  struct usage {
+    unsigned long long used;    // bytes stored in the bucket
+    unsigned long long avail;   // free space where it is stored, 0 if unknown
+    unsigned long long files;   // files documents
+  };
+
+  //! Space taken by the whole bucket. Returns 0 or -errno.
+  virtual int store_usage(usage* u) = 0;
+
+  virtual void insert_file(const mongo::BSONObj& file_obj) = 0;
+
+  //! Make file_obj the current version of its filename in one insert,
+  //  then retire the older documents of that name. Their chunks stay
+  //  readable for delay_seconds, for readers still on the old version.
+  //  At no point is the name missing.
+  virtual void replace_file(const mongo::BSONObj& file_obj, int delay_seconds) = 0;
+
+  //! Apply a $set / $unset update to the current files document named filename
+  //  and return the result, or an empty object if there is no such file.
+  //  condition adds {field: {$exists: bool}} clauses the document has to
+  //  satisfy as well.
+  virtual mongo::BSONObj update_file(const std::string& filename,
+                                     const mongo::BSONObj& update,
+                                     const mongo::BSONObj& condition = mongo::BSONObj()) = 0;
+
+  //! Remove every files document named filename. Their chunks go after
+  //  --retire-delay, or once no reader holds them (see gc.h).
+  //  Returns 0, or -ENOENT when there was no such file.
+  virtual int remove_file(const std::string& filename) = 0;
+
+  //! Remove one files document. Its chunks stay readable for at least
+  //  delay_seconds.
+  virtual void retire_file(const mongo::BSONObj& file_obj, int delay_seconds) = 0;
+
+  //! Copy a file's contents and attributes to dst, replacing it.
+  //  Returns 0 or -errno.
+  virtual int copy_file(const std::string& src, const std::string& dst) = 0;
+
+  //! Chunk document n of the given file, or an empty object.
+  virtual mongo::BSONObj get_chunk(const mongo::BSONElement& files_id, int n) = 0;
+
+  //! Chunk documents first <= n < last, in order. Missing ones are skipped.
+  virtual std::vector<mongo::BSONObj> get_chunks(const mongo::BSONElement& files_id,
+                                                 int first, int last) = 0;
+
+  virtual void put_chunks(const std::vector<mongo::BSONObj>& chunks) = 0;
+};
+
+//! Sort that puts the current version of a name first, see find_file.
+mongo::BSONObj newest_first();
+
+//! The backend selected by init_backend.
+Backend& get_backend();
+
+//! Select the backend named by --backend ("mongo" when NULL). Returns
+//  false for an unknown name.
+bool init_backend(const char* name);
+
+#endif
@@ -0,0 +1,59 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "chunk_cache.h"
+
+ChunkCache chunk_cache;
+
+void ChunkCache::set_capacity(size_t bytes) {
+  std::lock_guard<std::mutex> guard(_lock);
+  _capacity = bytes;
+  evict();
+}
+
+StoredChunk::ptr ChunkCache::get(const std::string& key) {
+  std::lock_guard<std::mutex> guard(_lock);
+  auto i = _index.find(key);
+  if (i == _index.end())
+    return StoredChunk::ptr();
+
+  _lru.splice(_lru.begin(), _lru, i->second);
+  return i->second->second;
+}
+
+void ChunkCache::put(const std::string& key, StoredChunk::ptr chunk) {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (entry_size(key, chunk) > _capacity || _index.count(key))
+    return;
+
+  _lru.push_front(std::make_pair(key, chunk));
+  _index[key] = _lru.begin();
+  _size += entry_size(key, chunk);
+  evict();
+}
+
+size_t ChunkCache::entry_size(const std::string& key, const StoredChunk::ptr& chunk) {
+  return key.size() + chunk->data.size() + chunk->blob.size() + sizeof(StoredChunk);
+}
+
+void ChunkCache::evict() {
+  while (_size > _capacity && !_lru.empty()) {
+    _size -= entry_size(_lru.back().first, _lru.back().second);
+    _index.erase(_lru.back().first);
+    _lru.pop_back();
+  }
+}
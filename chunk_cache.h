@@ -0,0 +1,66 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CHUNK_CACHE_H
+#define __CHUNK_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "codec.h"
+
+//! A chunk as it is stored in Mongo; data may still be compressed.
+struct StoredChunk {
+  std::string data;
+  chunk_codec codec;
+  size_t raw_len;
+
+  // Set when the chunk is only a reference to a deduplicated blob
+  std::string blob;
+
+  typedef std::shared_ptr<const StoredChunk> ptr;
+};
+
+//! Size bounded LRU of stored chunks. Chunks are immutable for a given
+//  files _id, so entries never need invalidating, only evicting.
+class ChunkCache {
+public:
+  ChunkCache() : _capacity(0), _size(0) {}
+
+  void set_capacity(size_t bytes);
+
+  StoredChunk::ptr get(const std::string& key);
+  void put(const std::string& key, StoredChunk::ptr chunk);
+
+private:
+  typedef std::list<std::pair<std::string, StoredChunk::ptr> > lru_list;
+
+  static size_t entry_size(const std::string& key, const StoredChunk::ptr& chunk);
+  void evict();
+
+  std::mutex _lock;
+  size_t _capacity, _size;
+  lru_list _lru;
+  std::unordered_map<std::string, lru_list::iterator> _index;
+};
+
+extern ChunkCache chunk_cache;
+
+#endif
@@ -0,0 +1,99 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <lz4.h>
+#include <zstd.h>
+
+#include "codec.h"
+
+// Favour speed: chunks are compressed on the close() path
+const int ZSTD_LEVEL = 1;
+
+const char* codec_name(chunk_codec codec) {
+  switch (codec) {
+  case CODEC_LZ4:
+    return "lz4";
+  case CODEC_ZSTD:
+    return "zstd";
+  default:
+    return NULL;
+  }
+}
+
+bool parse_codec(const std::string& name, chunk_codec* codec) {
+  if (name == "lz4")
+    *codec = CODEC_LZ4;
+  else if (name == "zstd")
+    *codec = CODEC_ZSTD;
+  else if (name == "none")
+    *codec = CODEC_NONE;
+  else
+    return false;
+
+  return true;
+}
+
+bool compress_chunk(chunk_codec codec, const char* src, size_t len, std::string& out) {
+  size_t out_len;
+
+  switch (codec) {
+  case CODEC_LZ4: {
+    out.resize(LZ4_compressBound(len));
+    int r = LZ4_compress_default(src, &out[0], len, out.size());
+    if (r <= 0)
+      return false;
+    out_len = r;
+    break;
+  }
+  case CODEC_ZSTD: {
+    out.resize(ZSTD_compressBound(len));
+    size_t r = ZSTD_compress(&out[0], out.size(), src, len, ZSTD_LEVEL);
+    if (ZSTD_isError(r))
+      return false;
+    out_len = r;
+    break;
+  }
+  default:
+    return false;
+  }
+
+  if (out_len >= len)
+    return false;
+
+  out.resize(out_len);
+  return true;
+}
+
+bool decompress_chunk(chunk_codec codec, const char* src, size_t len,
+                      char* dst, size_t raw_len) {
+  switch (codec) {
+  case CODEC_NONE:
+    if (len != raw_len)
+      return false;
+    memcpy(dst, src, len);
+    return true;
+  case CODEC_LZ4:
+    return LZ4_decompress_safe(src, dst, len, raw_len) == (int)raw_len;
+  case CODEC_ZSTD: {
+    size_t r = ZSTD_decompress(dst, raw_len, src, len);
+    return !ZSTD_isError(r) && r == raw_len;
+  }
+  }
+
+  return false;
+}
@@ -0,0 +1,44 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CODEC_H
+#define __CODEC_H
+
+#include <cstddef>
+#include <string>
+
+enum chunk_codec {
+  CODEC_NONE,
+  CODEC_LZ4,
+  CODEC_ZSTD
+};
+
+//! Name stored in the chunk document ("lz4", "zstd"), NULL for CODEC_NONE.
+const char* codec_name(chunk_codec codec);
+
+//! Inverse of codec_name. Returns false for names we can't decode.
+bool parse_codec(const std::string& name, chunk_codec* codec);
+
+//! Compress src into out. Returns false when compressing doesn't save
+//  anything, in which case the chunk should be stored raw.
+bool compress_chunk(chunk_codec codec, const char* src, size_t len, std::string& out);
+
+//! Expand a stored chunk into dst, which must hold raw_len bytes.
+bool decompress_chunk(chunk_codec codec, const char* src, size_t len,
+                      char* dst, size_t raw_len);
+
+#endif
@@ -0,0 +1,156 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <map>
+#include <mutex>
+
+#include "control.h"
+#include "stats.h"
+#include "tracing.h"
+
+namespace {
+
+struct control_file {
+  const char* path;
+  std::string (*render)();
+  // Called with whatever was written
+  void (*write)(const char* buf, size_t len);
+};
+
+void reset_stats_on_write(const char*, size_t) {
+  reset_stats();
+}
+
+std::string render_trace_state() {
+  return tracing_enabled() ? "1\n" : "0\n";
+}
+
+void write_trace_state(const char* buf, size_t len) {
+  if (len && (buf[0] == '0' || buf[0] == '1'))
+    set_tracing(buf[0] == '1');
+}
+
+void clear_trace_on_write(const char*, size_t) {
+  clear_trace();
+}
+
+const control_file control_files[] = {
+  { "/.gridfs/stats", stats_text, reset_stats_on_write },
+  { "/.gridfs/stats.json", stats_json, reset_stats_on_write },
+  { "/.gridfs/trace", render_trace_state, write_trace_state },
+  { "/.gridfs/trace.json", trace_json, clear_trace_on_write },
+  { NULL, NULL, NULL }
+};
+
+const control_file* find_control_file(const char* path) {
+  for (const control_file* f = control_files; f->path; f++)
+    if (strcmp(f->path, path) == 0)
+      return f;
+  return NULL;
+}
+
+// Content is rendered once per open so a reader sees one consistent snapshot
+std::mutex snapshots_lock;
+std::map<uint64_t, std::string> snapshots;
+std::atomic<uint64_t> next_handle(1);
+
+}
+
+int control_getattr(const char* path, struct stat* stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  fuse_context *context = fuse_get_context();
+  stbuf->st_uid = context->uid;
+  stbuf->st_gid = context->gid;
+  stbuf->st_ctime = stbuf->st_mtime = time(NULL);
+
+  if (strcmp(path, "/.gridfs") == 0) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  if (!find_control_file(path))
+    return -ENOENT;
+
+  stbuf->st_mode = S_IFREG | 0644;
+  stbuf->st_nlink = 1;
+  return 0;
+}
+
+int control_readdir(const char* path, void* buf, fuse_fill_dir_t filler) {
+  if (strcmp(path, "/.gridfs") != 0)
+    return -ENOTDIR;
+
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+  for (const control_file* f = control_files; f->path; f++)
+    filler(buf, f->path + strlen("/.gridfs/"), NULL, 0);
+
+  return 0;
+}
+
+int control_open(const char* path, struct fuse_file_info* fi) {
+  const control_file* f = find_control_file(path);
+  if (!f)
+    return strcmp(path, "/.gridfs") == 0 ? -EISDIR : -ENOENT;
+
+  fi->direct_io = 1;
+  fi->fh = next_handle++;
+
+  if ((fi->flags & O_ACCMODE) != O_WRONLY) {
+    std::string content = f->render();
+    std::lock_guard<std::mutex> guard(snapshots_lock);
+    snapshots[fi->fh].swap(content);
+  }
+
+  return 0;
+}
+
+int control_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi) {
+  std::lock_guard<std::mutex> guard(snapshots_lock);
+  auto i = snapshots.find(fi->fh);
+  if (i == snapshots.end())
+    return -EBADF;
+
+  const std::string& content = i->second;
+  if ((size_t)offset >= content.size())
+    return 0;
+
+  size_t len = std::min<size_t>(size, content.size() - offset);
+  memcpy(buf, content.data() + offset, len);
+  return len;
+}
+
+int control_write(const char* path, const char* buf, size_t nbyte, off_t offset, struct fuse_file_info* fi) {
+  const control_file* f = find_control_file(path);
+  if (!f)
+    return -ENOENT;
+
+  f->write(buf, nbyte);
+  return nbyte;
+}
+
+int control_truncate(const char* path, off_t size) {
+  return find_control_file(path) ? 0 : -ENOENT;
+}
+
+int control_release(const char* path, struct fuse_file_info* fi) {
+  std::lock_guard<std::mutex> guard(snapshots_lock);
+  snapshots.erase(fi->fh);
+  return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CONTROL_H
+#define __CONTROL_H
+
+#include "operations.h"
+
+/* Files under /.gridfs are generated by the mount itself and never
+   stored. They are opened direct_io, so reads always see fresh content
+   and their reported size of 0 doesn't matter. */
+
+inline bool is_control_path(const char* path) {
+  return strncmp(path, "/.gridfs", 8) == 0 && (path[8] == 0 || path[8] == '/');
+}
+
+int control_getattr(const char* path, struct stat* stbuf);
+
+int control_readdir(const char* path, void* buf, fuse_fill_dir_t filler);
+
+int control_open(const char* path, struct fuse_file_info* fi);
+
+int control_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info* fi);
+
+int control_write(const char* path, const char* buf, size_t nbyte, off_t offset, struct fuse_file_info* fi);
+
+int control_truncate(const char* path, off_t size);
+
+int control_release(const char* path, struct fuse_file_info* fi);
+
+#endif
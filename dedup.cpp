@@ -0,0 +1,212 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <set>
+#include <thread>
+#include <openssl/sha.h>
+
+#include "dedup.h"
+#include "mongo_backend.h"
+#include "operations.h"
+#include "options.h"
+#include "singleflight.h"
+#include "stats.h"
+#include "store.h"
+#include "utils.h"
+
+namespace {
+
+// How long a blob must go unreferenced before it may be swept. Has to
+// comfortably exceed the time a single flush takes to insert its chunks.
+const int GC_GRACE_SECONDS = 60 * 60;
+const int GC_INTERVAL_SECONDS = 60 * 60;
+
+// Blobs per $in query
+const size_t BATCH = 500;
+
+std::string blobs_ns() { return db_name() + ".blobs"; }
+
+std::string sha256_hex(const char* data, size_t len) {
+  static const char digits[] = "0123456789abcdef";
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256((const unsigned char*)data, len, digest);
+
+  std::string hex;
+  for (unsigned char c : digest) {
+    hex.push_back(digits[c >> 4]);
+    hex.push_back(digits[c & 0xf]);
+  }
+  return hex;
+}
+
+mongo::BSONArray to_array(std::vector<std::string>::const_iterator first,
+                          std::vector<std::string>::const_iterator last) {
+  mongo::BSONArrayBuilder b;
+  for (; first != last; ++first)
+    b.append(*first);
+  return b.arr();
+}
+
+void sweep_blobs(mongo::DBClientBase& client) {
+  mongo::Date_t cutoff(mongo_time() - unix_time_to_mongo_time(GC_GRACE_SECONDS));
+  mongo::BSONObj proj = BSON("_id" << 1);
+  std::unique_ptr<mongo::DBClientCursor> cursor =
+    DB_TIMED(DB_QUERY, client.query(blobs_ns(), BSON("lastRef" << BSON("$lt" << cutoff)), 0, 0, &proj));
+
+  while (cursor->more()) {
+    std::string blob = cursor->next()["_id"].String();
+    mongo::BSONObj ref = DB_TIMED(DB_FINDONE, client.findOne(db_name() + ".chunks",
+                                                             BSON("blob" << blob), &proj));
+    if (!ref.isEmpty())
+      continue;
+
+    // Re-check lastRef: a writer that stamped the blob since we listed it
+    // is about to reference it.
+    DB_TIMED(DB_REMOVE, client.remove(blobs_ns(), BSON("_id" << blob << "lastRef" << BSON("$lt" << cutoff)), true));
+  }
+}
+
+bool create_blob_index(mongo::DBClientBase& client) {
+  mongo::BSONObj info;
+  return DB_TIMED(DB_COMMAND, client.runCommand(gridfs_options.db,
+                                                BSON("createIndexes" << std::string(gridfs_options.prefix) + ".chunks"
+                                                     << "indexes" << BSON_ARRAY(BSON("key" << BSON("blob" << 1)
+                                                                                     << "name" << "blob_1"
+                                                                                     << "sparse" << true))),
+                                                info));
+}
+
+void blob_gc_loop() {
+  // The sweep looks chunks up by blob. The index is made on the first
+  // pass that reaches the server, so one that is down at mount time
+  // only delays it.
+  bool indexed = false;
+  for (;;) {
+    try {
+      auto sdc = make_ScopedDbConnection();
+      if (!indexed)
+        indexed = create_blob_index(sdc->conn());
+      else
+        sweep_blobs(sdc->conn());
+    } catch (const std::exception& e) {
+      fprintf(stderr, "blob gc: %s\n", e.what());
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(GC_INTERVAL_SECONDS));
+  }
+}
+
+}
+
+std::vector<std::string> store_blobs(mongo::DBClientBase& client,
+                                     const LocalGridFile& lgf) {
+  std::vector<std::string> names;
+  std::map<std::string, size_t> first_use;
+  std::vector<char> scratch;
+  for (size_t n = 0; n * lgf.ChunkSize() < (size_t)lgf.Length(); n++) {
+    size_t len = std::min<size_t>(lgf.ChunkSize(), lgf.Length() - n * lgf.ChunkSize());
+    names.push_back(sha256_hex(lgf.range(n * lgf.ChunkSize(), len, scratch), len));
+    first_use.insert(std::make_pair(names.back(), n));
+  }
+
+  std::vector<std::string> distinct;
+  for (auto& i : first_use)
+    distinct.push_back(i.first);
+
+  std::vector<std::string> missing;
+  for (size_t i = 0; i < distinct.size(); i += BATCH) {
+    auto first = distinct.begin() + i;
+    auto last = distinct.begin() + std::min(i + BATCH, distinct.size());
+    mongo::BSONArray batch = to_array(first, last);
+
+    // Stamp whatever already exists, then see what survived the stamp:
+    // those can't be swept any more and need no upload.
+    DB_TIMED(DB_UPDATE, client.update(blobs_ns(),
+                                      BSON("_id" << BSON("$in" << batch)),
+                                      BSON("$set" << BSON("lastRef" << mongo::DATENOW)),
+                                      false, true));
+
+    std::set<std::string> present;
+    mongo::BSONObj proj = BSON("_id" << 1);
+    std::unique_ptr<mongo::DBClientCursor> cursor =
+      DB_TIMED(DB_QUERY, client.query(blobs_ns(), BSON("_id" << BSON("$in" << batch)), 0, 0, &proj));
+    while (cursor->more())
+      present.insert(cursor->next()["_id"].String());
+
+    for (auto blob = first; blob != last; ++blob) {
+      if (!present.count(*blob))
+        missing.push_back(*blob);
+    }
+  }
+
+  // The rest go up as unordered bulk upserts, compressed on the workers
+  // with --upload-parallel of them in flight. One another writer got in
+  // first is only stamped.
+  run_uploads(missing.size(), std::max<size_t>(1, UPLOAD_BATCH_BYTES / lgf.ChunkSize()),
+              [&lgf, &missing, &first_use](size_t first, size_t last) {
+    auto sdc = make_ScopedDbConnection();
+    mongo::BulkOperationBuilder bulk = sdc->conn().initializeUnorderedBulkOp(blobs_ns());
+    std::string packed;
+    std::vector<char> scratch;
+    for (size_t i = first; i < last; i++) {
+      size_t n = first_use.find(missing[i])->second;
+      size_t len = std::min<size_t>(lgf.ChunkSize(), lgf.Length() - n * lgf.ChunkSize());
+      mongo::BSONObjBuilder data;
+      append_chunk_data(data, lgf.range(n * lgf.ChunkSize(), len, scratch), len, packed);
+      bulk.find(BSON("_id" << missing[i])).upsert().updateOne(
+        BSON("$set" << BSON("lastRef" << mongo::DATENOW) << "$setOnInsert" << data.obj()));
+    }
+
+    mongo::WriteResult result;
+    DB_TIMED(DB_UPDATE, bulk.execute(&mongo::WriteConcern::acknowledged, &result));
+  });
+
+  return names;
+}
+
+static SingleFlight<StoredChunk::ptr> blob_flights;
+
+StoredChunk::ptr fetch_blob(const std::string& blob) {
+  std::string key = "blob:" + blob;
+  StoredChunk::ptr cached = chunk_cache.get(key);
+  if (cached)
+    return cached;
+
+  return blob_flights.run(key, [&]() {
+    // Blobs are as immutable as chunks and follow --chunk-read-pref
+    auto sdc = make_ScopedDbConnection();
+    mongo::BSONObj blob_obj =
+      DB_TIMED(DB_FINDONE, sdc->conn().findOne(blobs_ns(),
+                                               routed_query(BSON("_id" << blob), chunks_read_pref),
+                                               NULL, routed_options(chunks_read_pref)));
+    if (blob_obj.isEmpty() && !chunks_read_pref.isEmpty())
+      blob_obj = DB_TIMED(DB_FINDONE, sdc->conn().findOne(blobs_ns(), BSON("_id" << blob)));
+    if (blob_obj.isEmpty())
+      return StoredChunk::ptr();
+
+    StoredChunk::ptr chunk = parse_stored_chunk(blob_obj);
+    if (chunk)
+      chunk_cache.put(key, chunk);
+    return chunk;
+  });
+}
+
+void start_blob_gc() {
+  std::thread(blob_gc_loop).detach();
+}
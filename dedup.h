@@ -0,0 +1,51 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEDUP_H
+#define __DEDUP_H
+
+#include <string>
+#include <vector>
+#include <mongo/client/dbclient.h>
+
+#include "local_gridfile.h"
+#include "chunk_cache.h"
+
+/* With --dedup, chunk documents hold no data. Each one names a blob by the
+   SHA-256 of its raw contents, and blobs live once in <prefix>.blobs:
+
+     chunks: { files_id, n, blob: "<sha256>" }
+     blobs:  { _id: "<sha256>", data, [codec, rawLength], lastRef }
+
+   Nothing is reference counted. Writers stamp lastRef on every blob they
+   use before inserting the chunks that point at it, and a background
+   sweep removes blobs that no chunk references and that haven't been
+   stamped for a grace period. Deleting a file is then just deleting its
+   chunks, and a crash at any point can only leave garbage behind. */
+
+//! Make sure every chunk of lgf exists as a blob, uploading only the
+//  ones the server doesn't have yet. Returns each chunk's blob name.
+std::vector<std::string> store_blobs(mongo::DBClientBase& client,
+                                     const LocalGridFile& lgf);
+
+//! Load a blob, from the chunk cache when possible.
+StoredChunk::ptr fetch_blob(const std::string& blob);
+
+//! Start the background blob sweep. Called from gridfs_init.
+void start_blob_gc();
+
+#endif
@@ -0,0 +1,408 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk_cache.h"
+#include "hash.h"
+
+DiskCache disk_cache;
+
+namespace {
+
+const char ENTRY_MAGIC[8] = {'G', 'F', 'S', 'C', 'H', 'U', 'N', 'K'};
+const char JOURNAL_MAGIC[8] = {'G', 'F', 'S', 'D', 'C', 'J', 'N', 'L'};
+
+struct entry_header {
+  char magic[8];
+  uint32_t key_len;
+  uint32_t codec;
+  uint64_t raw_len;
+  uint64_t data_len;
+  uint64_t checksum;  // xxh64 of the data, seeded with that of the key
+};
+
+/* A put records the entry's size on disk, a removal records 0. check
+   covers both so the tail of a journal torn by a crash is recognised. */
+struct journal_record {
+  uint64_t name;
+  uint64_t size;
+  uint64_t check;
+};
+
+uint64_t record_check(const journal_record& r) {
+  return xxh64(&r, offsetof(journal_record, check));
+}
+
+uint64_t entry_checksum(const std::string& key, const std::string& data) {
+  return xxh64(data.data(), data.size(), xxh64(key.data(), key.size()));
+}
+
+bool write_all(int fd, const void* buf, size_t len) {
+  const char* p = static_cast<const char*>(buf);
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool read_all(int fd, void* buf, size_t len) {
+  char* p = static_cast<char*>(buf);
+  while (len) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+std::atomic<unsigned> tmp_serial(0);
+
+}
+
+std::string DiskCache::entry_path(uint64_t name) const {
+  std::string hex = hex64(name);
+  return _dir + "/" + hex.substr(0, 2) + "/" + hex;
+}
+
+bool DiskCache::open(const std::string& dir, size_t capacity) {
+  std::lock_guard<std::mutex> guard(_lock);
+
+  // fuse_main changes to / when it daemonizes
+  char resolved[PATH_MAX];
+  if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    return false;
+  if (!realpath(dir.c_str(), resolved))
+    return false;
+  _dir = resolved;
+  _capacity = capacity;
+
+  for (int i = 0; i < 256; i++) {
+    std::string sub = _dir + "/" + hex64(i).substr(14);
+    if (mkdir(sub.c_str(), 0700) < 0 && errno != EEXIST)
+      return false;
+  }
+
+  // Files of puts a crash interrupted. Entries live a level down, so
+  // this only ever lists a few hundred names.
+  if (DIR* d = opendir(_dir.c_str())) {
+    while (struct dirent* e = readdir(d)) {
+      if (strncmp(e->d_name, "tmp.", 4) == 0)
+        unlink((_dir + "/" + e->d_name).c_str());
+    }
+    closedir(d);
+  }
+
+  _journal = ::open((_dir + "/journal").c_str(), O_RDWR | O_CREAT, 0600);
+  if (_journal < 0)
+    return false;
+  replay();
+
+  // Only a mount that didn't get to close() can have left entries the
+  // journal never heard of, so the walk is skipped otherwise
+  std::string marker = _dir + "/open";
+  if (access(marker.c_str(), F_OK) == 0)
+    sweep();
+  int fd = ::open(marker.c_str(), O_WRONLY | O_CREAT, 0600);
+  if (fd >= 0)
+    ::close(fd);
+
+  std::vector<uint64_t> victims;
+  evict(victims);
+  for (uint64_t name : victims)
+    unlink(entry_path(name).c_str());
+  if (_records > 2 * _index.size() + 4096)
+    compact();
+  return true;
+}
+
+void DiskCache::close() {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_journal < 0)
+    return;
+  fsync(_journal);
+  ::close(_journal);
+  _journal = -1;
+  unlink((_dir + "/open").c_str());
+}
+
+/* Remove entry files the journal doesn't list: puts a crash stopped
+   between their rename and their journal record. The size accounting
+   never saw them. */
+void DiskCache::sweep() {
+  for (int i = 0; i < 256; i++) {
+    std::string sub = _dir + "/" + hex64(i).substr(14);
+    DIR* d = opendir(sub.c_str());
+    if (!d)
+      continue;
+    while (struct dirent* e = readdir(d)) {
+      if (e->d_name[0] == '.')
+        continue;
+      char* end;
+      uint64_t name = strtoull(e->d_name, &end, 16);
+      if (*end || !_index.count(name))
+        unlink((sub + "/" + e->d_name).c_str());
+    }
+    closedir(d);
+  }
+}
+
+/* Rebuild the index from the journal, oldest record first, and cut off
+   whatever follows the last intact record. */
+void DiskCache::replay() {
+  char magic[sizeof(JOURNAL_MAGIC)];
+  if (!read_all(_journal, magic, sizeof(magic)) ||
+      memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) != 0) {
+    // New or unreadable: start over. Entry files it described are
+    // replaced as the same chunks are cached again.
+    ftruncate(_journal, 0);
+    lseek(_journal, 0, SEEK_SET);
+    write_all(_journal, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+    return;
+  }
+
+  off_t good = sizeof(JOURNAL_MAGIC);
+  std::vector<journal_record> block(4096);
+  bool torn = false;
+  while (!torn) {
+    ssize_t n = read(_journal, &block[0], block.size() * sizeof(journal_record));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    size_t count = n / sizeof(journal_record);
+    for (size_t i = 0; i < count; i++) {
+      const journal_record& r = block[i];
+      if (r.check != record_check(r)) {
+        torn = true;
+        break;
+      }
+      if (r.size)
+        link(r.name, r.size);
+      else
+        unlink_entry(r.name);
+      good += sizeof(journal_record);
+      _records++;
+    }
+    if (count * sizeof(journal_record) != (size_t)n)
+      break;
+  }
+
+  ftruncate(_journal, good);
+  lseek(_journal, good, SEEK_SET);
+}
+
+void DiskCache::append(uint64_t name, uint64_t size) {
+  journal_record r;
+  r.name = name;
+  r.size = size;
+  r.check = record_check(r);
+  // A short write leaves a torn record, which replay drops
+  write_all(_journal, &r, sizeof(r));
+  _records++;
+}
+
+/* Rewrite the journal as one put per live entry, least recently used
+   first, so replaying it also restores the current eviction order. */
+void DiskCache::compact() {
+  std::string tmp = _dir + "/journal.tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    return;
+
+  std::string out(JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  for (auto i = _lru.rbegin(); i != _lru.rend(); ++i) {
+    journal_record r;
+    r.name = i->first;
+    r.size = i->second;
+    r.check = record_check(r);
+    out.append(reinterpret_cast<const char*>(&r), sizeof(r));
+  }
+
+  if (!write_all(fd, out.data(), out.size()) || fsync(fd) < 0 ||
+      rename(tmp.c_str(), (_dir + "/journal").c_str()) < 0) {
+    ::close(fd);
+    unlink(tmp.c_str());
+    return;
+  }
+
+  ::close(_journal);
+  _journal = fd;
+  _records = _index.size();
+}
+
+void DiskCache::link(uint64_t name, uint64_t size) {
+  unlink_entry(name);
+  _lru.push_front(std::make_pair(name, size));
+  _index[name] = _lru.begin();
+  _size += size;
+}
+
+void DiskCache::unlink_entry(uint64_t name) {
+  auto i = _index.find(name);
+  if (i == _index.end())
+    return;
+  _size -= i->second->second;
+  _lru.erase(i->second);
+  _index.erase(i);
+}
+
+/* Forget an entry whose file turned out missing or damaged. */
+void DiskCache::drop(uint64_t name) {
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (!_index.count(name))
+      return;
+    unlink_entry(name);
+    append(name, 0);
+  }
+  unlink(entry_path(name).c_str());
+}
+
+void DiskCache::evict(std::vector<uint64_t>& victims) {
+  while (_size > _capacity && !_lru.empty()) {
+    uint64_t name = _lru.back().first;
+    unlink_entry(name);
+    append(name, 0);
+    victims.push_back(name);
+  }
+}
+
+StoredChunk::ptr DiskCache::get(const std::string& key) {
+  if (!enabled())
+    return StoredChunk::ptr();
+
+  uint64_t name = xxh64(key.data(), key.size());
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto i = _index.find(name);
+    if (i == _index.end())
+      return StoredChunk::ptr();
+    _lru.splice(_lru.begin(), _lru, i->second);
+  }
+
+  int fd = ::open(entry_path(name).c_str(), O_RDONLY);
+  if (fd < 0) {
+    drop(name);
+    return StoredChunk::ptr();
+  }
+
+  // The lengths in the header aren't checksummed, so they have to add
+  // up to the file's size before anything is allocated for them
+  struct stat st;
+  entry_header h;
+  std::string stored_key, data;
+  bool ok = fstat(fd, &st) == 0 &&
+            read_all(fd, &h, sizeof(h)) &&
+            memcmp(h.magic, ENTRY_MAGIC, sizeof(h.magic)) == 0 &&
+            h.codec <= CODEC_ZSTD && h.key_len < 4096 &&
+            h.data_len <= _capacity &&
+            sizeof(h) + h.key_len + h.data_len == (uint64_t)st.st_size;
+  if (ok) {
+    stored_key.resize(h.key_len);
+    ok = read_all(fd, &stored_key[0], h.key_len);
+  }
+  // Another key with the same hash; it stays, this one just misses
+  if (ok && stored_key != key) {
+    ::close(fd);
+    return StoredChunk::ptr();
+  }
+  if (ok) {
+    data.resize(h.data_len);
+    ok = read_all(fd, &data[0], h.data_len) && h.checksum == entry_checksum(key, data);
+  }
+  ::close(fd);
+
+  if (!ok) {
+    drop(name);
+    return StoredChunk::ptr();
+  }
+
+  auto chunk = std::make_shared<StoredChunk>();
+  chunk->data.swap(data);
+  chunk->codec = (chunk_codec)h.codec;
+  chunk->raw_len = h.raw_len;
+  return chunk;
+}
+
+void DiskCache::put(const std::string& key, const StoredChunk& chunk) {
+  if (!enabled() || !chunk.blob.empty())
+    return;
+
+  uint64_t name = xxh64(key.data(), key.size());
+  uint64_t size = sizeof(entry_header) + key.size() + chunk.data.size();
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    if (size > _capacity || _index.count(name))
+      return;
+  }
+
+  entry_header h;
+  memcpy(h.magic, ENTRY_MAGIC, sizeof(h.magic));
+  h.key_len = key.size();
+  h.codec = chunk.codec;
+  h.raw_len = chunk.raw_len;
+  h.data_len = chunk.data.size();
+  h.checksum = entry_checksum(key, chunk.data);
+
+  // Written aside and renamed into place, so a reader never sees half a
+  // file. A crash before the journal record leaves an unlisted file,
+  // which the next open sweeps away.
+  std::string tmp = _dir + "/tmp." + hex64(name) + "." + std::to_string(tmp_serial++);
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0)
+    return;
+  bool ok = write_all(fd, &h, sizeof(h)) &&
+            write_all(fd, key.data(), key.size()) &&
+            write_all(fd, chunk.data.data(), chunk.data.size());
+  ok = ::close(fd) == 0 && ok;
+  if (!ok || rename(tmp.c_str(), entry_path(name).c_str()) < 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+
+  std::vector<uint64_t> victims;
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    link(name, size);
+    append(name, size);
+    evict(victims);
+    if (_records > 2 * _index.size() + 4096)
+      compact();
+  }
+  for (uint64_t victim : victims)
+    unlink(entry_path(victim).c_str());
+}
@@ -0,0 +1,76 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DISK_CACHE_H
+#define __DISK_CACHE_H
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+#include "chunk_cache.h"
+
+/* Second tier below ChunkCache, kept in a directory on local disk so it
+   survives remounts. Each chunk is its own file named after the hash of
+   its key and checked against a checksum when read back. Which entries
+   exist, and their order, is kept in an append-only journal that is
+   replayed at startup instead of walking the directory. */
+class DiskCache {
+public:
+  DiskCache() : _journal(-1), _capacity(0), _size(0), _records(0) {}
+
+  //! Use dir, creating it if needed, and keep it under capacity bytes.
+  //  Returns false if the directory or its journal can't be used.
+  bool open(const std::string& dir, size_t capacity);
+  bool enabled() const { return _journal >= 0; }
+
+  //! Sync the journal and mark the directory as cleanly closed. From
+  //  gridfs_destroy.
+  void close();
+
+  StoredChunk::ptr get(const std::string& key);
+
+  //! Only expanded chunks belong here, never blob references.
+  void put(const std::string& key, const StoredChunk& chunk);
+
+private:
+  typedef std::list<std::pair<uint64_t, uint64_t> > lru_list;
+
+  std::string entry_path(uint64_t name) const;
+  void replay();
+  void sweep();
+  void append(uint64_t name, uint64_t size);
+  void compact();
+  void link(uint64_t name, uint64_t size);
+  void unlink_entry(uint64_t name);
+  void drop(uint64_t name);
+  void evict(std::vector<uint64_t>& victims);
+
+  std::mutex _lock;
+  std::string _dir;
+  int _journal;
+  size_t _capacity, _size, _records;
+  lru_list _lru;
+  std::unordered_map<uint64_t, lru_list::iterator> _index;
+};
+
+extern DiskCache disk_cache;
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <thread>
+
+#include "executor.h"
+
+// Never destroyed: its workers are still parked on it at exit
+Executor& io_executor = *new Executor();
+
+namespace {
+
+// Index of the worker running on this thread, -1 elsewhere
+thread_local int worker_index = -1;
+thread_local const Executor* worker_of = NULL;
+
+}
+
+void Executor::start(unsigned int threads) {
+  for (unsigned int i = 0; i < threads; i++)
+    _queues.push_back(std::unique_ptr<Queue>(new Queue()));
+  for (unsigned int i = 0; i < threads; i++)
+    std::thread(&Executor::run, this, (int)i).detach();
+}
+
+bool Executor::on_worker() const {
+  return worker_of == this;
+}
+
+void Executor::push(task t) {
+  if (_queues.empty()) {
+    t();
+    return;
+  }
+
+  // Counted first so _pending never drops below the queued tasks
+  _pending++;
+  int self = on_worker() ? worker_index : -1;
+  Queue& q = *_queues[self >= 0 ? self : _next++ % _queues.size()];
+  {
+    std::lock_guard<std::mutex> guard(q.lock);
+    q.tasks.push_back(std::move(t));
+  }
+
+  // Taking the lock orders this against a worker checking _pending
+  // on its way to sleep.
+  { std::lock_guard<std::mutex> guard(_idle_lock); }
+  _wake.notify_one();
+}
+
+bool Executor::take(int self, task& t) {
+  size_t n = _queues.size();
+  if (self >= 0) {
+    Queue& own = *_queues[self];
+    std::lock_guard<std::mutex> guard(own.lock);
+    if (!own.tasks.empty()) {
+      t = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      _pending--;
+      return true;
+    }
+  }
+
+  for (size_t i = 1; i <= n; i++) {
+    Queue& victim = *_queues[(self + i) % n];
+    std::lock_guard<std::mutex> guard(victim.lock);
+    if (!victim.tasks.empty()) {
+      t = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      _pending--;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+bool Executor::run_one() {
+  task t;
+  if (!take(worker_index, t))
+    return false;
+  t();
+  return true;
+}
+
+void Executor::run(int self) {
+  worker_index = self;
+  worker_of = this;
+
+  for (;;) {
+    task t;
+    if (take(self, t)) {
+      t();
+      continue;
+    }
+
+    std::unique_lock<std::mutex> guard(_idle_lock);
+    _wake.wait(guard, [this]() { return _pending > 0; });
+  }
+}
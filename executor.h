@@ -0,0 +1,94 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __EXECUTOR_H
+#define __EXECUTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
+
+/* Worker pool for storage round trips. The driver is blocking, so the
+   only way to have more requests in flight than FUSE has threads is to
+   hand them to threads of our own. Each worker owns a deque. Tasks
+   submitted from a worker go on its own deque and it takes them back
+   LIFO. Tasks from anywhere else are dealt round robin. Idle workers
+   steal the oldest task from the others.
+
+   FUSE threads submit and wait on the future. Tasks may submit and wait
+   too: wait() on a worker runs other queued tasks until the future is
+   ready, so nested fan-out can't tie up every worker. */
+class Executor {
+public:
+  Executor() : _next(0), _pending(0) {}
+
+  //! Start the workers. Until then, and with 0 threads, submit runs
+  //  the task before returning.
+  void start(unsigned int threads);
+
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> submit(F f) {
+    typedef typename std::result_of<F()>::type R;
+    auto task = std::make_shared<std::packaged_task<R()> >(std::move(f));
+    std::future<R> result = task->get_future();
+    push([task]() { (*task)(); });
+    return result;
+  }
+
+  template <typename T>
+  T wait(std::future<T>& f) {
+    if (on_worker())
+      while (f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        if (!run_one())
+          f.wait_for(std::chrono::microseconds(200));
+    return f.get();
+  }
+
+  //! Tasks queued and not yet started.
+  size_t pending() const { return _pending; }
+
+private:
+  typedef std::function<void()> task;
+
+  struct Queue {
+    std::mutex lock;
+    std::deque<task> tasks;
+  };
+
+  void push(task t);
+  bool take(int self, task& t);
+  bool run_one();
+  bool on_worker() const;
+  void run(int self);
+
+  std::vector<std::unique_ptr<Queue> > _queues;
+  std::atomic<unsigned int> _next;
+  std::atomic<size_t> _pending;
+  std::mutex _idle_lock;
+  std::condition_variable _wake;
+};
+
+extern Executor& io_executor;
+
+#endif
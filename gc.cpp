@@ -0,0 +1,321 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <mongo/bson/bson.h>
+
+#include "gc.h"
+#include "operations.h"
+#include "options.h"
+#include "stats.h"
+#include "utils.h"
+
+namespace {
+
+// Chunks deleted per remove
+const int BATCH = 100;
+// How often the collector looks for work when nobody wakes it
+const int IDLE_SECONDS = 10;
+// Orphans found by the scan may belong to a flush that hasn't inserted
+// its files document yet.
+const int ORPHAN_GRACE_SECONDS = 60 * 60;
+// One orphan scan across all mounts per this long, and how often a
+// mount checks whether it is due
+const int ORPHAN_SCAN_SECONDS = 24 * 60 * 60;
+const int ORPHAN_CHECK_SECONDS = 60 * 60;
+// The document in <prefix>.gc that records the last orphan scan. It has
+// no notBefore, which keeps it out of the collector's way.
+const char ORPHAN_SCAN_ID[] = "orphanScan";
+
+std::mutex wake_lock;
+std::condition_variable wake;
+
+std::atomic<unsigned long long> pending_files(0);
+std::atomic<unsigned long long> pending_chunks(0);
+std::atomic<unsigned long long> collected_files(0);
+std::atomic<unsigned long long> collected_chunks(0);
+
+std::string gc_ns() { return db_name() + ".gc"; }
+
+// Open versions, keyed like the memory backend keys files ids. Each
+// holds {_id: <files _id>} and a count.
+std::mutex held_lock;
+std::map<std::string, std::pair<mongo::BSONObj, int> > held;
+
+std::string held_key(const mongo::BSONElement& id) {
+  return id.toString(false);
+}
+
+/* Push the tombstones of held versions out past the next few passes,
+   for the collectors of other mounts. Ours skips them anyway. */
+void extend_held(mongo::DBClientBase& client) {
+  mongo::BSONArrayBuilder ids;
+  {
+    std::lock_guard<std::mutex> guard(held_lock);
+    if (held.empty())
+      return;
+    for (auto& h : held)
+      ids.append(h.second.first["_id"]);
+  }
+
+  int seconds = std::max<int>(gridfs_options.retire_delay, 3 * IDLE_SECONDS);
+  mongo::Date_t not_before(mongo_time() + unix_time_to_mongo_time(seconds));
+  DB_TIMED(DB_UPDATE, client.update(gc_ns(),
+                                    BSON("_id" << BSON("$in" << ids.arr())),
+                                    BSON("$set" << BSON("notBefore" << not_before)),
+                                    false, true));
+}
+
+long long num_chunks(const mongo::BSONObj& file_obj) {
+  long long length = file_obj["length"].numberLong();
+  long long chunk_size = file_obj["chunkSize"].numberLong();
+  if (length <= 0 || chunk_size <= 0)
+    return 0;
+  return (length + chunk_size - 1) / chunk_size;
+}
+
+void throttle(int chunks) {
+  unsigned int rate = gridfs_options.gc_rate ? gridfs_options.gc_rate : 1000;
+  std::this_thread::sleep_for(std::chrono::milliseconds(chunks * 1000LL / rate));
+}
+
+/* Take the orphan scan if no mount has run one for ORPHAN_SCAN_SECONDS.
+   The upsert of a fresh record collides with its _id and fails, so only
+   one mount wins a stale one. */
+bool claim_orphan_scan(mongo::DBClientBase& client) {
+  long long now = mongo_time();
+  mongo::Date_t cutoff(now - unix_time_to_mongo_time(ORPHAN_SCAN_SECONDS));
+  mongo::BSONObj info;
+  DB_TIMED(DB_UPDATE, client.runCommand(gridfs_options.db,
+                                        BSON("findAndModify" << std::string(gridfs_options.prefix) + ".gc"
+                                             << "query" << BSON("_id" << ORPHAN_SCAN_ID
+                                                                << "lastRun" << BSON("$lt" << cutoff))
+                                             << "update" << BSON("$set" << BSON("lastRun" << mongo::Date_t(now)))
+                                             << "upsert" << true),
+                                        info));
+  return info["ok"].trueValue();
+}
+
+/* Tombstone chunks whose files document is gone without one. The whole
+   result is read through the cursor, and tombstones go in at --gc-rate
+   so the scan doesn't compete with the mount's own traffic. */
+void scan_orphans(mongo::DBClientBase& client) {
+  std::string files = std::string(gridfs_options.prefix) + ".files";
+  mongo::BSONObj pipeline = BSON_ARRAY(
+    BSON("$group" << BSON("_id" << "$files_id" << "chunks" << BSON("$sum" << 1))) <<
+    BSON("$lookup" << BSON("from" << files << "localField" << "_id"
+                           << "foreignField" << "_id" << "as" << "file")) <<
+    BSON("$match" << BSON("file" << BSON("$size" << 0))) <<
+    BSON("$project" << BSON("chunks" << 1)));
+  mongo::BSONObj options = BSON("allowDiskUse" << true);
+
+  std::unique_ptr<mongo::DBClientCursor> cursor =
+    DB_TIMED(DB_COMMAND, client.aggregate(db_name() + ".chunks", pipeline, &options));
+
+  mongo::Date_t not_before(mongo_time() + unix_time_to_mongo_time(ORPHAN_GRACE_SECONDS));
+  unsigned long long found = 0;
+  while (cursor->more()) {
+    mongo::BSONObj orphan = cursor->nextSafe();
+    DB_TIMED(DB_UPDATE, client.update(gc_ns(),
+                                      BSON("_id" << orphan["_id"]),
+                                      BSON("$setOnInsert" << BSON("chunks" << orphan["chunks"].numberLong()
+                                                                  << "done" << 0LL
+                                                                  << "notBefore" << not_before)),
+                                      true));
+    found++;
+    throttle(1);
+  }
+
+  if (found)
+    fprintf(stderr, "chunk gc: orphan scan found %llu file(s) without a files document\n", found);
+}
+
+void collect(mongo::DBClientBase& client, const mongo::BSONObj& tomb) {
+  mongo::BSONElement id = tomb["_id"];
+
+  mongo::BSONObj proj = BSON("_id" << 1);
+  if (!DB_TIMED(DB_FINDONE, client.findOne(db_name() + ".files", BSON("_id" << id), &proj)).isEmpty()) {
+    DB_TIMED(DB_REMOVE, client.remove(gc_ns(), BSON("_id" << id), true));
+    return;
+  }
+
+  long long chunks = tomb["chunks"].numberLong();
+  for (long long n = tomb["done"].numberLong(); n < chunks; n += BATCH) {
+    DB_TIMED(DB_REMOVE, client.remove(db_name() + ".chunks",
+                                      BSON("files_id" << id << "n" << BSON("$gte" << n << "$lt" << n + BATCH))));
+    DB_TIMED(DB_UPDATE, client.update(gc_ns(), BSON("_id" << id),
+                                      BSON("$set" << BSON("done" << n + BATCH))));
+
+    int removed = std::min<long long>(BATCH, chunks - n);
+    collected_chunks += removed;
+    pending_chunks -= std::min<unsigned long long>(removed, pending_chunks);
+    throttle(removed);
+  }
+
+  // Anything past the recorded chunk count
+  DB_TIMED(DB_REMOVE, client.remove(db_name() + ".chunks", BSON("files_id" << id)));
+  DB_TIMED(DB_REMOVE, client.remove(gc_ns(), BSON("_id" << id), true));
+  collected_files++;
+}
+
+void gc_loop() {
+  time_t next_orphan_check = 0;
+  for (;;) {
+    try {
+      auto sdc = make_ScopedDbConnection();
+      mongo::DBClientBase& client = sdc->conn();
+
+      extend_held(client);
+
+      if (time(NULL) >= next_orphan_check) {
+        next_orphan_check = time(NULL) + ORPHAN_CHECK_SECONDS;
+        if (claim_orphan_scan(client))
+          scan_orphans(client);
+      }
+
+      std::vector<mongo::BSONObj> due;
+      unsigned long long files = 0, chunks = 0;
+      long long now = mongo_time();
+      std::unique_ptr<mongo::DBClientCursor> cursor =
+        DB_TIMED(DB_QUERY, client.query(gc_ns(), BSON("notBefore" << BSON("$exists" << true))));
+      while (cursor->more()) {
+        mongo::BSONObj tomb = cursor->next().getOwned();
+        files++;
+        chunks += tomb["chunks"].numberLong() - tomb["done"].numberLong();
+        if ((long long)tomb["notBefore"].date().millis <= now &&
+            !stored_file_held(tomb["_id"]))
+          due.push_back(tomb);
+      }
+      pending_files = files;
+      pending_chunks = chunks;
+
+      for (auto& tomb : due) {
+        collect(client, tomb);
+        if (pending_files)
+          pending_files--;
+      }
+    } catch (const std::exception& e) {
+      fprintf(stderr, "chunk gc: %s\n", e.what());
+    }
+
+    std::unique_lock<std::mutex> guard(wake_lock);
+    wake.wait_for(guard, std::chrono::seconds(IDLE_SECONDS));
+  }
+}
+
+}
+
+void retire_stored_file(mongo::DBClientBase& client, const mongo::BSONObj& file_obj,
+                        int delay_seconds) {
+  long long chunks = num_chunks(file_obj);
+  if (chunks) {
+    mongo::Date_t not_before(mongo_time() + unix_time_to_mongo_time(delay_seconds));
+    DB_TIMED(DB_UPDATE, client.update(gc_ns(),
+                                      BSON("_id" << file_obj["_id"]),
+                                      BSON("$set" << BSON("chunks" << chunks
+                                                          << "done" << 0LL
+                                                          << "notBefore" << not_before)),
+                                      true));
+  }
+
+  DB_TIMED(DB_REMOVE, client.remove(db_name() + ".files", BSON("_id" << file_obj["_id"]), true));
+
+  if (chunks && !delay_seconds)
+    wake.notify_one();
+}
+
+int remove_stored_file(mongo::DBClientBase& client, const std::string& path) {
+  mongo::BSONObj proj = BSON("_id" << 1 << "length" << 1 << "chunkSize" << 1);
+  std::unique_ptr<mongo::DBClientCursor> cursor =
+    DB_TIMED(DB_QUERY, client.query(db_name() + ".files", BSON("filename" << path), 0, 0, &proj));
+
+  std::vector<mongo::BSONObj> found;
+  while (cursor->more())
+    found.push_back(cursor->next().getOwned());
+
+  if (found.empty())
+    return -ENOENT;
+
+  for (auto& file_obj : found)
+    retire_stored_file(client, file_obj, gridfs_options.retire_delay);
+
+  return 0;
+}
+
+void replace_stored_file(mongo::DBClientBase& client, const mongo::BSONObj& file_obj,
+                         int delay_seconds) {
+  DB_TIMED(DB_INSERT, client.insert(db_name() + ".files", file_obj));
+
+  // Only older versions: one stored since by someone else stays current
+  mongo::BSONObj proj = BSON("_id" << 1 << "length" << 1 << "chunkSize" << 1);
+  std::unique_ptr<mongo::DBClientCursor> cursor =
+    DB_TIMED(DB_QUERY, client.query(db_name() + ".files",
+                                    BSON("filename" << file_obj["filename"]
+                                         << "_id" << BSON("$ne" << file_obj["_id"])
+                                         << "$or" << BSON_ARRAY(
+                                              BSON("version" << BSON("$lt" << file_obj["version"])) <<
+                                              BSON("version" << BSON("$exists" << false)))),
+                                    0, 0, &proj));
+
+  std::vector<mongo::BSONObj> found;
+  while (cursor->more())
+    found.push_back(cursor->next().getOwned());
+
+  for (auto& old : found)
+    retire_stored_file(client, old, delay_seconds);
+}
+
+void hold_stored_file(const mongo::BSONElement& id) {
+  std::lock_guard<std::mutex> guard(held_lock);
+  auto& h = held[held_key(id)];
+  if (!h.second++)
+    h.first = BSON("_id" << id);
+}
+
+void release_stored_file(const mongo::BSONElement& id) {
+  std::lock_guard<std::mutex> guard(held_lock);
+  auto h = held.find(held_key(id));
+  if (h != held.end() && !--h->second.second)
+    held.erase(h);
+}
+
+bool stored_file_held(const mongo::BSONElement& id) {
+  std::lock_guard<std::mutex> guard(held_lock);
+  return held.count(held_key(id)) > 0;
+}
+
+gc_stats chunk_gc_stats() {
+  gc_stats s;
+  s.pending_files = pending_files;
+  s.pending_chunks = pending_chunks;
+  s.collected_files = collected_files;
+  s.collected_chunks = collected_chunks;
+  return s;
+}
+
+void start_chunk_gc() {
+  std::thread(gc_loop).detach();
+}
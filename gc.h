@@ -0,0 +1,70 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __GC_H
+#define __GC_H
+
+#include <string>
+#include <mongo/client/dbclient.h>
+
+/* Removing a file only deletes its files document. Before that, a
+   tombstone { _id: <files _id>, chunks, notBefore } goes into
+   <prefix>.gc, and a background collector deletes the chunks in
+   throttled batches. Tombstones outlive restarts. Once a day, one of the
+   mounts' collectors also scans for chunks whose files document is gone
+   without a tombstone, and adds one. The collector never touches chunks
+   while a files document with their files_id exists, which makes a
+   stale tombstone harmless. */
+
+//! Hide every files document named path and queue their chunks for
+//  collection after --retire-delay. Returns 0, or -ENOENT when there
+//  was no such file.
+int remove_stored_file(mongo::DBClientBase& client, const std::string& path);
+
+//! Tombstone and remove a single files document. Its chunks stay
+//  readable for at least delay_seconds.
+void retire_stored_file(mongo::DBClientBase& client, const mongo::BSONObj& file_obj,
+                        int delay_seconds = 0);
+
+//! Insert file_obj, which makes it the current version of its filename,
+//  then retire every files document of that name with a lower version
+//  or none (see Backend::find_file).
+void replace_stored_file(mongo::DBClientBase& client, const mongo::BSONObj& file_obj,
+                         int delay_seconds);
+
+/* Readers keep the version they opened. While a handle on it is open,
+   this mount keeps pushing its tombstone's notBefore out, so no
+   collector takes its chunks, and the memory backend keeps them too.
+   Holds are counted per files _id. */
+void hold_stored_file(const mongo::BSONElement& id);
+void release_stored_file(const mongo::BSONElement& id);
+bool stored_file_held(const mongo::BSONElement& id);
+
+struct gc_stats {
+  unsigned long long pending_files;
+  unsigned long long pending_chunks;
+  unsigned long long collected_files;
+  unsigned long long collected_chunks;
+};
+
+//! Backlog as of the collector's last pass, and totals since mount.
+gc_stats chunk_gc_stats();
+
+//! Start the collector. Called from gridfs_init.
+void start_chunk_gc();
+
+#endif
@@ -0,0 +1,31 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HASH_H
+#define __HASH_H
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+
+//! XXH64 of a single buffer.
+uint64_t xxh64(const void* data, size_t len, uint64_t seed = 0);
+
+//! 64 bit value as 16 lower case hex digits.
+std::string hex64(uint64_t v);
+
+#endif
@@ -0,0 +1,240 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+#include <grp.h>
+#include <pwd.h>
+#include <unistd.h>
+
+#include "idmap.h"
+#include "options.h"
+#include "stats.h"
+
+namespace {
+
+uint64_t timeout_ns = 600 * 1000000000ULL;
+
+/* One direction of one mapping. Missing answers are cached as well. */
+template <typename K, typename V>
+class TimedMap {
+public:
+  bool get(const K& key, bool* found, V* value) {
+    std::lock_guard<std::mutex> guard(_lock);
+    auto i = _entries.find(key);
+    if (i == _entries.end() || i->second.expires < now_ns())
+      return false;
+    *found = i->second.found;
+    *value = i->second.value;
+    return true;
+  }
+
+  void put(const K& key, bool found, const V& value) {
+    std::lock_guard<std::mutex> guard(_lock);
+    // Only a bound on memory
+    if (_entries.size() > 65536)
+      _entries.clear();
+    entry& e = _entries[key];
+    e.found = found;
+    e.value = value;
+    e.expires = now_ns() + timeout_ns;
+  }
+
+private:
+  struct entry {
+    bool found;
+    V value;
+    uint64_t expires;
+  };
+
+  std::mutex _lock;
+  std::unordered_map<K, entry> _entries;
+};
+
+TimedMap<uid_t, std::string> user_names;
+TimedMap<std::string, uid_t> user_ids;
+TimedMap<gid_t, std::string> group_names;
+TimedMap<std::string, gid_t> group_ids;
+
+/* Call a getpw*_r/getgr*_r function with a buffer that grows until the
+   entry fits. Returns 0 and sets *result to the entry, or to NULL when
+   there is no such entry, or returns the error the lookup failed with.
+   Only the first two are answers worth caching. */
+template <typename Entry, typename Lookup>
+int nss_lookup(Entry* entry, std::vector<char>& buf, Entry** result, Lookup lookup) {
+  buf.resize(1024);
+  for (;;) {
+    *result = NULL;
+    int err = lookup(entry, &buf[0], buf.size(), result);
+    if (err == ERANGE && buf.size() < (1 << 20)) {
+      buf.resize(buf.size() * 2);
+      continue;
+    }
+    if (err)
+      *result = NULL;
+    return err;
+  }
+}
+
+// A lookup in one direction answers the other as well
+void remember_user(uid_t uid, const std::string& name) {
+  user_names.put(uid, true, name);
+  user_ids.put(name, true, uid);
+}
+
+void remember_group(gid_t gid, const std::string& name) {
+  group_names.put(gid, true, name);
+  group_ids.put(name, true, gid);
+}
+
+}
+
+void set_idmap_timeout(unsigned seconds) {
+  timeout_ns = seconds * 1000000000ULL;
+}
+
+void preload_idmap() {
+  setpwent();
+  while (passwd* pw = getpwent())
+    remember_user(pw->pw_uid, pw->pw_name);
+  endpwent();
+
+  setgrent();
+  while (group* gr = getgrent())
+    remember_group(gr->gr_gid, gr->gr_name);
+  endgrent();
+}
+
+bool user_name(uid_t uid, std::string* name) {
+  bool found;
+  if (user_names.get(uid, &found, name))
+    return found;
+
+  passwd pw;
+  std::vector<char> buf;
+  passwd* result;
+  int err = nss_lookup(&pw, buf, &result, [uid](passwd* p, char* b, size_t n, passwd** r) {
+    return getpwuid_r(uid, p, b, n, r);
+  });
+  if (!result) {
+    if (err == 0)
+      user_names.put(uid, false, std::string());
+    return false;
+  }
+
+  *name = result->pw_name;
+  remember_user(uid, *name);
+  return true;
+}
+
+bool user_id(const std::string& name, uid_t* uid) {
+  bool found;
+  if (user_ids.get(name, &found, uid))
+    return found;
+
+  passwd pw;
+  std::vector<char> buf;
+  passwd* result;
+  int err = nss_lookup(&pw, buf, &result, [&name](passwd* p, char* b, size_t n, passwd** r) {
+    return getpwnam_r(name.c_str(), p, b, n, r);
+  });
+  if (!result) {
+    if (err == 0)
+      user_ids.put(name, false, 0);
+    return false;
+  }
+
+  *uid = result->pw_uid;
+  remember_user(*uid, name);
+  return true;
+}
+
+bool group_name(gid_t gid, std::string* name) {
+  bool found;
+  if (group_names.get(gid, &found, name))
+    return found;
+
+  group gr;
+  std::vector<char> buf;
+  group* result;
+  int err = nss_lookup(&gr, buf, &result, [gid](group* g, char* b, size_t n, group** r) {
+    return getgrgid_r(gid, g, b, n, r);
+  });
+  if (!result) {
+    if (err == 0)
+      group_names.put(gid, false, std::string());
+    return false;
+  }
+
+  *name = result->gr_name;
+  remember_group(gid, *name);
+  return true;
+}
+
+bool group_id(const std::string& name, gid_t* gid) {
+  bool found;
+  if (group_ids.get(name, &found, gid))
+    return found;
+
+  group gr;
+  std::vector<char> buf;
+  group* result;
+  int err = nss_lookup(&gr, buf, &result, [&name](group* g, char* b, size_t n, group** r) {
+    return getgrnam_r(name.c_str(), g, b, n, r);
+  });
+  if (!result) {
+    if (err == 0)
+      group_ids.put(name, false, 0);
+    return false;
+  }
+
+  *gid = result->gr_gid;
+  remember_group(*gid, name);
+  return true;
+}
+
+void append_owner(mongo::BSONObjBuilder& b, uid_t uid, gid_t gid) {
+  std::string name;
+  if (uid != (uid_t)-1) {
+    if (user_name(uid, &name))
+      b << "owner" << name;
+    if (gridfs_options.store_ids)
+      b << "uid" << (long long)uid;
+  }
+  if (gid != (gid_t)-1) {
+    if (group_name(gid, &name))
+      b << "group" << name;
+    if (gridfs_options.store_ids)
+      b << "gid" << (long long)gid;
+  }
+}
+
+void file_owner(const mongo::BSONObj& file_obj, uid_t* uid, gid_t* gid) {
+  // The numbers are only trusted when this mount writes them too; hosts
+  // that don't share an id space still agree on the names
+  if (gridfs_options.store_ids && file_obj["uid"].isNumber())
+    *uid = file_obj["uid"].numberLong();
+  else if (file_obj.hasField("owner"))
+    user_id(file_obj["owner"].str(), uid);
+
+  if (gridfs_options.store_ids && file_obj["gid"].isNumber())
+    *gid = file_obj["gid"].numberLong();
+  else if (file_obj.hasField("group"))
+    group_id(file_obj["group"].str(), gid);
+}
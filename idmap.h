@@ -0,0 +1,51 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __IDMAP_H
+#define __IDMAP_H
+
+#include <string>
+#include <sys/types.h>
+
+#include <mongo/bson/bson.h>
+
+/* Users and groups are stored by name, so every stat turns names into
+   ids and every write turns ids into names. With NSS on LDAP or SSSD
+   each of those can be a network call, so answers, including that there
+   is no such user, are kept for --idmap-timeout seconds. Lookups use
+   the reentrant getpw*_r/getgr*_r calls and may come from any thread. */
+
+void set_idmap_timeout(unsigned seconds);
+
+//! Resolve every user and group NSS will enumerate, for --idmap-preload.
+//  Runs before any other thread exists.
+void preload_idmap();
+
+bool user_name(uid_t uid, std::string* name);
+bool user_id(const std::string& name, uid_t* uid);
+bool group_name(gid_t gid, std::string* name);
+bool group_id(const std::string& name, gid_t* gid);
+
+//! owner and group fields naming uid and gid, plus numeric uid and gid
+//  with --store-ids. (uid_t)-1 and (gid_t)-1 are left out, as in chown.
+void append_owner(mongo::BSONObjBuilder& b, uid_t uid, gid_t gid);
+
+//! Set uid and gid from a files document's owner and group, leaving
+//  either alone if the document has nothing this host can resolve.
+void file_owner(const mongo::BSONObj& file_obj, uid_t* uid, gid_t* gid);
+
+#endif
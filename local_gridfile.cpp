@@ -1,37 +1,265 @@
 #include "local_gridfile.h"
+#include "operations.h"
+#include "executor.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 
-int LocalGridFile::write(const char *buf, size_t nbyte, off_t offset) {
+// 16MB of idle buffers at most
+const size_t POOLED_CHUNKS = 64;
+
+ChunkPool chunk_pool;
+
+char* ChunkPool::get(size_t size) {
+  if (size == DEFAULT_CHUNK_SIZE) {
+    lock_guard<mutex> guard(_lock);
+    if (!_free.empty()) {
+      char* buf = _free.back();
+      _free.pop_back();
+      return buf;
+    }
+  }
+  return new char[size];
+}
+
+void ChunkPool::put(char* buf, size_t size) {
+  if (size == DEFAULT_CHUNK_SIZE) {
+    lock_guard<mutex> guard(_lock);
+    if (_free.size() < POOLED_CHUNKS) {
+      _free.push_back(buf);
+      return;
+    }
+  }
+  delete[] buf;
+}
+
+WriteBudget write_budget;
+
+bool WriteBudget::set_spill_dir(const std::string& dir) {
+  // FUSE changes to / once it daemonizes
+  char resolved[PATH_MAX];
+  if (!realpath(dir.c_str(), resolved))
+    return false;
+  _dir = resolved;
+  return true;
+}
+
+void WriteBudget::track(const std::shared_ptr<LocalGridFile>& lgf) {
+  lock_guard<mutex> guard(_lock);
+  _files.erase(remove_if(_files.begin(), _files.end(),
+                         [](const weak_ptr<LocalGridFile>& f) { return f.expired(); }),
+               _files.end());
+  _files.push_back(lgf);
+}
+
+void WriteBudget::charge(size_t bytes) {
+  {
+    lock_guard<mutex> guard(_lock);
+    _bytes += bytes;
+    _peak = max(_peak, _bytes);
+    if (!_capacity || _bytes <= _capacity / 4 * 3 || !begin_spill())
+      return;
+  }
+  io_executor.submit([this]() { spill(); });
+}
+
+void WriteBudget::release(size_t bytes) {
+  {
+    lock_guard<mutex> guard(_lock);
+    _bytes -= bytes;
+  }
+  _room.notify_all();
+}
+
+void WriteBudget::wait_for_room() {
+  unique_lock<mutex> guard(_lock);
+  if (!_capacity || _bytes < _capacity)
+    return;
+  _waits++;
+  if (begin_spill()) {
+    guard.unlock();
+    io_executor.submit([this]() { spill(); });
+    guard.lock();
+  }
+  _room.wait(guard, [this]() { return _bytes < _capacity || _stalled; });
+}
+
+int WriteBudget::spill_file() {
+  std::string name = (_dir.empty() ? "/tmp" : _dir) + "/gridfs-spill.XXXXXX";
+  std::vector<char> path(name.begin(), name.end());
+  path.push_back('\0');
+  int fd = mkstemp(path.data());
+  if (fd >= 0)
+    unlink(path.data());
+  return fd;
+}
+
+WriteBudget::usage WriteBudget::stats() const {
+  lock_guard<mutex> guard(_lock);
+  usage u = { _bytes, _peak, _capacity, _spilled, _waits };
+  return u;
+}
+
+void WriteBudget::reset_stats() {
+  lock_guard<mutex> guard(_lock);
+  _peak = _bytes;
+  _spilled = 0;
+  _waits = 0;
+}
+
+// Called with _lock held. True when the caller has to start the pass.
+bool WriteBudget::begin_spill() {
+  if (_spilling)
+    return false;
+  _spilling = true;
+  _stalled = false;
+  return true;
+}
+
+void WriteBudget::spill() {
+  std::vector<LocalGridFile::ptr> files;
+  {
+    lock_guard<mutex> guard(_lock);
+    for (auto& f : _files)
+      if (LocalGridFile::ptr lgf = f.lock())
+        files.push_back(lgf);
+  }
+  sort(files.begin(), files.end(), [](const LocalGridFile::ptr& a, const LocalGridFile::ptr& b) {
+    return a->resident() > b->resident();
+  });
+
+  size_t freed = 0;
+  for (auto& lgf : files) {
+    {
+      lock_guard<mutex> guard(_lock);
+      if (_bytes <= _capacity / 2)
+        break;
+    }
+    freed += lgf->spill();
+  }
+
+  {
+    lock_guard<mutex> guard(_lock);
+    _spilling = false;
+    _spilled += freed;
+    // What is left is pinned by uploads, or the disk is full. Rather
+    // than hang the writers, let them run over until memory is freed.
+    if (_bytes >= _capacity)
+      _stalled = true;
+  }
+  _room.notify_all();
+}
+
+LocalGridFile::~LocalGridFile() {
+  for (auto i : _chunks) {
+    if (i)
+      chunk_pool.put(i, _chunkSize);
+  }
+  write_budget.release(_resident);
+  if (_spill_fd >= 0)
+    close(_spill_fd);
+}
+
+char* LocalGridFile::new_chunk() {
+  // Pooled buffers hold whatever the last file left in them
+  char* buf = chunk_pool.get(_chunkSize);
+  memset(buf, 0, _chunkSize);
+  _resident += _chunkSize;
+  write_budget.charge(_chunkSize);
+  return buf;
+}
+
+// Called with _lock held
+char* LocalGridFile::load_chunk(size_t n) {
+  if (!_chunks[n]) {
+    char* buf = new_chunk();
+    // Short reads leave the zeroes a chunk past the end would have
+    ssize_t got = pread(_spill_fd, buf, _chunkSize, (off_t)n * _chunkSize);
+    (void)got;
+    _chunks[n] = buf;
+  }
+  return _chunks[n];
+}
+
+const char* LocalGridFile::range(size_t offset, size_t len, std::vector<char>& scratch) const {
+  {
+    lock_guard<mutex> guard(_lock);
+    size_t n = offset / _chunkSize;
+    if (n < _chunks.size() && _chunks[n] && offset % _chunkSize + len <= _chunkSize)
+      return _chunks[n] + offset % _chunkSize;
+  }
+  scratch.resize(len);
+  read(scratch.data(), len, offset);
+  return scratch.data();
+}
+
+size_t LocalGridFile::spill() {
+  lock_guard<mutex> guard(_lock);
+  if (_pins)
+    return 0;
+  if (_spill_fd < 0 && (_spill_fd = write_budget.spill_file()) < 0)
+    return 0;
+
+  size_t freed = 0;
+  for (size_t n = 0; n < _chunks.size(); n++) {
+    if (!_chunks[n])
+      continue;
+    size_t start = n * _chunkSize;
+    size_t len = start < _length ? min<size_t>(_chunkSize, _length - start) : 0;
+    if (pwrite(_spill_fd, _chunks[n], len, start) != (ssize_t)len)
+      break;
+    chunk_pool.put(_chunks[n], _chunkSize);
+    _chunks[n] = NULL;
+    freed += _chunkSize;
+  }
+
+  _resident -= freed;
+  write_budget.release(freed);
+  return freed;
+}
+
+/* Hands copy each piece of [offset, offset + nbyte) that falls in one
+   chunk. copy returns how much it copied, stopping early when its source
+   runs out, or -errno. */
+template <typename Copy>
+int LocalGridFile::copy_in(size_t nbyte, off_t offset, Copy copy) {
   size_t last_chunk = (offset + nbyte) / _chunkSize;
   size_t written = 0;
 
+  lock_guard<mutex> guard(_lock);
   while(last_chunk > _chunks.size() - 1) {
-    char *new_buf = new char[_chunkSize];
-    memset(new_buf, 0, _chunkSize);
-    _chunks.push_back(new_buf);
+    _chunks.push_back(new_chunk());
   }
 
-  off_t chunk_num = offset / _chunkSize;
-  off_t buf_offset = offset % _chunkSize;
+  while(written < nbyte) {
+    size_t at = offset + written;
+    char* dest_buf = load_chunk(at / _chunkSize) + at % _chunkSize;
+    size_t to_write = min<size_t>(nbyte - written, _chunkSize - at % _chunkSize);
+    ssize_t copied = copy(dest_buf, to_write);
+    if (copied < 0) {
+      if (!written)
+        return copied;
+      break;
+    }
 
-  char* dest_buf = _chunks[chunk_num];
-  if (buf_offset) {
-    dest_buf += offset % _chunkSize;
-    size_t to_write = min<size_t>(nbyte - written, _chunkSize - buf_offset);
-    memcpy(dest_buf, buf, to_write);
-    written += to_write;
-    chunk_num++;
-  }
+    if (_stream_md5) {
+      if (at == _hashed) {
+        md5_append(&_md5, (const md5_byte_t*)dest_buf, copied);
+        _hashed += copied;
+      } else {
+        _stream_md5 = false;
+      }
+    }
 
-  while(written < nbyte) {
-    dest_buf = _chunks[chunk_num];
-    size_t to_write = min<size_t>(nbyte - written, _chunkSize);
-    memcpy(dest_buf, buf, to_write);
-    written += to_write;
-    chunk_num++;
+    written += copied;
+    if ((size_t)copied < to_write)
+      break;
   }
 
   _length = max<size_t>(_length, offset + written);
@@ -40,23 +268,66 @@ int LocalGridFile::write(const char *buf, size_t nbyte, off_t offset) {
   return written;
 }
 
-int LocalGridFile::read(char* buf, size_t size, off_t offset) {
+int LocalGridFile::write(const char *buf, size_t nbyte, off_t offset) {
+  return copy_in(nbyte, offset, [&](char* dest, size_t len) -> ssize_t {
+    memcpy(dest, buf, len);
+    buf += len;
+    return len;
+  });
+}
+
+int LocalGridFile::write_buf(struct fuse_bufvec* src, off_t offset) {
+  return copy_in(fuse_buf_size(src), offset, [src](char* dest, size_t len) -> ssize_t {
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(len);
+    dst.buf[0].mem = dest;
+    return fuse_buf_copy(&dst, src, (enum fuse_buf_copy_flags)0);
+  });
+}
+
+int LocalGridFile::read(char* buf, size_t size, off_t offset) const {
   size_t len = 0;
   size_t chunk_num = offset / _chunkSize;
 
+  lock_guard<mutex> guard(_lock);
   while (len < size && chunk_num < _chunks.size()) {
     const char* chunk = _chunks[chunk_num];
     size_t to_read = min<size_t>((size_t)_chunkSize, size - len);
+    size_t skip = 0;
 
     if (!len && offset) {
-      chunk += offset % _chunkSize;
-      to_read = min<size_t>(to_read, (size_t)(_chunkSize - (offset % _chunkSize)));
+      skip = offset % _chunkSize;
+      to_read = min<size_t>(to_read, (size_t)(_chunkSize - skip));
     }
 
-    memcpy(buf + len, chunk, to_read);
+    if (chunk) {
+      memcpy(buf + len, chunk + skip, to_read);
+    } else {
+      // Spilled chunks are read in place, not loaded back
+      ssize_t got = pread(_spill_fd, buf + len, to_read, (off_t)chunk_num * _chunkSize + skip);
+      if (got < 0)
+        got = 0;
+      memset(buf + len + got, 0, to_read - got);
+    }
     len += to_read;
     chunk_num++;
   }
 
   return len;
 }
+
+string LocalGridFile::md5() const {
+  md5_state_t st = _md5;
+
+  if (!_stream_md5) {
+    md5_init(&st);
+    std::vector<char> scratch;
+    for (size_t n = 0; n * _chunkSize < _length; n++) {
+      size_t len = min<size_t>(_chunkSize, _length - n * _chunkSize);
+      md5_append(&st, (const md5_byte_t*)range(n * _chunkSize, len, scratch), len);
+    }
+  }
+
+  mongo::md5digest d;
+  md5_finish(&st, d);
+  return mongo::digestToString(d);
+}
@@ -2,9 +2,16 @@
 #define _LOCAL_GRIDFILE_H
 
 #include <vector>
+#include <atomic>
+#include <condition_variable>
 #include <cstring>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <string>
+
+#include <mongo/bson/bson.h>
+#include <mongo/util/md5.hpp>
 
 #ifdef __linux__
 #include "sys/types.h"
@@ -12,6 +19,81 @@
 
 const unsigned int DEFAULT_CHUNK_SIZE = 256 * 1024;
 
+struct fuse_bufvec;
+
+//! Keeps freed chunk buffers for the next file written. Buffers this
+//  size come straight from mmap, so otherwise every chunk costs a fresh
+//  mapping, a page fault per page and an unmap.
+class ChunkPool {
+public:
+  char* get(size_t size);
+  void put(char* buf, size_t size);
+
+private:
+  std::mutex _lock;
+  std::vector<char*> _free;
+};
+
+extern ChunkPool chunk_pool;
+
+class LocalGridFile;
+class Journal;
+
+/* Caps the memory held in chunk buffers of files open for writing,
+   across all of them (--write-budget). Past three quarters of the cap,
+   the largest files are spilled to an unlinked file in --spill-dir in
+   the background, until usage is down to half. Writers only wait when
+   the whole budget is in use. */
+class WriteBudget {
+public:
+  WriteBudget() : _capacity(0), _bytes(0), _peak(0), _spilling(false),
+                  _stalled(false), _spilled(0), _waits(0) {}
+
+  //! 0, the default until main sets one, is unlimited.
+  void set_capacity(size_t bytes) { _capacity = bytes; }
+  bool set_spill_dir(const std::string& dir);
+
+  //! Make a file a candidate for spilling. Called when it is created.
+  void track(const std::shared_ptr<LocalGridFile>& lgf);
+
+  void charge(size_t bytes);
+  void release(size_t bytes);
+
+  //! Block while the budget is used up. Called before each write,
+  //  without holding any file's lock.
+  void wait_for_room();
+
+  //! A new spill file, already unlinked, or -1.
+  int spill_file();
+
+  struct usage {
+    size_t bytes;
+    size_t peak;
+    size_t capacity;
+    unsigned long long spilled;
+    unsigned long long waits;
+  };
+
+  //! Current and peak usage, and spill and wait totals since the last reset.
+  usage stats() const;
+  void reset_stats();
+
+private:
+  bool begin_spill();
+  void spill();
+
+  size_t _capacity;
+  mutable std::mutex _lock;
+  std::condition_variable _room;
+  size_t _bytes, _peak;
+  bool _spilling, _stalled;
+  unsigned long long _spilled, _waits;
+  std::string _dir;
+  std::vector<std::weak_ptr<LocalGridFile> > _files;
+};
+
+extern WriteBudget write_budget;
+
 class LocalGridFile {
 public:
   LocalGridFile(uid_t u, gid_t g, mode_t m, int chunkSize = DEFAULT_CHUNK_SIZE) :
@@ -20,24 +102,52 @@ public:
     _uid(u),
     _gid(g),
     _mode(m),
-    _dirty(true)
+    _storedChunkSize(0),
+    _mtime(0),
+    _dirty(true),
+    _resident(0),
+    _pins(0),
+    _spill_fd(-1),
+    _stream_md5(true),
+    _hashed(0)
   {
-    _chunks.push_back(new char[_chunkSize]);
+    _chunks.push_back(new_chunk());
+    md5_init(&_md5);
   }
 
-  ~LocalGridFile() {
-    for (auto i : _chunks) {
-      delete i;
-    }
-  }
+  ~LocalGridFile();
 
-  int Length() const { return _length; }
+  size_t Length() const { return _length; }
 
   int ChunkSize() const { return _chunkSize; }
 
   int NumChunks() const { return _chunks.size(); }
 
-  char* Chunk(int n) const { return _chunks[n]; }
+  //! Chunk size to store the file with, from user.gridfs.chunk_size.
+  //  0 leaves it to the directory or the mount.
+  size_t StoredChunkSize() const { return _storedChunkSize; }
+  void setStoredChunkSize(size_t s) { _storedChunkSize = s; }
+
+  //! Bytes [offset, offset + len) of the file. Points into a chunk
+  //  buffer when the range is all in one that is in memory, otherwise
+  //  the bytes are copied into scratch.
+  const char* range(size_t offset, size_t len, std::vector<char>& scratch) const;
+
+  //! Keeps the chunk buffers where they are while uploads read them.
+  class Pin {
+  public:
+    explicit Pin(const LocalGridFile& lgf) : _lgf(lgf) { _lgf._pins++; }
+    ~Pin() { _lgf._pins--; }
+  private:
+    const LocalGridFile& _lgf;
+  };
+
+  //! Bytes of chunk buffers in memory.
+  size_t resident() const { return _resident; }
+
+  //! Write every chunk in memory out to the spill file and free its
+  //  buffer, unless the file is pinned. Returns the bytes freed.
+  size_t spill();
 
   uid_t Uid() const { return _uid; }
   void setUid(uid_t u) { _uid = u; }
@@ -48,24 +158,71 @@ public:
   mode_t Mode() const { return _mode; }
   void setMode(mode_t m) { _mode = m; }
 
+  //! Modification time in ms since the epoch, as utimens set it while
+  //  the file waited to be stored. 0 stores it with the current time.
+  unsigned long long MTime() const { return _mtime; }
+  void setMTime(unsigned long long ms) { _mtime = ms; }
+
+  //! Extended attributes, stored as the files document's metadata.
+  mongo::BSONObj Metadata() const { return _metadata; }
+  void setMetadata(const mongo::BSONObj& m) { _metadata = m.getOwned(); }
+
   bool is_dirty() const { return _dirty; }
   bool is_clean() const { return !_dirty; }
 
   void set_flushed() { _dirty = false; }
 
+  //! Where writes are journaled in --write-back mode, or empty.
+  std::shared_ptr<Journal> journal() const { return _journal; }
+  void setJournal(const std::shared_ptr<Journal>& j) { _journal = j; }
+
+  //! Stop maintaining the running MD5 (when the mount doesn't store one).
+  void disable_md5() { _stream_md5 = false; }
+
+  //! MD5 of the current contents as hex. Free when the file was written
+  //  front to back, otherwise the local chunks are hashed again.
+  std::string md5() const;
+
   int write(const char* buf, size_t nbyte, off_t offset);
-  int read(char* buf, size_t size, off_t offset);
+
+  //! Like write, but copies from FUSE's buffers, which may be pipes when
+  //  splicing, straight into the chunks. Returns bytes written or -errno.
+  int write_buf(struct fuse_bufvec* src, off_t offset);
+
+  int read(char* buf, size_t size, off_t offset) const;
 
   typedef std::shared_ptr<LocalGridFile> ptr;
 
 private:
+  template <typename Copy>
+  int copy_in(size_t nbyte, off_t offset, Copy copy);
+
+  char* new_chunk();
+  char* load_chunk(size_t n);
+
   size_t _length, _chunkSize;
   uid_t _uid;
   gid_t _gid;
   mode_t _mode;
+  mongo::BSONObj _metadata;
+  size_t _storedChunkSize;
+  unsigned long long _mtime;
 
   bool _dirty;
+  std::shared_ptr<Journal> _journal;
+
+  // A NULL chunk has been spilled, to n * _chunkSize in _spill_fd
+  mutable std::mutex _lock;
   std::vector<char*> _chunks;
+  std::atomic<size_t> _resident;
+  mutable std::atomic<int> _pins;
+  int _spill_fd;
+
+  // Running MD5 over [0, _hashed). Dropped as soon as a write doesn't
+  // start exactly where the previous one ended.
+  bool _stream_md5;
+  size_t _hashed;
+  md5_state_t _md5;
 };
 
 #endif
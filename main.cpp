@@ -18,8 +18,19 @@
 #include "operations.h"
 #include "options.h"
 #include "utils.h"
+#include "attr_cache.h"
+#include "idmap.h"
+#include "usage.h"
+#include "chunk_cache.h"
+#include "disk_cache.h"
+#include "writeback.h"
+#include "backend.h"
+#include "mongo_backend.h"
+#include "oplog.h"
+#include "stats.h"
 #include <mongo/util/net/hostandport.h>
 #include <mongo/client/dbclient.h>
+#include <algorithm>
 #include <cstring>
 #include <stdio.h>
 #include <iostream>
@@ -30,31 +41,41 @@ using namespace std;
 int main(int argc, char *argv[])
 {
   static struct fuse_operations gridfs_oper;
-  gridfs_oper.getattr = gridfs_getattr;
-  gridfs_oper.readlink = gridfs_readlink;
-  gridfs_oper.mkdir = gridfs_mkdir;
-  gridfs_oper.unlink = gridfs_unlink;
-  gridfs_oper.rmdir = gridfs_rmdir;
-  gridfs_oper.symlink = gridfs_symlink;
-  gridfs_oper.rename = gridfs_rename;
-  gridfs_oper.chmod = gridfs_chmod;
-  gridfs_oper.chown = gridfs_chown;
-  gridfs_oper.open = gridfs_open;
-  gridfs_oper.read = gridfs_read;
-  gridfs_oper.write = gridfs_write;
-  gridfs_oper.flush = gridfs_flush;
-  gridfs_oper.release = gridfs_release;
-  gridfs_oper.setxattr = gridfs_setxattr;
-  gridfs_oper.getxattr = gridfs_getxattr;
-  gridfs_oper.listxattr = gridfs_listxattr;
-  gridfs_oper.removexattr = gridfs_removexattr;
-  gridfs_oper.readdir = gridfs_readdir;
-  gridfs_oper.create = gridfs_create;
-  gridfs_oper.utimens = gridfs_utimens;
+  gridfs_oper.init = gridfs_init;
+  gridfs_oper.destroy = gridfs_destroy;
+  gridfs_oper.getattr = TIMED(OP_GETATTR, gridfs_getattr);
+  gridfs_oper.readlink = TIMED(OP_READLINK, gridfs_readlink);
+  gridfs_oper.mkdir = TIMED(OP_MKDIR, gridfs_mkdir);
+  gridfs_oper.unlink = TIMED(OP_UNLINK, gridfs_unlink);
+  gridfs_oper.rmdir = TIMED(OP_RMDIR, gridfs_rmdir);
+  gridfs_oper.symlink = TIMED(OP_SYMLINK, gridfs_symlink);
+  gridfs_oper.rename = TIMED(OP_RENAME, gridfs_rename);
+  gridfs_oper.chmod = TIMED(OP_CHMOD, gridfs_chmod);
+  gridfs_oper.chown = TIMED(OP_CHOWN, gridfs_chown);
+  gridfs_oper.truncate = TIMED(OP_TRUNCATE, gridfs_truncate);
+  gridfs_oper.open = TIMED(OP_OPEN, gridfs_open);
+  gridfs_oper.read = TIMED(OP_READ, gridfs_read);
+  gridfs_oper.write = TIMED(OP_WRITE, gridfs_write);
+  gridfs_oper.write_buf = TIMED(OP_WRITE, gridfs_write_buf);
+  gridfs_oper.flush = TIMED(OP_FLUSH, gridfs_flush);
+  gridfs_oper.release = TIMED(OP_RELEASE, gridfs_release);
+  gridfs_oper.setxattr = TIMED(OP_SETXATTR, gridfs_setxattr);
+  gridfs_oper.getxattr = TIMED(OP_GETXATTR, gridfs_getxattr);
+  gridfs_oper.listxattr = TIMED(OP_LISTXATTR, gridfs_listxattr);
+  gridfs_oper.removexattr = TIMED(OP_REMOVEXATTR, gridfs_removexattr);
+  gridfs_oper.readdir = TIMED(OP_READDIR, gridfs_readdir);
+  gridfs_oper.create = TIMED(OP_CREATE, gridfs_create);
+  gridfs_oper.utimens = TIMED(OP_UTIMENS, gridfs_utimens);
+  gridfs_oper.statfs = TIMED(OP_STATFS, gridfs_statfs);
 
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
   memset(&gridfs_options, 0, sizeof(struct gridfs_options));
+  // 0 turns these off, so the defaults have to be in place before parsing
+  gridfs_options.readahead = 8;
+  gridfs_options.attr_timeout = 1;
+  gridfs_options.usage_timeout = 5;
+  gridfs_options.retire_delay = 300;
   if (fuse_opt_parse(&args, &gridfs_options, gridfs_opts, gridfs_opt_proc) == -1)
     return -1;
 
@@ -63,12 +84,16 @@ int main(int argc, char *argv[])
   }
 
   mongo::ConnectionString cs;
-  if (!gridfs_options.port) {
+  if (gridfs_options.replset) {
+    cs = mongo::ConnectionString(mongo::ConnectionString::SET, gridfs_options.host,
+                                 gridfs_options.replset);
+  } else if (!gridfs_options.port) {
     gridfs_options.port = 0;
+    cs = mongo::ConnectionString(mongo::HostAndPort(gridfs_options.host));
   } else {
     cs = mongo::ConnectionString(mongo::HostAndPort(gridfs_options.host, gridfs_options.port));
-    gridfs_options.conn_string = &cs;
   }
+  gridfs_options.conn_string = &cs;
 
   if (!gridfs_options.db) {
     gridfs_options.db = "test";
@@ -86,5 +111,118 @@ int main(int argc, char *argv[])
     gridfs_options.prefix = "fs";
   }
 
+  if (!gridfs_options.hash || strcmp(gridfs_options.hash, "md5") == 0) {
+    gridfs_options.hashing = HASH_MD5;
+  } else if (strcmp(gridfs_options.hash, "xxh64") == 0) {
+    gridfs_options.hashing = HASH_XXH64;
+  } else if (strcmp(gridfs_options.hash, "none") == 0) {
+    gridfs_options.hashing = HASH_NONE;
+  } else {
+    cerr << "Unknown hash: " << gridfs_options.hash << endl;
+    return -1;
+  }
+
+  gridfs_options.compression = CODEC_NONE;
+  if (gridfs_options.compress &&
+      !parse_codec(gridfs_options.compress, &gridfs_options.compression)) {
+    cerr << "Unknown codec: " << gridfs_options.compress << endl;
+    return -1;
+  }
+
+  if (!gridfs_options.cache_size) {
+    gridfs_options.cache_size = 64;
+  }
+  chunk_cache.set_capacity((size_t)gridfs_options.cache_size << 20);
+  attr_cache.set_timeout(gridfs_options.attr_timeout);
+  set_usage_timeout(gridfs_options.usage_timeout);
+
+  if (!gridfs_options.idmap_timeout) {
+    gridfs_options.idmap_timeout = 600;
+  }
+  set_idmap_timeout(gridfs_options.idmap_timeout);
+  if (gridfs_options.idmap_preload)
+    preload_idmap();
+
+  if (!gridfs_options.min_chunk_size) {
+    gridfs_options.min_chunk_size = DEFAULT_CHUNK_SIZE >> 10;
+  }
+  if (!gridfs_options.max_chunk_size) {
+    gridfs_options.max_chunk_size = std::max(4096u, gridfs_options.min_chunk_size);
+  }
+  // Chunk documents have to stay under the 16MB BSON limit
+  if (gridfs_options.max_chunk_size > 15 * 1024 ||
+      gridfs_options.min_chunk_size > gridfs_options.max_chunk_size) {
+    cerr << "Chunk sizes must satisfy min <= max <= 15360 KB" << endl;
+    return -1;
+  }
+
+  if (!gridfs_options.write_budget) {
+    gridfs_options.write_budget = 1024;
+  }
+  write_budget.set_capacity((size_t)gridfs_options.write_budget << 20);
+  if (gridfs_options.spill_dir && !write_budget.set_spill_dir(gridfs_options.spill_dir)) {
+    cerr << "Can't use spill directory " << gridfs_options.spill_dir << endl;
+    return -1;
+  }
+
+  if (gridfs_options.disk_cache) {
+    if (!gridfs_options.disk_cache_size) {
+      gridfs_options.disk_cache_size = 4096;
+    }
+    if (!disk_cache.open(gridfs_options.disk_cache,
+                         (size_t)gridfs_options.disk_cache_size << 20)) {
+      cerr << "Can't use disk cache " << gridfs_options.disk_cache << endl;
+      return -1;
+    }
+  }
+
+  if (gridfs_options.write_back) {
+    journal_sync sync = SYNC_CLOSE;
+    if (gridfs_options.journal_sync &&
+        !parse_journal_sync(gridfs_options.journal_sync, &sync)) {
+      cerr << "Unknown journal sync: " << gridfs_options.journal_sync << endl;
+      return -1;
+    }
+    if (!write_back.open(gridfs_options.write_back, sync)) {
+      cerr << "Can't use write-back directory " << gridfs_options.write_back << endl;
+      return -1;
+    }
+  }
+
+  if (!gridfs_options.io_threads) {
+    gridfs_options.io_threads = 16;
+  }
+
+  if (!gridfs_options.read_parallel) {
+    gridfs_options.read_parallel = 4;
+  }
+
+  if (!gridfs_options.upload_parallel) {
+    gridfs_options.upload_parallel = 4;
+  }
+
+  set_tracing(gridfs_options.trace);
+
+  if (gridfs_options.record && !oplog_open(gridfs_options.record)) {
+    cerr << "Can't open " << gridfs_options.record << endl;
+    return -1;
+  }
+
+  if (!init_backend(gridfs_options.backend)) {
+    cerr << "Unknown backend: " << gridfs_options.backend << endl;
+    return -1;
+  }
+  std::string err;
+  if (!init_read_prefs(err)) {
+    cerr << err << endl;
+    return -1;
+  }
+
+  if (gridfs_options.dedup && gridfs_options.backend &&
+      strcmp(gridfs_options.backend, "mongo") != 0) {
+    cerr << "--dedup needs the mongo backend" << endl;
+    return -1;
+  }
+
   return fuse_main(args.argc, args.argv, &gridfs_oper, NULL);
 }
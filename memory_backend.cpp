@@ -0,0 +1,422 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <regex>
+#include <thread>
+#include <unistd.h>
+
+#include <mongo/bson/bson.h>
+
+#include "memory_backend.h"
+#include "stats.h"
+#include "gc.h"
+#include "options.h"
+
+namespace {
+
+// Chunks are keyed by the printed files_id, which is unique per type
+std::string id_key(const mongo::BSONElement& id) {
+  return id.toString(false);
+}
+
+// doc with the dotted field path set to value, or removed if value is eoo
+mongo::BSONObj set_field(const mongo::BSONObj& doc, const std::string& path,
+                         const mongo::BSONElement& value) {
+  size_t dot = path.find('.');
+  std::string head = path.substr(0, dot);
+  std::string rest = dot == std::string::npos ? "" : path.substr(dot + 1);
+
+  mongo::BSONObjBuilder b;
+  bool found = false;
+  mongo::BSONObjIterator i(doc);
+  while (i.more()) {
+    mongo::BSONElement e = i.next();
+    if (head != e.fieldName()) {
+      b.append(e);
+      continue;
+    }
+
+    found = true;
+    if (!rest.empty())
+      b.append(head, set_field(e.type() == mongo::Object ? e.Obj() : mongo::BSONObj(),
+                               rest, value));
+    else if (!value.eoo())
+      b.appendAs(value, head);
+  }
+
+  if (!found && !value.eoo()) {
+    if (!rest.empty())
+      b.append(head, set_field(mongo::BSONObj(), rest, value));
+    else
+      b.appendAs(value, head);
+  }
+
+  return b.obj();
+}
+
+mongo::BSONObj apply_update(mongo::BSONObj doc, const mongo::BSONObj& update) {
+  mongo::BSONObjIterator set(update["$set"].type() == mongo::Object ?
+                             update["$set"].Obj() : mongo::BSONObj());
+  while (set.more()) {
+    mongo::BSONElement e = set.next();
+    doc = set_field(doc, e.fieldName(), e);
+  }
+
+  mongo::BSONObjIterator unset(update["$unset"].type() == mongo::Object ?
+                               update["$unset"].Obj() : mongo::BSONObj());
+  while (unset.more())
+    doc = set_field(doc, unset.next().fieldName(), mongo::BSONElement());
+
+  return doc;
+}
+
+bool satisfies(const mongo::BSONElement& value, const mongo::BSONElement& op) {
+  const char* name = op.fieldName();
+  if (strcmp(name, "$exists") == 0)
+    return value.eoo() != op.trueValue();
+  if (strcmp(name, "$regex") == 0)
+    return value.type() == mongo::String &&
+           std::regex_search(value.String(), std::regex(op.String()));
+
+  // Ranges only compare within one type, as on the server
+  if (value.eoo() || value.canonicalType() != op.canonicalType())
+    return false;
+  int cmp = value.woCompare(op, false);
+  if (strcmp(name, "$gt") == 0)
+    return cmp > 0;
+  if (strcmp(name, "$gte") == 0)
+    return cmp >= 0;
+  if (strcmp(name, "$lt") == 0)
+    return cmp < 0;
+  if (strcmp(name, "$lte") == 0)
+    return cmp <= 0;
+  return false;
+}
+
+// The part of the query language update_file conditions and find_files
+// filters use: equality, $exists, $regex, ranges and $and
+bool matches(const mongo::BSONObj& doc, const mongo::BSONObj& filter) {
+  mongo::BSONObjIterator i(filter);
+  while (i.more()) {
+    mongo::BSONElement clause = i.next();
+    if (strcmp(clause.fieldName(), "$and") == 0) {
+      mongo::BSONObjIterator sub(clause.Obj());
+      while (sub.more())
+        if (!matches(doc, sub.next().Obj()))
+          return false;
+      continue;
+    }
+
+    mongo::BSONElement value = doc.getFieldDotted(clause.fieldName());
+    if (clause.type() == mongo::Object && clause.Obj().firstElement().fieldName()[0] == '$') {
+      mongo::BSONObjIterator ops(clause.Obj());
+      while (ops.more())
+        if (!satisfies(value, ops.next()))
+          return false;
+    } else if (value.eoo() || value.woCompare(clause, false) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+mongo::BSONObj project(const mongo::BSONObj& doc, const mongo::BSONObj& fields) {
+  if (fields.isEmpty())
+    return doc;
+
+  mongo::BSONObjBuilder b;
+  mongo::BSONObjIterator i(doc);
+  while (i.more()) {
+    mongo::BSONElement e = i.next();
+    if (strcmp(e.fieldName(), "_id") == 0 || fields.hasField(e.fieldName()))
+      b.append(e);
+  }
+  return b.obj();
+}
+
+}
+
+void MemoryBackend::round_trip() const {
+  if (_latency_us)
+    std::this_thread::sleep_for(std::chrono::microseconds(_latency_us));
+}
+
+void MemoryBackend::drop_chunks(const std::string& files_id) {
+  _chunks.erase(_chunks.lower_bound(std::make_pair(files_id, 0)),
+                _chunks.lower_bound(std::make_pair(files_id + '\0', 0)));
+}
+
+MemoryBackend::file_map::iterator MemoryBackend::current(const std::string& filename) {
+  // As newest_first sorts: by version, a missing one lowest, then _id
+  auto range = _files.equal_range(filename);
+  if (range.first == range.second)
+    return _files.end();
+  auto best = range.first;
+  for (auto i = std::next(range.first); i != range.second; ++i) {
+    int cmp = i->second["version"].woCompare(best->second["version"], false);
+    if (cmp > 0 || (cmp == 0 && i->second["_id"].woCompare(best->second["_id"], false) > 0))
+      best = i;
+  }
+  return best;
+}
+
+void MemoryBackend::retire_chunks(const mongo::BSONElement& files_id, int delay_seconds) {
+  if (delay_seconds || stored_file_held(files_id))
+    _retired.push_back(std::make_pair(time(NULL) + delay_seconds, BSON("_id" << files_id)));
+  else
+    drop_chunks(id_key(files_id));
+}
+
+void MemoryBackend::retire_files(const std::string& filename, int delay_seconds) {
+  auto range = _files.equal_range(filename);
+  for (auto i = range.first; i != range.second; ++i)
+    retire_chunks(i->second["_id"], delay_seconds);
+  _files.erase(range.first, range.second);
+}
+
+void MemoryBackend::purge_retired() {
+  time_t now = time(NULL);
+  for (size_t i = 0; i < _retired.size(); ) {
+    mongo::BSONElement id = _retired[i].second["_id"];
+    if (_retired[i].first <= now && !stored_file_held(id)) {
+      drop_chunks(id_key(id));
+      _retired[i] = _retired.back();
+      _retired.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
+mongo::BSONObj MemoryBackend::find_file(const std::string& filename) {
+  DbTimer timer(DB_FINDONE);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  auto i = current(filename);
+  return i == _files.end() ? mongo::BSONObj() : i->second;
+}
+
+std::vector<mongo::BSONObj> MemoryBackend::list_files(const std::string& dir,
+                                                      bool children_only,
+                                                      const mongo::BSONObj& fields) {
+  DbTimer timer(DB_QUERY);
+  round_trip();
+
+  std::vector<mongo::BSONObj> found;
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto i = _files.lower_bound(dir);
+       i != _files.end() && i->first.compare(0, dir.size(), dir) == 0; ++i) {
+    if (children_only && i->first.find('/', dir.size()) != std::string::npos)
+      continue;
+    found.push_back(project(i->second, fields));
+  }
+
+  return found;
+}
+
+std::vector<mongo::BSONObj> MemoryBackend::find_files(const mongo::BSONObj& filter, int limit,
+                                                      const mongo::BSONObj& fields) {
+  DbTimer timer(DB_QUERY);
+  round_trip();
+
+  std::vector<mongo::BSONObj> found;
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto& i : _files) {
+    if (limit && found.size() == (size_t)limit)
+      break;
+    if (matches(i.second, filter))
+      found.push_back(project(i.second, fields));
+  }
+
+  return found;
+}
+
+int MemoryBackend::tree_usage(const std::string& dir, long long* bytes, long long* files) {
+  DbTimer timer(DB_COMMAND);
+  round_trip();
+
+  *bytes = *files = 0;
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto i = _files.lower_bound(dir);
+       i != _files.end() && i->first.compare(0, dir.size(), dir) == 0; ++i) {
+    if (!i->second.hasField("length"))
+      continue;
+    *bytes += i->second["length"].numberLong();
+    ++*files;
+  }
+  return 0;
+}
+
+int MemoryBackend::store_usage(usage* u) {
+  DbTimer timer(DB_COMMAND);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  u->used = 0;
+  for (auto& i : _chunks)
+    u->used += i.second.objsize();
+  u->files = _files.size();
+  // Everything lives in this process's memory
+  u->avail = (unsigned long long)sysconf(_SC_AVPHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  return 0;
+}
+
+void MemoryBackend::insert_file(const mongo::BSONObj& file_obj) {
+  DbTimer timer(DB_INSERT);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  _files.insert(std::make_pair(file_obj["filename"].String(), file_obj.getOwned()));
+}
+
+void MemoryBackend::replace_file(const mongo::BSONObj& file_obj, int delay_seconds) {
+  DbTimer timer(DB_INSERT);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  purge_retired();
+
+  std::string filename = file_obj["filename"].String();
+  retire_files(filename, delay_seconds);
+  _files.insert(std::make_pair(filename, file_obj.getOwned()));
+}
+
+mongo::BSONObj MemoryBackend::update_file(const std::string& filename,
+                                          const mongo::BSONObj& update,
+                                          const mongo::BSONObj& condition) {
+  DbTimer timer(DB_UPDATE);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  auto i = current(filename);
+  if (i == _files.end() || !matches(i->second, condition))
+    return mongo::BSONObj();
+
+  // Re-inserted because a rename changes the key
+  mongo::BSONObj file_obj = apply_update(i->second, update);
+  _files.erase(i);
+  _files.insert(std::make_pair(file_obj["filename"].String(), file_obj));
+
+  return file_obj;
+}
+
+int MemoryBackend::remove_file(const std::string& filename) {
+  DbTimer timer(DB_REMOVE);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  purge_retired();
+  if (_files.find(filename) == _files.end())
+    return -ENOENT;
+
+  retire_files(filename, gridfs_options.retire_delay);
+  return 0;
+}
+
+void MemoryBackend::retire_file(const mongo::BSONObj& file_obj, int delay_seconds) {
+  DbTimer timer(DB_REMOVE);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  purge_retired();
+
+  std::string id = id_key(file_obj["_id"]);
+  for (auto i = _files.begin(); i != _files.end(); ++i)
+    if (id_key(i->second["_id"]) == id) {
+      _files.erase(i);
+      break;
+    }
+
+  retire_chunks(file_obj["_id"], delay_seconds);
+}
+
+int MemoryBackend::copy_file(const std::string& src, const std::string& dst) {
+  DbTimer timer(DB_COMMAND);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  auto s = current(src);
+  if (s == _files.end())
+    return -ENOENT;
+
+  mongo::OID id;
+  id.init();
+  mongo::BSONObjBuilder file;
+  file << "_id" << id
+       << "filename" << dst
+       << "version" << mongo::OID::gen()
+       << "uploadDate" << mongo::DATENOW;
+  mongo::BSONObjIterator i(s->second);
+  while (i.more()) {
+    mongo::BSONElement e = i.next();
+    if (!file.hasField(e.fieldName()))
+      file.append(e);
+  }
+  mongo::BSONObj file_obj = file.obj();
+
+  std::string src_id = id_key(s->second["_id"]);
+  std::string dst_id = id_key(file_obj["_id"]);
+  std::vector<mongo::BSONObj> copies;
+  for (auto c = _chunks.lower_bound(std::make_pair(src_id, 0));
+       c != _chunks.end() && c->first.first == src_id; ++c)
+    copies.push_back(set_field(c->second, "files_id", file_obj["_id"]));
+
+  // Readers of the version replaced keep it until the retire delay
+  retire_files(dst, gridfs_options.retire_delay);
+  for (size_t n = 0; n < copies.size(); n++)
+    _chunks[std::make_pair(dst_id, copies[n]["n"].numberInt())] = copies[n];
+  _files.insert(std::make_pair(dst, file_obj));
+
+  return 0;
+}
+
+mongo::BSONObj MemoryBackend::get_chunk(const mongo::BSONElement& files_id, int n) {
+  DbTimer timer(DB_GETCHUNK);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  auto i = _chunks.find(std::make_pair(id_key(files_id), n));
+  return i == _chunks.end() ? mongo::BSONObj() : i->second;
+}
+
+std::vector<mongo::BSONObj> MemoryBackend::get_chunks(const mongo::BSONElement& files_id,
+                                                      int first, int last) {
+  DbTimer timer(DB_GETCHUNK);
+  round_trip();
+
+  std::string id = id_key(files_id);
+  std::vector<mongo::BSONObj> chunks;
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto i = _chunks.lower_bound(std::make_pair(id, first));
+       i != _chunks.end() && i->first.first == id && i->first.second < last; ++i)
+    chunks.push_back(i->second);
+
+  return chunks;
+}
+
+void MemoryBackend::put_chunks(const std::vector<mongo::BSONObj>& chunks) {
+  DbTimer timer(DB_INSERT);
+  round_trip();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto& chunk : chunks)
+    _chunks[std::make_pair(id_key(chunk["files_id"]), chunk["n"].numberInt())] = chunk.getOwned();
+}
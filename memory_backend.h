@@ -0,0 +1,80 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MEMORY_BACKEND_H
+#define __MEMORY_BACKEND_H
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include "backend.h"
+
+//! Files and chunks held in this process, for benchmarking the
+//  filesystem without a server. Nothing survives unmounting.
+class MemoryBackend : public Backend {
+public:
+  //! latency_us is added to every call to stand in for a round trip.
+  explicit MemoryBackend(unsigned int latency_us) : _latency_us(latency_us) {}
+
+  mongo::BSONObj find_file(const std::string& filename);
+  std::vector<mongo::BSONObj> list_files(const std::string& dir,
+                                         bool children_only,
+                                         const mongo::BSONObj& fields);
+  std::vector<mongo::BSONObj> find_files(const mongo::BSONObj& filter, int limit,
+                                         const mongo::BSONObj& fields);
+  int tree_usage(const std::string& dir, long long* bytes, long long* files);
+  int store_usage(usage* u);
+  void insert_file(const mongo::BSONObj& file_obj);
+  void replace_file(const mongo::BSONObj& file_obj, int delay_seconds);
+  mongo::BSONObj update_file(const std::string& filename,
+                             const mongo::BSONObj& update,
+                             const mongo::BSONObj& condition = mongo::BSONObj());
+  int remove_file(const std::string& filename);
+  void retire_file(const mongo::BSONObj& file_obj, int delay_seconds);
+  int copy_file(const std::string& src, const std::string& dst);
+
+  mongo::BSONObj get_chunk(const mongo::BSONElement& files_id, int n);
+  std::vector<mongo::BSONObj> get_chunks(const mongo::BSONElement& files_id,
+                                         int first, int last);
+  void put_chunks(const std::vector<mongo::BSONObj>& chunks);
+
+private:
+  typedef std::multimap<std::string, mongo::BSONObj> file_map;
+  typedef std::map<std::pair<std::string, int>, mongo::BSONObj> chunk_map;
+
+  void round_trip() const;
+
+  // The rest expect _lock to be held
+  void drop_chunks(const std::string& files_id);
+  void retire_chunks(const mongo::BSONElement& files_id, int delay_seconds);
+  void retire_files(const std::string& filename, int delay_seconds);
+  file_map::iterator current(const std::string& filename);
+  void purge_retired();
+
+  unsigned int _latency_us;
+
+  std::mutex _lock;
+  file_map _files;
+  chunk_map _chunks;
+  // {_id: files id} whose chunks go once the time has passed, unless
+  // a reader still holds that version
+  std::vector<std::pair<time_t, mongo::BSONObj> > _retired;
+};
+
+#endif
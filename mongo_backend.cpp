@@ -0,0 +1,313 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#include <mongo/bson/bson.h>
+
+#include "mongo_backend.h"
+#include "operations.h"
+#include "options.h"
+#include "store.h"
+#include "dedup.h"
+#include "gc.h"
+#include "stats.h"
+
+mongo::BSONObj files_read_pref;
+mongo::BSONObj chunks_read_pref;
+
+namespace {
+
+const char* read_modes[] = {
+  "primary", "primaryPreferred", "secondary", "secondaryPreferred", "nearest"
+};
+
+bool parse_read_pref(const char* mode, unsigned max_staleness,
+                     mongo::BSONObj* pref, std::string& err) {
+  if (!mode)
+    mode = "primary";
+  if (std::find_if(std::begin(read_modes), std::end(read_modes),
+                   [mode](const char* m) { return strcmp(m, mode) == 0; }) == std::end(read_modes)) {
+    err = std::string("Unknown read preference: ") + mode;
+    return false;
+  }
+
+  if (strcmp(mode, "primary") == 0) {
+    *pref = mongo::BSONObj();
+    return true;
+  }
+
+  mongo::BSONObjBuilder b;
+  b << "mode" << mode;
+  // Servers refuse bounds under 90 seconds: secondaries report their
+  // progress every 10 and staleness can't be measured any finer
+  if (max_staleness)
+    b << "maxStalenessSeconds" << (int)max_staleness;
+  *pref = b.obj();
+  return true;
+}
+
+std::string regex_quote(const std::string& s) {
+  std::string quoted;
+  for (char c : s) {
+    if (strchr("\\^$.|?*+()[]{}", c))
+      quoted.push_back('\\');
+    quoted.push_back(c);
+  }
+  return quoted;
+}
+
+}
+
+bool init_read_prefs(std::string& err) {
+  if (gridfs_options.max_staleness && gridfs_options.max_staleness < 90) {
+    err = "--max-staleness must be at least 90 seconds";
+    return false;
+  }
+
+  const char* chunk_mode = gridfs_options.chunk_read_pref ? gridfs_options.chunk_read_pref
+                                                          : gridfs_options.read_pref;
+  if (!parse_read_pref(gridfs_options.read_pref, gridfs_options.max_staleness,
+                       &files_read_pref, err) ||
+      !parse_read_pref(chunk_mode, gridfs_options.max_staleness, &chunks_read_pref, err))
+    return false;
+
+  if (gridfs_options.max_staleness && files_read_pref.isEmpty() && chunks_read_pref.isEmpty()) {
+    err = "--max-staleness needs a --read-pref other than primary";
+    return false;
+  }
+  return true;
+}
+
+/* Query::readPref has no room for maxStalenessSeconds, so the modifiers
+   are written out. The replica set client picks the member by the mode;
+   mongos also applies the staleness bound. */
+mongo::Query routed_query(const mongo::BSONObj& filter, const mongo::BSONObj& pref,
+                          const mongo::BSONObj& sort) {
+  if (pref.isEmpty()) {
+    mongo::Query q(filter);
+    if (!sort.isEmpty())
+      q.sort(sort);
+    return q;
+  }
+
+  mongo::BSONObjBuilder b;
+  b << "$query" << filter;
+  if (!sort.isEmpty())
+    b << "$orderby" << sort;
+  b << "$readPreference" << pref;
+  return mongo::Query(b.obj());
+}
+
+void MongoBackend::start() {
+  start_chunk_gc();
+  if (gridfs_options.dedup)
+    start_blob_gc();
+}
+
+mongo::BSONObj MongoBackend::find_file(const std::string& filename) {
+  auto sdc = make_ScopedDbConnection();
+  return DB_TIMED(DB_FINDONE, sdc->conn().findOne(db_name() + ".files",
+                                                  routed_query(BSON("filename" << filename),
+                                                               files_read_pref, newest_first()),
+                                                  NULL, routed_options(files_read_pref)));
+}
+
+std::vector<mongo::BSONObj> MongoBackend::list_files(const std::string& dir,
+                                                     bool children_only,
+                                                     const mongo::BSONObj& fields) {
+  std::string pattern = "^" + regex_quote(dir);
+  if (children_only)
+    pattern += "[^/]*$";
+
+  auto sdc = make_ScopedDbConnection();
+  std::unique_ptr<mongo::DBClientCursor> cursor =
+    DB_TIMED(DB_QUERY, sdc->conn().query(db_name() + ".files",
+                                         routed_query(BSON("filename" << BSON("$regex" << pattern)),
+                                                      files_read_pref),
+                                         0, 0,
+                                         fields.isEmpty() ? NULL : &fields,
+                                         routed_options(files_read_pref)));
+
+  std::vector<mongo::BSONObj> found;
+  while (cursor->more())
+    found.push_back(cursor->next().getOwned());
+
+  return found;
+}
+
+std::vector<mongo::BSONObj> MongoBackend::find_files(const mongo::BSONObj& filter, int limit,
+                                                     const mongo::BSONObj& fields) {
+  auto sdc = make_ScopedDbConnection();
+  std::unique_ptr<mongo::DBClientCursor> cursor =
+    DB_TIMED(DB_QUERY, sdc->conn().query(db_name() + ".files",
+                                         routed_query(filter, files_read_pref, BSON("filename" << 1)),
+                                         limit, 0,
+                                         fields.isEmpty() ? NULL : &fields,
+                                         routed_options(files_read_pref)));
+
+  std::vector<mongo::BSONObj> found;
+  while (cursor->more())
+    found.push_back(cursor->next().getOwned());
+
+  return found;
+}
+
+int MongoBackend::tree_usage(const std::string& dir, long long* bytes, long long* files) {
+  // Directories and symlinks have no length
+  mongo::BSONObj pipeline = BSON_ARRAY(
+    BSON("$match" << BSON("filename" << BSON("$regex" << "^" + regex_quote(dir))
+                          << "length" << BSON("$exists" << true))) <<
+    BSON("$group" << BSON("_id" << mongo::BSONNULL
+                          << "bytes" << BSON("$sum" << "$length")
+                          << "files" << BSON("$sum" << 1))));
+
+  auto sdc = make_ScopedDbConnection();
+  mongo::BSONObj info;
+  if (!DB_TIMED(DB_COMMAND, sdc->conn().runCommand(gridfs_options.db,
+                                                   BSON("aggregate" << std::string(gridfs_options.prefix) + ".files"
+                                                        << "pipeline" << pipeline
+                                                        << "cursor" << mongo::BSONObj()),
+                                                   info))) {
+    fprintf(stderr, "usage of %s failed: %s\n", dir.c_str(), info.toString().c_str());
+    return -EIO;
+  }
+
+  // No group at all when nothing matched
+  mongo::BSONObjIterator batch(info["cursor"].Obj()["firstBatch"].Obj());
+  mongo::BSONObj group = batch.more() ? batch.next().Obj() : mongo::BSONObj();
+  *bytes = group["bytes"].numberLong();
+  *files = group["files"].numberLong();
+  return 0;
+}
+
+int MongoBackend::store_usage(usage* u) {
+  auto sdc = make_ScopedDbConnection();
+  mongo::BSONObj db_stats, files_stats, chunks_stats;
+  std::string prefix = gridfs_options.prefix;
+  if (!DB_TIMED(DB_COMMAND, sdc->conn().runCommand(gridfs_options.db, BSON("dbStats" << 1), db_stats)) ||
+      !DB_TIMED(DB_COMMAND, sdc->conn().runCommand(gridfs_options.db,
+                                                   BSON("collStats" << prefix + ".files"), files_stats)) ||
+      !DB_TIMED(DB_COMMAND, sdc->conn().runCommand(gridfs_options.db,
+                                                   BSON("collStats" << prefix + ".chunks"), chunks_stats)))
+    return -EIO;
+
+  u->used = files_stats["storageSize"].numberLong() + chunks_stats["storageSize"].numberLong();
+  u->files = files_stats["count"].numberLong();
+  // Volume figures are only in dbStats from 3.6 on
+  long long total = db_stats["fsTotalSize"].numberLong();
+  long long fs_used = db_stats["fsUsedSize"].numberLong();
+  u->avail = total > fs_used ? total - fs_used : 0;
+  return 0;
+}
+
+void MongoBackend::insert_file(const mongo::BSONObj& file_obj) {
+  auto sdc = make_ScopedDbConnection();
+  DB_TIMED(DB_INSERT, sdc->conn().insert(db_name() + ".files", file_obj));
+}
+
+void MongoBackend::replace_file(const mongo::BSONObj& file_obj, int delay_seconds) {
+  auto sdc = make_ScopedDbConnection();
+  replace_stored_file(sdc->conn(), file_obj, delay_seconds);
+}
+
+mongo::BSONObj MongoBackend::update_file(const std::string& filename,
+                                         const mongo::BSONObj& update,
+                                         const mongo::BSONObj& condition) {
+  mongo::BSONObjBuilder query;
+  query << "filename" << filename;
+  query.appendElements(condition);
+
+  // One round trip that also tells us whether the file exists
+  auto sdc = make_ScopedDbConnection();
+  mongo::BSONObj info;
+  DB_TIMED(DB_UPDATE, sdc->conn().runCommand(gridfs_options.db,
+                                             BSON("findAndModify" << std::string(gridfs_options.prefix) + ".files"
+                                                  << "query" << query.obj()
+                                                  << "sort" << newest_first()
+                                                  << "update" << update
+                                                  << "new" << true),
+                                             info));
+
+  if (info["value"].type() != mongo::Object)
+    return mongo::BSONObj();
+
+  return info["value"].Obj().getOwned();
+}
+
+int MongoBackend::remove_file(const std::string& filename) {
+  auto sdc = make_ScopedDbConnection();
+  return remove_stored_file(sdc->conn(), filename);
+}
+
+void MongoBackend::retire_file(const mongo::BSONObj& file_obj, int delay_seconds) {
+  auto sdc = make_ScopedDbConnection();
+  retire_stored_file(sdc->conn(), file_obj, delay_seconds);
+}
+
+int MongoBackend::copy_file(const std::string& src, const std::string& dst) {
+  auto sdc = make_ScopedDbConnection();
+  return copy_stored_file(sdc->conn(), src, dst);
+}
+
+mongo::BSONObj MongoBackend::get_chunk(const mongo::BSONElement& files_id, int n) {
+  mongo::BSONObj filter = BSON("files_id" << files_id << "n" << n);
+  auto sdc = make_ScopedDbConnection();
+  mongo::BSONObj chunk =
+    DB_TIMED(DB_GETCHUNK, sdc->conn().findOne(db_name() + ".chunks",
+                                              routed_query(filter, chunks_read_pref),
+                                              NULL, routed_options(chunks_read_pref)));
+
+  // A secondary can be behind the files document that led us here
+  if (chunk.isEmpty() && !chunks_read_pref.isEmpty())
+    chunk = DB_TIMED(DB_GETCHUNK, sdc->conn().findOne(db_name() + ".chunks", filter));
+  return chunk;
+}
+
+std::vector<mongo::BSONObj> MongoBackend::get_chunks(const mongo::BSONElement& files_id,
+                                                     int first, int last) {
+  mongo::BSONObj filter = BSON("files_id" << files_id
+                               << "n" << BSON("$gte" << first << "$lt" << last));
+  auto sdc = make_ScopedDbConnection();
+  auto query = [&](const mongo::BSONObj& pref) {
+    std::unique_ptr<mongo::DBClientCursor> cursor =
+      DB_TIMED(DB_GETCHUNK, sdc->conn().query(db_name() + ".chunks",
+                                              routed_query(filter, pref, BSON("n" << 1)),
+                                              0, 0, NULL, routed_options(pref)));
+    std::vector<mongo::BSONObj> found;
+    while (cursor->more())
+      found.push_back(cursor->next().getOwned());
+    return found;
+  };
+
+  // As in get_chunk, the primary has them if a secondary doesn't yet
+  std::vector<mongo::BSONObj> chunks = query(chunks_read_pref);
+  if (chunks.empty() && !chunks_read_pref.isEmpty())
+    chunks = query(mongo::BSONObj());
+
+  return chunks;
+}
+
+void MongoBackend::put_chunks(const std::vector<mongo::BSONObj>& chunks) {
+  if (chunks.empty())
+    return;
+
+  auto sdc = make_ScopedDbConnection();
+  DB_TIMED(DB_INSERT, sdc->conn().insert(db_name() + ".chunks", chunks));
+}
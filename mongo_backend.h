@@ -0,0 +1,70 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __MONGO_BACKEND_H
+#define __MONGO_BACKEND_H
+
+#include "backend.h"
+
+//! Where reads of files documents and of chunk data are sent, as the
+//  $readPreference documents built from --read-pref, --chunk-read-pref
+//  and --max-staleness. Empty means the primary.
+extern mongo::BSONObj files_read_pref;
+extern mongo::BSONObj chunks_read_pref;
+
+//! Set the two preferences above from the options. Returns false, with
+//  a message in err, for an unknown mode or an unusable staleness bound.
+bool init_read_prefs(std::string& err);
+
+//! filter as a query routed by pref, sorted if sort isn't empty.
+mongo::Query routed_query(const mongo::BSONObj& filter, const mongo::BSONObj& pref,
+                          const mongo::BSONObj& sort = mongo::BSONObj());
+
+//! Query options that go with a routed query.
+inline int routed_options(const mongo::BSONObj& pref) {
+  return pref.isEmpty() ? 0 : mongo::QueryOption_SlaveOk;
+}
+
+//! GridFS collections on the server named by --host/--port/--db/--prefix.
+class MongoBackend : public Backend {
+public:
+  void start();
+
+  mongo::BSONObj find_file(const std::string& filename);
+  std::vector<mongo::BSONObj> list_files(const std::string& dir,
+                                         bool children_only,
+                                         const mongo::BSONObj& fields);
+  std::vector<mongo::BSONObj> find_files(const mongo::BSONObj& filter, int limit,
+                                         const mongo::BSONObj& fields);
+  int tree_usage(const std::string& dir, long long* bytes, long long* files);
+  int store_usage(usage* u);
+  void insert_file(const mongo::BSONObj& file_obj);
+  void replace_file(const mongo::BSONObj& file_obj, int delay_seconds);
+  mongo::BSONObj update_file(const std::string& filename,
+                             const mongo::BSONObj& update,
+                             const mongo::BSONObj& condition = mongo::BSONObj());
+  int remove_file(const std::string& filename);
+  void retire_file(const mongo::BSONObj& file_obj, int delay_seconds);
+  int copy_file(const std::string& src, const std::string& dst);
+
+  mongo::BSONObj get_chunk(const mongo::BSONElement& files_id, int n);
+  std::vector<mongo::BSONObj> get_chunks(const mongo::BSONElement& files_id,
+                                         int first, int last);
+  void put_chunks(const std::vector<mongo::BSONObj>& chunks);
+};
+
+#endif
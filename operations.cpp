@@ -18,6 +18,11 @@
 #include "operations.h"
 #include "options.h"
 #include "local_gridfile.h"
+#include "backend.h"
+#include "oplog.h"
+#include "executor.h"
+#include "writeback.h"
+#include "disk_cache.h"
 #include <memory>
 
 #include <mongo/client/connpool.h>
@@ -34,6 +39,22 @@ struct SDC_deleter {
   }
 };
 
+//! Background work has to start here rather than in main: fuse_main
+//  forks when daemonizing and threads don't survive the fork.
+void* gridfs_init(struct fuse_conn_info* conn) {
+  io_executor.start(gridfs_options.io_threads);
+  get_backend().start();
+  if (write_back.enabled())
+    write_back.start();
+
+  return NULL;
+}
+
+void gridfs_destroy(void* private_data) {
+  disk_cache.close();
+  oplog_close();
+}
+
 std::shared_ptr<mongo::ScopedDbConnection> make_ScopedDbConnection(void) {
   mongo::ScopedDbConnection *sdc = mongo::ScopedDbConnection::getScopedDbConnection(*gridfs_options.conn_string);
   if (gridfs_options.username) {
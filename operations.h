@@ -35,6 +35,10 @@
 
 extern std::map<std::string, LocalGridFile::ptr> open_files;
 
+void* gridfs_init(struct fuse_conn_info* conn);
+
+void gridfs_destroy(void* private_data);
+
 int gridfs_getattr(const char* path, struct stat *stbuf);
 
 int gridfs_readlink(const char* path, char* buf, size_t size);
@@ -53,12 +57,16 @@ int gridfs_chmod(const char* path, mode_t mode);
 
 int gridfs_chown(const char* path, uid_t uid, gid_t gid);
 
+int gridfs_truncate(const char* path, off_t size);
+
 int gridfs_open(const char* path, struct fuse_file_info *fi);
 
 int gridfs_read(const char* path, char* buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
 int gridfs_write(const char* path, const char* buf, size_t nbyte, off_t offset, struct fuse_file_info* ffi);
 
+int gridfs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* ffi);
+
 int gridfs_flush(const char* path, struct fuse_file_info* ffi);
 
 int gridfs_release(const char* path, struct fuse_file_info* ffi);
@@ -77,10 +85,8 @@ int gridfs_create(const char* path, mode_t mode, struct fuse_file_info* ffi);
 
 int gridfs_utimens(const char* path, const struct timespec tv[2]);
 
-std::shared_ptr<mongo::ScopedDbConnection> make_ScopedDbConnection(void);
+int gridfs_statfs(const char* path, struct statvfs* stbuf);
 
-inline mongo::GridFS get_gridfs(std::shared_ptr<mongo::ScopedDbConnection> sdc) {
-  return mongo::GridFS(sdc->conn(), gridfs_options.db, gridfs_options.prefix);
-}
+std::shared_ptr<mongo::ScopedDbConnection> make_ScopedDbConnection(void);
 
 #endif
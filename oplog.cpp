@@ -0,0 +1,89 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include "oplog.h"
+#include "hash.h"
+#include "stats.h"
+
+std::atomic<bool> oplog_on(false);
+
+namespace {
+
+std::mutex log_lock;
+FILE* log_file = NULL;
+uint64_t log_start_ns;
+std::atomic<uint16_t> next_thread(0);
+
+uint16_t thread_number() {
+  thread_local uint16_t n = next_thread++;
+  return n;
+}
+
+}
+
+bool oplog_open(const char* path) {
+  log_file = fopen(path, "wb");
+  if (!log_file)
+    return false;
+  setvbuf(log_file, NULL, _IOFBF, 1 << 20);
+
+  uint32_t version = OPLOG_VERSION, count = OP_COUNT;
+  fwrite(OPLOG_MAGIC, sizeof(OPLOG_MAGIC), 1, log_file);
+  fwrite(&version, sizeof(version), 1, log_file);
+  fwrite(&count, sizeof(count), 1, log_file);
+  for (int op = 0; op < OP_COUNT; op++) {
+    const char* name = fuse_op_name((fuse_op)op);
+    fwrite(name, strlen(name) + 1, 1, log_file);
+  }
+  // Nothing may sit in the buffer when fuse_main forks
+  fflush(log_file);
+
+  log_start_ns = now_ns();
+  oplog_on = true;
+  return true;
+}
+
+void oplog_append(int op, uint64_t start_ns, uint64_t end_ns, int result,
+                  const char* path, uint64_t offset, uint32_t size) {
+  oplog_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.start_us = (start_ns - log_start_ns) / 1000;
+  rec.path_hash = path ? xxh64(path, strlen(path)) : 0;
+  rec.offset = offset;
+  rec.size = size;
+  rec.duration_us = (end_ns - start_ns) / 1000;
+  rec.result = result;
+  rec.thread = thread_number();
+  rec.op = op;
+
+  std::lock_guard<std::mutex> guard(log_lock);
+  if (log_file)
+    fwrite(&rec, sizeof(rec), 1, log_file);
+}
+
+void oplog_close() {
+  std::lock_guard<std::mutex> guard(log_lock);
+  oplog_on = false;
+  if (log_file) {
+    fclose(log_file);
+    log_file = NULL;
+  }
+}
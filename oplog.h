@@ -0,0 +1,65 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __OPLOG_H
+#define __OPLOG_H
+
+#include <atomic>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* With --record=<file> every FUSE operation is appended to a compact
+   binary log that tools/replay.cpp can re-issue against a mount. Paths
+   are only kept as their XXH64, so a production log reveals no names.
+   The file is in host byte order:
+
+     "GFSOPLOG", uint32 version, uint32 op count, that many NUL
+     terminated op names (indexed by oplog_record::op), then records
+     until the end of the file. */
+
+const char OPLOG_MAGIC[8] = { 'G', 'F', 'S', 'O', 'P', 'L', 'O', 'G' };
+const uint32_t OPLOG_VERSION = 1;
+
+struct oplog_record {
+  uint64_t start_us;     // since recording began
+  uint64_t path_hash;
+  uint64_t offset;       // read, write and truncate only
+  uint32_t size;
+  uint32_t duration_us;
+  int32_t result;
+  uint16_t thread;       // small per-thread number, in order of first use
+  uint8_t op;
+  uint8_t pad;
+};
+
+extern std::atomic<bool> oplog_on;
+
+inline bool oplog_enabled() {
+  return oplog_on.load(std::memory_order_relaxed);
+}
+
+//! Start logging to path. Called from main before fuse_main, so the
+//  path is still relative to the caller's directory.
+bool oplog_open(const char* path);
+
+void oplog_append(int op, uint64_t start_ns, uint64_t end_ns, int result,
+                  const char* path, uint64_t offset, uint32_t size);
+
+//! Flush and close the log at unmount.
+void oplog_close();
+
+#endif
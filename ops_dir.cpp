@@ -15,22 +15,24 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <pwd.h>
-#include <grp.h>
+
+#include <set>
 
 #include <mongo/bson/bson.h>
-#include <mongo/client/gridfs.h>
 
 #include "operations.h"
 #include "options.h"
 #include "utils.h"
+#include "backend.h"
+#include "attr_cache.h"
+#include "idmap.h"
+#include "control.h"
+#include "query.h"
+#include "writeback.h"
 
 int gridfs_mkdir(const char* path, mode_t mode) {
   path = fuse_to_mongo_path(path);
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::DBClientBase &client = sdc->conn();
-
   mongo::OID id;
   id.init();
   fuse_context *context = fuse_get_context();
@@ -42,56 +44,44 @@ int gridfs_mkdir(const char* path, mode_t mode) {
        << "uploadDate" << mongo::DATENOW
        << "md5" << 0
        << "mode" << (mode | S_IFDIR);
-  {
-    passwd *pw = getpwuid(context->uid);
-    if (pw)
-      file << "owner" << pw->pw_name;
-  }
-  {
-    group *gr = getgrgid(context->gid);
-    if (gr)
-      file << "group" << gr->gr_name;
-  }
+  append_owner(file, context->uid, context->gid);
 
-  client.insert(db_name() + ".files",
-		file.obj());
+  mongo::BSONObj file_obj = file.obj();
+  get_backend().insert_file(file_obj);
+  attr_cache.put(path, file_obj);
 
   return 0;
 }
 
 int gridfs_rmdir(const char* path) {
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-
   path = fuse_to_mongo_path(path);
-  gf.removeFile(path);
-
-  return 0;
+  int r = write_back.settle(path);
+  if (r < 0)
+    return r;
+  attr_cache.forget(path);
+  return get_backend().remove_file(path);
 }
 
 int gridfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+  if (is_control_path(path))
+    return control_readdir(path, buf, filler);
+  if (is_query_path(path))
+    return query_readdir(path, buf, filler);
+
   path = fuse_to_mongo_path(path);
 
   filler(buf, ".", NULL, 0);
   filler(buf, "..", NULL, 0);
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::BSONObj proj = BSON("filename" << 1);
   std::string path_start = path;
   if (strlen(path) > 0)
     path_start += "/";
-  std::unique_ptr<mongo::DBClientCursor> cursor = sdc->conn().query(db_name() + ".files",
-								    BSON("filename" <<
-									 BSON("$regex" << "^" + path_start)
-									 ),
-								    0, 0,
-								    &proj);
+  std::vector<mongo::BSONObj> files =
+    get_backend().list_files(path_start, true, BSON("filename" << 1));
   std::string lastFN;
-  while (cursor->more()) {
-    std::string filename = cursor->next()["filename"].String();
+  for (auto& file_obj : files) {
+    std::string filename = file_obj["filename"].String();
     std::string rel = filename.substr(path_start.length());
-    if (rel.find("/") != std::string::npos)
-      continue;
 
     /* If this filename matches the last filename we've seen, *do not* add it to the buffer because it's a duplicate filename */ 
     if (lastFN != filename)
@@ -111,6 +101,21 @@ int gridfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t of
       filler(buf, i.first.c_str(), NULL, 0);
     }
 
+  // Closed in --write-back mode and not stored yet. Only new files are
+  // missing from the listing.
+  std::vector<std::string> queued = write_back.pending_under(path_start);
+  if (!queued.empty()) {
+    std::set<std::string> listed;
+    for (auto& file_obj : files)
+      listed.insert(file_obj["filename"].String());
+    for (auto& filename : queued) {
+      std::string rel = filename.substr(path_start.length());
+      if (rel.find("/") == std::string::npos && !listed.count(filename) &&
+          !open_files.count(filename))
+        filler(buf, rel.c_str(), NULL, 0);
+    }
+  }
+
   return 0;
 }
 
@@ -16,46 +16,109 @@
  */
 
 #include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <pwd.h>
 #include <grp.h>
 
 #include <mongo/bson/bson.h>
-#include <mongo/client/gridfs.h>
 
 #include "operations.h"
 #include "utils.h"
 #include "options.h"
+#include "backend.h"
+#include "store.h"
+#include "attr_cache.h"
+#include "control.h"
+#include "writeback.h"
+#include "gc.h"
+
+std::atomic<uint64_t> FH(1);
+
+namespace {
+
+/* The files document each read-only handle was opened on. Reads stay
+   on that version when the file is replaced or removed meanwhile, and
+   its chunks are held until the handle is released. */
+std::mutex versions_lock;
+std::map<uint64_t, mongo::BSONObj> open_versions;
+
+bool open_version(uint64_t fh, mongo::BSONObj* file_obj) {
+  std::lock_guard<std::mutex> guard(versions_lock);
+  auto i = open_versions.find(fh);
+  if (i == open_versions.end())
+    return false;
+  *file_obj = i->second;
+  return true;
+}
 
-unsigned int FH = 1;
+}
 
 int gridfs_open(const char *path, struct fuse_file_info *fi) {
+  if (is_control_path(path))
+    return control_open(path, fi);
+
   if ((fi->flags & O_ACCMODE) != O_RDONLY)
     return -EACCES;
 
   path = fuse_to_mongo_path(path);
-  if (open_files.find(path) != open_files.end())
+  if (local_file(path))
     return 0;
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-
-  mongo::GridFile file = gf.findFile(path);
-
-  if (!file.exists())
+  mongo::BSONObj file_obj = lookup_file(get_backend(), path);
+  if (file_obj.isEmpty())
     return -ENOENT;
 
+  fi->fh = FH++;
+  hold_stored_file(file_obj["_id"]);
+  std::lock_guard<std::mutex> guard(versions_lock);
+  open_versions[fi->fh] = file_obj;
+
   return 0;
 }
 
 int gridfs_release(const char* path, struct fuse_file_info* ffi) {
-  // fh is not set if file is opened read only
-  // Would check ffi->flags for O_RDONLY instead but MacFuse doesn't
-  // seem to properly pass flags into release
+  if (is_control_path(path))
+    return control_release(path, ffi);
+
+  // fh is not set if a file is opened read only while it is being
+  // written, and names the version read otherwise. Would check
+  // ffi->flags for O_RDONLY instead but MacFuse doesn't seem to
+  // properly pass flags into release
   if (!ffi->fh)
     return 0;
+  {
+    std::lock_guard<std::mutex> guard(versions_lock);
+    auto version = open_versions.find(ffi->fh);
+    if (version != open_versions.end()) {
+      release_stored_file(version->second["_id"]);
+      open_versions.erase(version);
+      return 0;
+    }
+  }
 
   path = fuse_to_mongo_path(path);
-  open_files.erase(path);
+  auto file_iter = open_files.find(path);
+  if (file_iter == open_files.end())
+    return 0;
+
+  // Queued before it leaves open_files, so it never looks missing
+  LocalGridFile::ptr lgf = file_iter->second;
+  if (lgf->journal()) {
+    int r = lgf->is_dirty() ? lgf->journal()->commit(*lgf) : 0;
+    if (r == 0) {
+      write_back.submit(path, lgf);
+    } else {
+      // Queued without a commit, a crash would lose it, so it is
+      // stored here and now like without --write-back
+      fprintf(stderr, "write-back: journal of %s: %s, storing it directly\n",
+              path, strerror(-r));
+      store_local_file(get_backend(), path, *lgf);
+      lgf->journal()->remove();
+    }
+  }
+  open_files.erase(file_iter);
 
   return 0;
 }
@@ -63,7 +126,17 @@ int gridfs_release(const char* path, struct fuse_file_info* ffi) {
 int gridfs_create(const char* path, mode_t mode, struct fuse_file_info* ffi) {
   fuse_context *context = fuse_get_context();
   path = fuse_to_mongo_path(path);
-  open_files[path] = std::make_shared<LocalGridFile>(context->uid, context->gid, mode);
+  LocalGridFile::ptr lgf = std::make_shared<LocalGridFile>(context->uid, context->gid, mode);
+  if (gridfs_options.hashing != HASH_MD5)
+    lgf->disable_md5();
+  if (write_back.enabled()) {
+    std::shared_ptr<Journal> journal = write_back.create(path);
+    if (!journal)
+      return -EIO;
+    lgf->setJournal(journal);
+  }
+  write_budget.track(lgf);
+  open_files[path] = lgf;
 
   ffi->fh = FH++;
 
@@ -71,68 +144,89 @@ int gridfs_create(const char* path, mode_t mode, struct fuse_file_info* ffi) {
 }
 
 int gridfs_unlink(const char* path) {
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-
   path = fuse_to_mongo_path(path);
-  gf.removeFile(path);
-
-  return 0;
+  int r = write_back.settle(path);
+  if (r < 0)
+    return r;
+  attr_cache.forget(path);
+  return get_backend().remove_file(path);
 }
 
 int gridfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+  if (is_control_path(path))
+    return control_read(path, buf, size, offset, fi);
+
   path = fuse_to_mongo_path(path);
-  auto file_iter = open_files.find(path);
-  if (file_iter != open_files.end()) {
-    LocalGridFile::ptr lgf = file_iter->second;
+  mongo::BSONObj file_obj;
+  if (fi->fh && open_version(fi->fh, &file_obj))
+    return read_stored_file(get_backend(), file_obj, buf, size, offset);
+
+  if (LocalGridFile::ptr lgf = local_file(path))
     return lgf->read(buf, size, offset);
-  }
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-  mongo::GridFile file = gf.findFile(path);
+  Backend& backend = get_backend();
+  file_obj = lookup_file(backend, path);
 
-  if (!file.exists())
+  if (file_obj.isEmpty())
     return -EBADF;
 
-  int chunk_size = file.getChunkSize();
-  int chunk_num = offset / chunk_size;
+  return read_stored_file(backend, file_obj, buf, size, offset);
+}
 
-  size_t len = 0;
-  while (len < size && chunk_num < file.getNumChunks()) {
-    mongo::GridFSChunk chunk = file.getChunk(chunk_num);
-    int to_read;
-    int cl = chunk.len();
+int gridfs_write(const char* path, const char* buf, size_t nbyte, off_t offset, struct fuse_file_info* ffi) {
+  if (is_control_path(path))
+    return control_write(path, buf, nbyte, offset, ffi);
 
-    const char *d = chunk.data(cl);
+  path = fuse_to_mongo_path(path);
+  if (open_files.find(path) == open_files.end())
+    return -ENOENT;
 
-    if (len) {
-      to_read = std::min((long unsigned)cl, (long unsigned)(size - len));
-      memcpy(buf + len, d, to_read);
-    } else {
-      to_read = std::min((long unsigned)(cl - (offset % chunk_size)), (long unsigned)(size - len));
-      memcpy(buf + len, d + (offset % chunk_size), to_read);
-    }
+  LocalGridFile::ptr lgf = open_files[path];
 
-    len += to_read;
-    chunk_num++;
+  write_budget.wait_for_room();
+  int written = lgf->write(buf, nbyte, offset);
+  if (written > 0 && lgf->journal()) {
+    int r = lgf->journal()->append(offset, buf, written);
+    if (r < 0)
+      return r;
   }
-
-  return len;
+  return written;
 }
 
-int gridfs_write(const char* path, const char* buf, size_t nbyte, off_t offset, struct fuse_file_info* ffi) {
+int gridfs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* ffi) {
+  if (is_control_path(path)) {
+    // Control files only ever take a few bytes
+    std::vector<char> flat(fuse_buf_size(buf));
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(flat.size());
+    dst.buf[0].mem = flat.data();
+    ssize_t n = fuse_buf_copy(&dst, buf, (enum fuse_buf_copy_flags)0);
+    if (n < 0)
+      return n;
+    return control_write(path, flat.data(), n, offset, ffi);
+  }
+
   path = fuse_to_mongo_path(path);
-  if (open_files.find(path) == open_files.end())
+  auto file_iter = open_files.find(path);
+  if (file_iter == open_files.end())
     return -ENOENT;
 
-  LocalGridFile::ptr lgf = open_files[path];
-
-  return lgf->write(buf, nbyte, offset);
+  LocalGridFile::ptr lgf = file_iter->second;
+  write_budget.wait_for_room();
+  int written = lgf->write_buf(buf, offset);
+  if (written > 0 && lgf->journal()) {
+    // The source may have been a pipe, so the bytes are taken back
+    // from the file
+    std::vector<char> scratch;
+    int r = lgf->journal()->append(offset, lgf->range(offset, written, scratch), written);
+    if (r < 0)
+      return r;
+  }
+  return written;
 }
 
 int gridfs_flush(const char* path, struct fuse_file_info *ffi) {
-  if (!ffi->fh)
+  mongo::BSONObj file_obj;
+  if (!ffi->fh || is_control_path(path) || open_version(ffi->fh, &file_obj))
     return 0;
 
   path = fuse_to_mongo_path(path);
@@ -145,37 +239,25 @@ int gridfs_flush(const char* path, struct fuse_file_info *ffi) {
   if (lgf->is_clean())
     return 0;
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-
-  if (gf.findFile(path).exists())
-    gf.removeFile(path);
-
-  size_t len = lgf->Length();
-  char *buf = new char[len];
-  lgf->read(buf, len, 0);
-
-  gf.storeFile(buf, len, path);
-
-  mongo::BSONObjBuilder b;
-  {
-    passwd *pw = getpwuid(lgf->Uid());
-    if (pw)
-      b.append("owner", pw->pw_name);
-  }
-  {
-    group *gr = getgrgid(lgf->Gid());
-    if (gr)
-      b.append("group", gr->gr_name);
+  // In --write-back mode the journal makes the file safe, and it is
+  // stored once released
+  if (lgf->journal()) {
+    int r = lgf->journal()->commit(*lgf);
+    if (r < 0)
+      return r;
+  } else {
+    store_local_file(get_backend(), path, *lgf);
   }
-  b.append("mode", lgf->Mode());
-
-  sdc->conn().update(db_name() + ".files",
-		     BSON("filename" << path),
-		     BSON("$set" << b.obj()));
 
   lgf->set_flushed();
 
   return 0;
 }
 
+
+int gridfs_truncate(const char* path, off_t size) {
+  if (is_control_path(path))
+    return control_truncate(path, size);
+
+  return -ENOSYS;
+}
@@ -15,19 +15,23 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <pwd.h>
-#include <grp.h>
 #include <string.h>
 
 #include "operations.h"
 #include "utils.h"
+#include "backend.h"
+#include "store.h"
+#include "attr_cache.h"
+#include "idmap.h"
+#include "query.h"
 
 int gridfs_readlink(const char* path, char* buf, size_t size) {
+  if (is_query_path(path))
+    return query_readlink(path, buf, size);
+
   path = fuse_to_mongo_path(path);
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::BSONObj file_obj = sdc->conn().findOne(db_name() + ".files",
-						BSON("filename" << path));
+  mongo::BSONObj file_obj = lookup_file(get_backend(), path);
 
   if (file_obj.isEmpty())
     return -ENOENT;
@@ -58,20 +62,11 @@ int gridfs_symlink(const char* target, const char* path) {
        << "md5" << 0
        << "mode" << (S_IFLNK | S_IRWXU | S_IRWXG | S_IRWXO)
        << "target" << target;
-  {
-    passwd *pw = getpwuid(context->uid);
-    if (pw)
-      file << "owner" << pw->pw_name;
-  }
-  {
-    group *gr = getgrgid(context->gid);
-    if (gr)
-      file << "group" << gr->gr_name;
-  }
+  append_owner(file, context->uid, context->gid);
 
-  auto sdc = make_ScopedDbConnection();
-  sdc->conn().insert(db_name() + ".files",
-		     file.obj());
+  mongo::BSONObj file_obj = file.obj();
+  get_backend().insert_file(file_obj);
+  attr_cache.put(path, file_obj);
 
   return 0;
 }
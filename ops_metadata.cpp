@@ -15,29 +15,28 @@
  *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <pwd.h>
-#include <grp.h>
 
 #include "operations.h"
 #include "options.h"
 #include "utils.h"
-
-unsigned int subdir_count(mongo::DBClientBase &client, std::string path) {
-  mongo::BSONObj proj = BSON("mode" << 1);
+#include "control.h"
+#include "query.h"
+#include "usage.h"
+#include "backend.h"
+#include "store.h"
+#include "attr_cache.h"
+#include "idmap.h"
+#include "writeback.h"
+
+unsigned int subdir_count(Backend& backend, std::string path) {
   std::string path_start = path;
   if (path.length() > 0)
     path_start += "/";
 
-  std::unique_ptr<mongo::DBClientCursor> cursor = client.query(db_name() + ".files",
-							       BSON("filename" <<
-								    BSON("$regex" << ("^" + path_start + "/[^/]*$"))
-								    ),
-							       0, 0,
-							       &proj);
-  std::string lastFN;
+  std::vector<mongo::BSONObj> files =
+    backend.list_files(path_start, true, BSON("mode" << 1));
   unsigned int count = 0;
-  while (cursor->more()) {
-    mongo::BSONObj file_obj = cursor->next();
+  for (auto& file_obj : files) {
     if (S_ISDIR(file_obj["mode"].Int()))
       count++;
   }
@@ -46,10 +45,12 @@ unsigned int subdir_count(mongo::DBClientBase &client, std::string path) {
 }
 
 int gridfs_getattr(const char *path, struct stat *stbuf) {
-  memset(stbuf, 0, sizeof(struct stat));
+  if (is_control_path(path))
+    return control_getattr(path, stbuf);
+  if (is_query_path(path))
+    return query_getattr(path, stbuf);
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::DBClientBase &client = sdc->conn();
+  memset(stbuf, 0, sizeof(struct stat));
 
   if (strcmp(path, "/") == 0) {
     stbuf->st_mode = S_IFDIR | 0777;
@@ -61,45 +62,33 @@ int gridfs_getattr(const char *path, struct stat *stbuf) {
   }
 
   path = fuse_to_mongo_path(path);
-  auto file_iter = open_files.find(path);
-
-  if (file_iter != open_files.end()) {
-    LocalGridFile::ptr lgf = file_iter->second;
+  if (LocalGridFile::ptr lgf = local_file(path)) {
     stbuf->st_mode = S_IFREG | (lgf->Mode() & (0xffff ^ S_IFMT));
     stbuf->st_nlink = 1;
     stbuf->st_uid = lgf->Uid();
     stbuf->st_gid = lgf->Gid();
     stbuf->st_ctime = time(NULL);
-    stbuf->st_mtime = time(NULL);
+    stbuf->st_mtime = lgf->MTime() ? lgf->MTime() / 1000 : time(NULL);
     stbuf->st_size = lgf->Length();
     return 0;
   }
 
-  mongo::BSONObj file_obj = client.findOne(db_name() + ".files",
-					   BSON("filename" << path));
+  Backend& backend = get_backend();
+  mongo::BSONObj file_obj = lookup_file(backend, path);
 
   if (file_obj.isEmpty())
     return -ENOENT;
 
-  if (file_obj.hasField("owner")) {
-    passwd *pw = getpwnam(file_obj["owner"].str().c_str());
-    if (pw)
-      stbuf->st_uid = pw->pw_uid;
-  }
-  if (file_obj.hasField("group")) {
-    group *gr = getgrnam(file_obj["group"].str().c_str());
-    if (gr)
-      stbuf->st_gid = gr->gr_gid;
-  }
+  file_owner(file_obj, &stbuf->st_uid, &stbuf->st_gid);
 
   stbuf->st_mode = file_obj["mode"].Int();
   if (S_ISREG(stbuf->st_mode)) {
     stbuf->st_nlink = 1;
-    stbuf->st_size = file_obj["length"].Int();
+    stbuf->st_size = file_obj["length"].numberLong();
     stbuf->st_blocks = stbuf->st_size >> 9;
   }
   if (S_ISDIR(stbuf->st_mode))
-    stbuf->st_nlink = 2 + subdir_count(client, path);
+    stbuf->st_nlink = 2 + subdir_count(backend, path);
   if (S_ISLNK(stbuf->st_mode))
     stbuf->st_size = file_obj["target"].String().length();
 
@@ -119,10 +108,17 @@ int gridfs_chmod(const char* path, mode_t mode) {
     lgf->setMode(mode);
   }
 
-  auto sdc = make_ScopedDbConnection();
-  sdc->conn().update(db_name() + ".files",
-		     BSON("filename" << path),
-		     BSON("$set" << BSON("mode" << mode)));
+  int r = write_back.amend(path, [mode](LocalGridFile& lgf) {
+    lgf.setMode(mode);
+    return 0;
+  });
+  if (r <= 0)
+    return r;
+  r = write_back.settle(path);
+  if (r < 0)
+    return r;
+
+  attr_cache.put(path, get_backend().update_file(path, BSON("$set" << BSON("mode" << mode))));
 
   return 0;
 }
@@ -137,25 +133,23 @@ int gridfs_chown(const char* path, uid_t uid, gid_t gid) {
     lgf->setGid(gid);
   }
 
-  mongo::BSONObjBuilder b;
+  int r = write_back.amend(path, [uid, gid](LocalGridFile& lgf) {
+    lgf.setUid(uid);
+    lgf.setGid(gid);
+    return 0;
+  });
+  if (r <= 0)
+    return r;
+  r = write_back.settle(path);
+  if (r < 0)
+    return r;
 
-  {
-    passwd *pw = getpwuid(uid);
-    if (pw)
-      b.append("owner", pw->pw_name);
-  }
-  {
-    group *gr = getgrgid(gid);
-    if (gr)
-      b.append("group", gr->gr_name);
-  }
+  mongo::BSONObjBuilder b;
+  append_owner(b, uid, gid);
+  mongo::BSONObj owner = b.obj();
 
-  if (b.hasField("owner") || b.hasField("group")) {
-    auto sdc = make_ScopedDbConnection();
-    sdc->conn().update(db_name() + ".files",
-		       BSON("filename" << path),
-		       BSON("$set" << b.obj()));
-  }
+  if (!owner.isEmpty())
+    attr_cache.put(path, get_backend().update_file(path, BSON("$set" << owner)));
 
   return 0;
 }
@@ -165,12 +159,19 @@ int gridfs_utimens(const char* path, const struct timespec tv[2]) {
 
   unsigned long long millis = ((unsigned long long)tv[1].tv_sec * 1000) + (tv[1].tv_nsec / 1e+6);
 
-  auto sdc = make_ScopedDbConnection();
-  sdc->conn().update(db_name() + ".files",
-		     BSON("filename" << path),
-		     BSON("$set" <<
-			  BSON("uploadDate" << mongo::Date_t(millis))
-			  ));
+  int r = write_back.amend(path, [millis](LocalGridFile& lgf) {
+    lgf.setMTime(millis);
+    return 0;
+  });
+  if (r <= 0)
+    return r;
+  r = write_back.settle(path);
+  if (r < 0)
+    return r;
+
+  attr_cache.put(path, get_backend().update_file(path, BSON("$set" <<
+                                                            BSON("uploadDate" << mongo::Date_t(millis))
+                                                            )));
 
   return 0;
 }
@@ -178,20 +179,52 @@ int gridfs_utimens(const char* path, const struct timespec tv[2]) {
 int gridfs_rename(const char* old_path, const char* new_path) {
   old_path = fuse_to_mongo_path(old_path);
   new_path = fuse_to_mongo_path(new_path);
-
-  auto sdc = make_ScopedDbConnection();
-  mongo::DBClientBase &client = sdc->conn();
-
-  mongo::BSONObj file_obj = client.findOne(db_name() + ".files",
-				    BSON("filename" << old_path));
+  int r = write_back.settle(old_path);
+  if (r == 0)
+    r = write_back.settle(new_path);
+  if (r < 0)
+    return r;
+
+  Backend& backend = get_backend();
+  mongo::BSONObj replaced = backend.find_file(new_path);
+  attr_cache.forget(old_path);
+
+  /* Renaming over a file replaces it without new_path ever going
+     missing or back. The new name and a new version are set in one
+     update, which makes the renamed document current over whatever
+     new_path held, and what it replaces is retired after. */
+  mongo::BSONObj file_obj =
+    backend.update_file(old_path, BSON("$set" << BSON("filename" << new_path
+                                                      << "version" << mongo::OID::gen())));
 
   if (file_obj.isEmpty())
     return -ENOENT;
 
-  client.update(db_name() + ".files",
-		BSON("_id" << file_obj.getField("_id")),
-		BSON("$set" << BSON("filename" << new_path)));
+  attr_cache.put(new_path, file_obj);
+  if (!replaced.isEmpty() && !(replaced["_id"] == file_obj["_id"]))
+    backend.retire_file(replaced, gridfs_options.retire_delay);
 
   return 0;
 }
 
+int gridfs_statfs(const char* path, struct statvfs* stbuf) {
+  Backend::usage u;
+  int r = bucket_usage(&u);
+  if (r < 0)
+    return r;
+
+  memset(stbuf, 0, sizeof(struct statvfs));
+  const unsigned long block = 4096;
+  stbuf->f_bsize = block;
+  stbuf->f_frsize = block;
+  stbuf->f_blocks = (u.used + u.avail + block - 1) / block;
+  stbuf->f_bfree = u.avail / block;
+  stbuf->f_bavail = u.avail / block;
+  // Files documents have no limit; leave df -i plenty of headroom
+  stbuf->f_ffree = 1ULL << 32;
+  stbuf->f_favail = stbuf->f_ffree;
+  stbuf->f_files = u.files + stbuf->f_ffree;
+  stbuf->f_namemax = 255;
+
+  return 0;
+}
@@ -18,25 +18,207 @@
 #include "operations.h"
 #include "utils.h"
 #include "options.h"
+#include "backend.h"
+#include "store.h"
+#include "attr_cache.h"
+#include "gc.h"
+#include "usage.h"
+#include "writeback.h"
 
 #ifdef __linux__
 #include <sys/xattr.h>
 #endif
 
-int gridfs_listxattr(const char* path, char* list, size_t size) {
-  path = fuse_to_mongo_path(path);
-  if (open_files.find(path) != open_files.end())
+#ifndef XATTR_CREATE
+#define XATTR_CREATE 1
+#define XATTR_REPLACE 2
+#endif
+
+/* Read-only attributes of the mount root reporting the chunk collector */
+static const char* root_xattrs[] = {
+  "gridfs.gc.pending_files",
+  "gridfs.gc.pending_chunks",
+  "gridfs.gc.collected_files",
+  "gridfs.gc.collected_chunks",
+  NULL
+};
+
+/* Copy out an attribute value with its terminating NUL, or return the
+   size needed when size is 0. */
+static int xattr_value(const std::string& str, char* value, size_t size) {
+  size_t len = str.size() + 1;
+  if (size == 0)
+    return len;
+  if (len >= size)
+    return -ERANGE;
+
+  memcpy(value, str.c_str(), len);
+
+  return len;
+}
+
+static bool is_usage_xattr(const char* attr_name) {
+  return strcmp(attr_name, "gridfs.bytes") == 0 || strcmp(attr_name, "gridfs.files") == 0;
+}
+
+/* user.gridfs.bytes and user.gridfs.files: the total length and number
+   of regular files anywhere below a directory, added up by the server.
+   They aren't listed, so tools copying attributes along with a tree
+   don't run an aggregation for every directory. */
+static int usage_xattr(const std::string& dir, const char* attr_name, char* value, size_t size) {
+  long long bytes, files;
+  int r = dir_usage(dir, &bytes, &files);
+  if (r < 0)
+    return r;
+
+  return xattr_value(std::to_string(strcmp(attr_name, "gridfs.bytes") == 0 ? bytes : files),
+                     value, size);
+}
+
+static int root_getxattr(const char* attr_name, char* value, size_t size) {
+  if (is_usage_xattr(attr_name))
+    return usage_xattr("", attr_name, value, size);
+
+  gc_stats gc = chunk_gc_stats();
+  unsigned long long v;
+  if (strcmp(attr_name, "gridfs.gc.pending_files") == 0)
+    v = gc.pending_files;
+  else if (strcmp(attr_name, "gridfs.gc.pending_chunks") == 0)
+    v = gc.pending_chunks;
+  else if (strcmp(attr_name, "gridfs.gc.collected_files") == 0)
+    v = gc.collected_files;
+  else if (strcmp(attr_name, "gridfs.gc.collected_chunks") == 0)
+    v = gc.collected_chunks;
+  else
+    return -ENODATA;
+
+  return xattr_value(std::to_string(v), value, size);
+}
+
+static int root_listxattr(char* list, size_t size) {
+  size_t len = 0;
+  for (const char** name = root_xattrs; *name; name++) {
+    std::string attr_name = namespace_xattr(*name);
+    int field_len = attr_name.size() + 1;
+    len += field_len;
+    if (len < size) {
+      memcpy(list, attr_name.c_str(), field_len);
+      list += field_len;
+    }
+  }
+
+  if (size == 0)
+    return len;
+  if (len >= size)
+    return -ERANGE;
+
+  return len;
+}
+
+/* The metadata sub-document of path, from the file itself while it is
+   open for writing or waiting to be stored. Returns 0 or -ENOENT. */
+static int file_metadata(const char* path, mongo::BSONObj* metadata) {
+  if (LocalGridFile::ptr lgf = local_file(path)) {
+    *metadata = lgf->Metadata();
     return 0;
+  }
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-  mongo::GridFile file = gf.findFile(path);
+  mongo::BSONObj file_obj = lookup_file(get_backend(), path);
+  if (file_obj.isEmpty())
+    return -ENOENT;
+
+  *metadata = file_obj.getObjectField("metadata").getOwned();
+  return 0;
+}
+
+/* An attribute set or removed on a file open for writing, kept until
+   the file is stored. */
+static int set_local_xattr(LocalGridFile& lgf, const char* attr_name,
+                           const char* value, size_t size, int flags) {
+  mongo::BSONObj metadata = lgf.Metadata();
+  bool exists = metadata.hasField(attr_name);
+  if ((flags & XATTR_CREATE) && exists)
+    return -EEXIST;
+  if ((flags & XATTR_REPLACE) && !exists)
+    return -ENOATTR;
+
+  mongo::BSONObjBuilder b;
+  b.appendElements(metadata.removeField(attr_name));
+  if (value)
+    b << attr_name << std::string(value, size);
+  lgf.setMetadata(b.obj());
+
+  return 0;
+}
 
-  if (!file.exists())
+/* user.gridfs.chunk_size: the chunk size a file is stored with. Set on a
+   file still open for writing it decides that file's. Set on a
+   directory it becomes the directory's chunkSize and applies to files
+   stored below it. 0 puts the choice back with the mount. */
+static int chunk_size_xattr(const char* path, char* value, size_t size) {
+  long long chunk_size;
+  if (LocalGridFile::ptr lgf = local_file(path)) {
+    chunk_size = lgf->StoredChunkSize();
+  } else {
+    mongo::BSONObj file_obj = lookup_file(get_backend(), path);
+    if (file_obj.isEmpty())
+      return -ENOENT;
+    chunk_size = file_obj["chunkSize"].numberLong();
+  }
+
+  return xattr_value(std::to_string(chunk_size), value, size);
+}
+
+static int set_chunk_size_xattr(const char* path, const char* value, size_t size) {
+  std::string str(value, size);
+  char* end;
+  unsigned long long chunk_size = strtoull(str.c_str(), &end, 10);
+  if (str.empty() || *end || chunk_size > 16 * 1024 * 1024)
+    return -EINVAL;
+
+  auto file_iter = open_files.find(path);
+  if (file_iter != open_files.end()) {
+    file_iter->second->setStoredChunkSize(chunk_size);
+    return 0;
+  }
+
+  // A stored file would have to be chunked all over again
+  int r = write_back.settle(path);
+  if (r < 0)
+    return r;
+  mongo::BSONObj file_obj = lookup_file(get_backend(), path);
+  if (file_obj.isEmpty())
+    return -ENOENT;
+  if (!S_ISDIR(file_obj["mode"].Int()))
+    return -EINVAL;
+
+  file_obj = get_backend().update_file(path, BSON("$set" << BSON("chunkSize" << (int)chunk_size)));
+  if (file_obj.isEmpty())
     return -ENOENT;
 
+  attr_cache.put(path, file_obj);
+  return 0;
+}
+
+/* Why a conditional update of path matched nothing. */
+static int update_failed(const char* path, int flags) {
+  attr_cache.forget(path);
+  if (get_backend().find_file(path).isEmpty())
+    return -ENOENT;
+  return (flags & XATTR_CREATE) ? -EEXIST : -ENOATTR;
+}
+
+int gridfs_listxattr(const char* path, char* list, size_t size) {
+  if (strcmp(path, "/") == 0)
+    return root_listxattr(list, size);
+
+  path = fuse_to_mongo_path(path);
+  mongo::BSONObj metadata;
+  int r = file_metadata(path, &metadata);
+  if (r < 0)
+    return r;
+
   size_t len = 0;
-  mongo::BSONObj metadata = file.getMetadata();
   std::set<std::string> field_set;
   metadata.getFieldNames(field_set);
   for (auto s : field_set) {
@@ -58,42 +240,36 @@ int gridfs_listxattr(const char* path, char* list, size_t size) {
 }
 
 int gridfs_getxattr(const char* path, const char* name, char* value, size_t size) {
-  if (strcmp(path, "/") == 0)
-    return -ENODATA;
-
   const char* attr_name = unnamespace_xattr(name);
   if (!attr_name)
     return -ENODATA;
 
-  path = fuse_to_mongo_path(path);
-  if (open_files.find(path) != open_files.end())
-    return -ENOATTR;
+  if (strcmp(path, "/") == 0)
+    return root_getxattr(attr_name, value, size);
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::GridFS gf = get_gridfs(sdc);
-  mongo::GridFile file = gf.findFile(path);
+  path = fuse_to_mongo_path(path);
+  if (strcmp(attr_name, "gridfs.chunk_size") == 0)
+    return chunk_size_xattr(path, value, size);
+  if (is_usage_xattr(attr_name)) {
+    mongo::BSONObj file_obj = lookup_file(get_backend(), path);
+    if (file_obj.isEmpty())
+      return -ENOENT;
+    if (!S_ISDIR(file_obj["mode"].Int()))
+      return -ENOATTR;
+    return usage_xattr(path, attr_name, value, size);
+  }
 
-  if (!file.exists())
-    return -ENOENT;
-
-  mongo::BSONObj metadata = file.getMetadata();
-  if (metadata.isEmpty())
-    return -ENOATTR;
+  mongo::BSONObj metadata;
+  int r = file_metadata(path, &metadata);
+  if (r < 0)
+    return r;
 
   mongo::BSONElement field = metadata[attr_name];
   if (field.eoo())
     return -ENOATTR;
 
-  std::string field_str = field.toString();
-  size_t len = field_str.size() + 1;
-  if (size == 0)
-    return len;
-  if (len >= size)
-    return -ERANGE;
-
-  memcpy(value, field_str.c_str(), len);
-
-  return len;
+  return xattr_value(field.type() == mongo::String ? field.String() : field.toString(false),
+                     value, size);
 }
 
 int gridfs_setxattr(const char* path, const char* name, const char* value, size_t size, int flags) {
@@ -105,24 +281,58 @@ int gridfs_setxattr(const char* path, const char* name, const char* value, size_
     return -ENODATA;
 
   path = fuse_to_mongo_path(path);
-  if (open_files.find(path) != open_files.end())
-    return -ENOATTR;
 
-  auto sdc = make_ScopedDbConnection();
-  mongo::DBClientBase &client = sdc->conn();
+  // Write-only trigger for a server side copy, for tools that can't
+  // use copy_file_range: setfattr -n user.gridfs.copy_to -v /dst src
+  if (strcmp(attr_name, "gridfs.copy_to") == 0) {
+    std::string dst(value, size);
+    dst = fuse_to_mongo_path(dst.c_str());
+    if (dst.empty())
+      return -EINVAL;
+    if (open_files.find(dst) != open_files.end() ||
+        open_files.find(path) != open_files.end())
+      return -EBUSY;
+    int r = write_back.settle(path);
+    if (r == 0)
+      r = write_back.settle(dst);
+    if (r < 0)
+      return r;
+    attr_cache.forget(dst);
+    return get_backend().copy_file(path, dst);
+  }
 
-  mongo::BSONObj file_obj = client.findOne(db_name() + ".files",
-					   BSON("filename" << path));
+  if (strcmp(attr_name, "gridfs.chunk_size") == 0)
+    return set_chunk_size_xattr(path, value, size);
+
+  auto file_iter = open_files.find(path);
+  if (file_iter != open_files.end())
+    return set_local_xattr(*file_iter->second, attr_name, value, size, flags);
+
+  int r = write_back.amend(path, [attr_name, value, size, flags](LocalGridFile& lgf) {
+    return set_local_xattr(lgf, attr_name, value, size, flags);
+  });
+  if (r <= 0)
+    return r;
+  r = write_back.settle(path);
+  if (r < 0)
+    return r;
+
+  // The flags become part of the update, so it stays one round trip
+  std::string field = std::string("metadata.") + attr_name;
+  mongo::BSONObj condition;
+  if (flags & XATTR_CREATE)
+    condition = BSON(field << BSON("$exists" << false));
+  else if (flags & XATTR_REPLACE)
+    condition = BSON(field << BSON("$exists" << true));
+
+  mongo::BSONObj file_obj =
+    get_backend().update_file(path, BSON("$set" << BSON(field << std::string(value, size))),
+                              condition);
 
   if (file_obj.isEmpty())
-    return -ENOENT;
-
-  client.update(db_name() + ".files",
-		BSON("filename" << path),
-		BSON("$set" <<
-		     BSON((std::string("metadata.") + attr_name) << value)
-		     ));
+    return update_failed(path, flags);
 
+  attr_cache.put(path, file_obj);
   return 0;
 }
 
@@ -135,24 +345,27 @@ int gridfs_removexattr(const char* path, const char* name) {
     return -ENODATA;
 
   path = fuse_to_mongo_path(path);
-  if (open_files.find(path) != open_files.end())
-    return -ENOATTR;
-
-  auto sdc = make_ScopedDbConnection();
-  mongo::DBClientBase &client = sdc->conn();
-
-  mongo::BSONObj file_obj = client.findOne(db_name() + ".files",
-					   BSON("filename" << path));
+  auto file_iter = open_files.find(path);
+  if (file_iter != open_files.end())
+    return set_local_xattr(*file_iter->second, attr_name, NULL, 0, XATTR_REPLACE);
+
+  int r = write_back.amend(path, [attr_name](LocalGridFile& lgf) {
+    return set_local_xattr(lgf, attr_name, NULL, 0, XATTR_REPLACE);
+  });
+  if (r <= 0)
+    return r;
+  r = write_back.settle(path);
+  if (r < 0)
+    return r;
+
+  std::string field = std::string("metadata.") + attr_name;
+  mongo::BSONObj file_obj =
+    get_backend().update_file(path, BSON("$unset" << BSON(field << "")),
+                              BSON(field << BSON("$exists" << true)));
 
   if (file_obj.isEmpty())
-    return -ENOENT;
-
-  client.update(db_name() + ".files",
-		BSON("filename" << path),
-		BSON("$unset" <<
-		     BSON((std::string("metadata.") + attr_name) << "")
-		     ));
+    return update_failed(path, XATTR_REPLACE);
 
+  attr_cache.put(path, file_obj);
   return 0;
 }
-
@@ -29,6 +29,37 @@ struct fuse_opt gridfs_opts[] = {
   GRIDFS_OPT_KEY("--prefix=%s", prefix, 0),
   GRIDFS_OPT_KEY("--username=%s", username, 0),
   GRIDFS_OPT_KEY("--password=%s", password, 0),
+  GRIDFS_OPT_KEY("--hash=%s", hash, 0),
+  GRIDFS_OPT_KEY("--compress=%s", compress, 0),
+  GRIDFS_OPT_KEY("--cache-size=%u", cache_size, 0),
+  GRIDFS_OPT_KEY("--dedup", dedup, 1),
+  GRIDFS_OPT_KEY("--gc-rate=%u", gc_rate, 0),
+  GRIDFS_OPT_KEY("--trace", trace, 1),
+  GRIDFS_OPT_KEY("--backend=%s", backend, 0),
+  GRIDFS_OPT_KEY("--backend-latency=%u", backend_latency, 0),
+  GRIDFS_OPT_KEY("--record=%s", record, 0),
+  GRIDFS_OPT_KEY("--io-threads=%u", io_threads, 0),
+  GRIDFS_OPT_KEY("--read-parallel=%u", read_parallel, 0),
+  GRIDFS_OPT_KEY("--readahead=%u", readahead, 0),
+  GRIDFS_OPT_KEY("--upload-parallel=%u", upload_parallel, 0),
+  GRIDFS_OPT_KEY("--disk-cache=%s", disk_cache, 0),
+  GRIDFS_OPT_KEY("--disk-cache-size=%u", disk_cache_size, 0),
+  GRIDFS_OPT_KEY("--replset=%s", replset, 0),
+  GRIDFS_OPT_KEY("--read-pref=%s", read_pref, 0),
+  GRIDFS_OPT_KEY("--chunk-read-pref=%s", chunk_read_pref, 0),
+  GRIDFS_OPT_KEY("--max-staleness=%u", max_staleness, 0),
+  GRIDFS_OPT_KEY("--attr-timeout=%u", attr_timeout, 0),
+  GRIDFS_OPT_KEY("--idmap-timeout=%u", idmap_timeout, 0),
+  GRIDFS_OPT_KEY("--idmap-preload", idmap_preload, 1),
+  GRIDFS_OPT_KEY("--store-ids", store_ids, 1),
+  GRIDFS_OPT_KEY("--write-budget=%u", write_budget, 0),
+  GRIDFS_OPT_KEY("--spill-dir=%s", spill_dir, 0),
+  GRIDFS_OPT_KEY("--min-chunk-size=%u", min_chunk_size, 0),
+  GRIDFS_OPT_KEY("--max-chunk-size=%u", max_chunk_size, 0),
+  GRIDFS_OPT_KEY("--usage-timeout=%u", usage_timeout, 0),
+  GRIDFS_OPT_KEY("--write-back=%s", write_back, 0),
+  GRIDFS_OPT_KEY("--journal-sync=%s", journal_sync, 0),
+  GRIDFS_OPT_KEY("--retire-delay=%u", retire_delay, 0),
   FUSE_OPT_KEY("-v", KEY_VERSION),
   FUSE_OPT_KEY("--version", KEY_VERSION),
   FUSE_OPT_KEY("-h", KEY_HELP),
@@ -55,10 +86,42 @@ void print_help() {
   cout << endl << "general options:" << endl;
   cout << "\t--host=[hostname]\thostname of your mongodb server" << endl;
   cout << "\t--port=[port]\tport of your mongodb server" << endl;
+  cout << "\t--replset=[name]\treplica set to connect to, --host lists its seeds (host:port,...)" << endl;
   cout << "\t--db=[dbname]\t\twhich mongo database to use" << endl;
   cout << "\t--prefix=[prefix]\tprefix of your gridFS" << endl;
   cout << "\t--username=[username]\tusername of your mongodb server" << endl;
   cout << "\t--password=[password]\tpassword of your mongodb server" << endl;
+  cout << "\t--hash=[md5|xxh64|none]\tchecksum stored with written files (default md5)" << endl;
+  cout << "\t--compress=[lz4|zstd]\tcompress chunks of written files" << endl;
+  cout << "\t--cache-size=[MB]\tmemory for cached chunks (default 64)" << endl;
+  cout << "\t--dedup\t\t\tstore identical chunks only once" << endl;
+  cout << "\t--gc-rate=[chunks]\tchunks of deleted files removed per second (default 1000)" << endl;
+  cout << "\t--trace\t\t\trecord a Chrome trace from mount time (see /.gridfs/trace)" << endl;
+  cout << "\t--backend=[name]\tmongo (default) or memory, which keeps files in this process" << endl;
+  cout << "\t--backend-latency=[us]\tdelay added to every memory backend call" << endl;
+  cout << "\t--record=[file]\t\tlog every operation for replay_gridfs" << endl;
+  cout << "\t--io-threads=[n]\tworkers for storage requests (default 16)" << endl;
+  cout << "\t--read-parallel=[n]\tchunks of one read fetched at once (default 4)" << endl;
+  cout << "\t--readahead=[chunks]\tchunks fetched ahead of sequential readers, 0 to disable (default 8)" << endl;
+  cout << "\t--upload-parallel=[n]\tchunk batches of one flush in flight (default 4)" << endl;
+  cout << "\t--disk-cache=[dir]\tkeep fetched chunks on local disk across mounts" << endl;
+  cout << "\t--disk-cache-size=[MB]\tdisk space for --disk-cache (default 4096)" << endl;
+  cout << "\t--read-pref=[mode]\twhere file metadata is read: primary (default), primaryPreferred," << endl;
+  cout << "\t\t\t\tsecondary, secondaryPreferred or nearest" << endl;
+  cout << "\t--chunk-read-pref=[mode]\twhere chunk data is read (default --read-pref)" << endl;
+  cout << "\t--max-staleness=[s]\tskip secondaries further behind than this (90 or more)" << endl;
+  cout << "\t--attr-timeout=[s]\thow long file attributes are cached, 0 to disable (default 1)" << endl;
+  cout << "\t--idmap-timeout=[s]\thow long user and group names are cached (default 600)" << endl;
+  cout << "\t--idmap-preload\t\tresolve all users and groups at mount" << endl;
+  cout << "\t--store-ids\t\talso store numeric uid and gid, and trust them over names" << endl;
+  cout << "\t--write-budget=[MB]\tmemory for files being written, all together (default 1024)" << endl;
+  cout << "\t--spill-dir=[dir]\twhere write buffers go past 3/4 of the budget (default /tmp)" << endl;
+  cout << "\t--min-chunk-size=[KB]\tsmallest chunk size files are stored with (default 256)" << endl;
+  cout << "\t--max-chunk-size=[KB]\tlargest chunk size, for the biggest files (default 4096)" << endl;
+  cout << "\t--usage-timeout=[s]\thow long directory and bucket usage is cached, 0 to disable (default 5)" << endl;
+  cout << "\t--write-back=[dir]\tjournal written files in dir and store them after close returns" << endl;
+  cout << "\t--journal-sync=[close|write|none]\twhen the --write-back journal is synced (default close)" << endl;
+  cout << "\t--retire-delay=[s]\thow long chunks of replaced and removed files are kept (default 300)" << endl;
   cout << "\t-h, --help\t\tprint help" << endl;
   cout << "\t-v, --version\t\tprint version" << endl;
   cout << endl << "FUSE options: " << endl;
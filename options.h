@@ -23,6 +23,14 @@
 #include <mongo/client/dbclient.h>
 #include <cstddef>
 
+#include "codec.h"
+
+enum hash_mode {
+  HASH_MD5,
+  HASH_XXH64,
+  HASH_NONE
+};
+
 struct gridfs_options {
   const char* host;
   int port;
@@ -31,6 +39,39 @@ struct gridfs_options {
   const char* prefix;
   const char* username;
   const char* password;
+  const char* hash;
+  hash_mode hashing;
+  const char* compress;
+  chunk_codec compression;
+  unsigned int cache_size;
+  int dedup;
+  unsigned int gc_rate;
+  int trace;
+  const char* backend;
+  unsigned int backend_latency;
+  const char* record;
+  unsigned int io_threads;
+  unsigned int read_parallel;
+  unsigned int readahead;
+  unsigned int upload_parallel;
+  const char* disk_cache;
+  unsigned int disk_cache_size;
+  const char* replset;
+  const char* read_pref;
+  const char* chunk_read_pref;
+  unsigned int max_staleness;
+  unsigned int attr_timeout;
+  unsigned int idmap_timeout;
+  int idmap_preload;
+  int store_ids;
+  unsigned int write_budget;
+  const char* spill_dir;
+  unsigned int min_chunk_size;
+  unsigned int max_chunk_size;
+  unsigned int usage_timeout;
+  const char* write_back;
+  const char* journal_sync;
+  unsigned int retire_delay;
 };
 
 extern gridfs_options gridfs_options;
@@ -0,0 +1,305 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <ctime>
+#include <vector>
+
+#include <mongo/bson/bson.h>
+
+#include "query.h"
+#include "backend.h"
+
+namespace {
+
+int hex_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+// Entry names only ever have %XX escapes; filters are form encoded
+bool url_decode(const std::string& in, std::string* out, bool plus_is_space = true) {
+  out->clear();
+  for (size_t i = 0; i < in.size(); i++) {
+    if (in[i] == '+' && plus_is_space) {
+      out->push_back(' ');
+    } else if (in[i] == '%') {
+      if (i + 2 >= in.size() || hex_digit(in[i + 1]) < 0 || hex_digit(in[i + 2]) < 0)
+        return false;
+      out->push_back(hex_digit(in[i + 1]) * 16 + hex_digit(in[i + 2]));
+      i += 2;
+    } else {
+      out->push_back(in[i]);
+    }
+  }
+  return true;
+}
+
+// Entry names have to be a single path component
+std::string entry_name(const std::string& path) {
+  std::string name;
+  for (char c : path) {
+    if (c == '%')
+      name += "%25";
+    else if (c == '/')
+      name += "%2F";
+    else
+      name.push_back(c);
+  }
+  return name;
+}
+
+std::string glob_to_regex(const std::string& glob) {
+  std::string re;
+  for (size_t i = 0; i < glob.size(); i++) {
+    char c = glob[i];
+    if (c == '*' && i + 1 < glob.size() && glob[i + 1] == '*') {
+      re += ".*";
+      i++;
+    } else if (c == '*') {
+      re += "[^/]*";
+    } else if (c == '?') {
+      re += "[^/]";
+    } else if (c == '[') {
+      size_t close = glob.find(']', i + 1);
+      if (close == std::string::npos) {
+        re += "\\[";
+      } else {
+        std::string set = glob.substr(i + 1, close - i - 1);
+        if (!set.empty() && set[0] == '!')
+          set[0] = '^';
+        re += "[" + set + "]";
+        i = close;
+      }
+    } else {
+      if (strchr("\\^$.|+(){}", c))
+        re.push_back('\\');
+      re.push_back(c);
+    }
+  }
+  return re;
+}
+
+bool parse_size(const std::string& s, long long* size) {
+  char* end;
+  *size = strtoll(s.c_str(), &end, 10);
+  if (s.empty() || *size < 0)
+    return false;
+  switch (*end) {
+  case 'k': case 'K': *size <<= 10; end++; break;
+  case 'm': case 'M': *size <<= 20; end++; break;
+  case 'g': case 'G': *size <<= 30; end++; break;
+  }
+  return *end == 0;
+}
+
+bool parse_date(const std::string& s, mongo::Date_t* date) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char* end = strptime(s.c_str(), "%Y-%m-%dT%H:%M:%S", &tm);
+  if (!end || *end) {
+    memset(&tm, 0, sizeof(tm));
+    end = strptime(s.c_str(), "%Y-%m-%d", &tm);
+  }
+  if (end && !*end) {
+    *date = mongo::Date_t((unsigned long long)timegm(&tm) * 1000);
+    return true;
+  }
+
+  char* num_end;
+  long long seconds = strtoll(s.c_str(), &num_end, 10);
+  if (s.empty() || *num_end || seconds < 0)
+    return false;
+  *date = mongo::Date_t((unsigned long long)seconds * 1000);
+  return true;
+}
+
+/* The filter of /.query/<filter>[/...], or false if path has none or it
+   doesn't parse. */
+bool query_of(const char* path, mongo::BSONObj* filter, int* limit, std::string* rest) {
+  std::string p = path + strlen("/.query/");
+  size_t slash = p.find('/');
+  if (rest)
+    *rest = slash == std::string::npos ? "" : p.substr(slash + 1);
+  return parse_query(p.substr(0, slash), filter, limit);
+}
+
+}
+
+bool parse_query(const std::string& text, mongo::BSONObj* filter, int* limit) {
+  mongo::BSONArrayBuilder clauses;
+  int count = 0;
+  *limit = 0;
+
+  size_t start = 0;
+  while (start <= text.size()) {
+    size_t amp = text.find('&', start);
+    if (amp == std::string::npos)
+      amp = text.size();
+    std::string param = text.substr(start, amp - start);
+    start = amp + 1;
+    if (param.empty())
+      continue;
+
+    size_t eq = param.find('=');
+    std::string key, value;
+    if (eq == std::string::npos ||
+        !url_decode(param.substr(0, eq), &key) ||
+        !url_decode(param.substr(eq + 1), &value))
+      return false;
+
+    long long size;
+    mongo::Date_t date;
+    if (key == "path") {
+      // Stored names have no leading slash
+      value.erase(0, value.find_first_not_of('/'));
+      clauses.append(BSON("filename" << BSON("$regex" << "^" + glob_to_regex(value) + "$")));
+    } else if (key == "name") {
+      clauses.append(BSON("filename" << BSON("$regex" << "(^|/)" + glob_to_regex(value) + "$")));
+    } else if (key == "regex") {
+      clauses.append(BSON("filename" << BSON("$regex" << value)));
+    } else if (key == "min_size" && parse_size(value, &size)) {
+      clauses.append(BSON("length" << BSON("$gte" << size)));
+    } else if (key == "max_size" && parse_size(value, &size)) {
+      clauses.append(BSON("length" << BSON("$lte" << size)));
+    } else if (key == "after" && parse_date(value, &date)) {
+      clauses.append(BSON("uploadDate" << BSON("$gte" << date)));
+    } else if (key == "before" && parse_date(value, &date)) {
+      clauses.append(BSON("uploadDate" << BSON("$lt" << date)));
+    } else if (key.compare(0, 5, "meta.") == 0 && key.size() > 5) {
+      clauses.append(BSON("metadata." + key.substr(5) << value));
+    } else if (key == "limit" && parse_size(value, &size) && size < (1 << 30)) {
+      *limit = size;
+      continue;
+    } else {
+      return false;
+    }
+    count++;
+  }
+
+  mongo::BSONArray all = clauses.arr();
+  if (count == 0)
+    *filter = mongo::BSONObj();
+  else if (count == 1)
+    *filter = all.firstElement().Obj().getOwned();
+  else
+    *filter = BSON("$and" << all);
+  return true;
+}
+
+/* Whether the file named filename is one the filter finds: 0, -ENOENT,
+   or -EINVAL when the server won't run the filter. The limit only
+   bounds what readdir lists. */
+static int query_member(const mongo::BSONObj& filter, const std::string& filename) {
+  mongo::BSONObj named = BSON("filename" << filename);
+  mongo::BSONObj both = filter.isEmpty() ? named : BSON("$and" << BSON_ARRAY(filter << named));
+  try {
+    if (get_backend().find_files(both, 1, BSON("_id" << 1)).empty())
+      return -ENOENT;
+  } catch (const std::exception& e) {
+    fprintf(stderr, "query for %s failed: %s\n", filename.c_str(), e.what());
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int query_getattr(const char* path, struct stat* stbuf) {
+  memset(stbuf, 0, sizeof(struct stat));
+  fuse_context *context = fuse_get_context();
+  stbuf->st_uid = context->uid;
+  stbuf->st_gid = context->gid;
+  stbuf->st_ctime = stbuf->st_mtime = time(NULL);
+
+  mongo::BSONObj filter;
+  int limit;
+  std::string entry;
+  if (strcmp(path, "/.query") != 0 && !query_of(path, &filter, &limit, &entry))
+    return -EINVAL;
+
+  if (entry.empty()) {
+    stbuf->st_mode = S_IFDIR | 0555;
+    stbuf->st_nlink = 2;
+    return 0;
+  }
+
+  std::string target;
+  if (entry.find('/') != std::string::npos || !url_decode(entry, &target, false))
+    return -ENOENT;
+  int r = query_member(filter, target);
+  if (r < 0)
+    return r;
+  stbuf->st_mode = S_IFLNK | 0777;
+  stbuf->st_nlink = 1;
+  stbuf->st_size = target.size() + strlen("../../");
+  return 0;
+}
+
+int query_readdir(const char* path, void* buf, fuse_fill_dir_t filler) {
+  filler(buf, ".", NULL, 0);
+  filler(buf, "..", NULL, 0);
+
+  // Queries can be opened, not listed
+  if (strcmp(path, "/.query") == 0)
+    return 0;
+
+  mongo::BSONObj filter;
+  int limit;
+  std::string entry;
+  if (!query_of(path, &filter, &limit, &entry))
+    return -EINVAL;
+  if (!entry.empty())
+    return -ENOTDIR;
+
+  std::vector<mongo::BSONObj> files;
+  try {
+    files = get_backend().find_files(filter, limit, BSON("filename" << 1));
+  } catch (const std::exception& e) {
+    // Most likely a regex the server won't compile
+    fprintf(stderr, "query %s failed: %s\n", path, e.what());
+    return -EINVAL;
+  }
+  for (auto& file_obj : files)
+    filler(buf, entry_name(file_obj["filename"].String()).c_str(), NULL, 0);
+
+  return 0;
+}
+
+int query_readlink(const char* path, char* buf, size_t size) {
+  mongo::BSONObj filter;
+  int limit;
+  std::string entry, target;
+  if (strcmp(path, "/.query") == 0 || !query_of(path, &filter, &limit, &entry) ||
+      entry.empty() || !url_decode(entry, &target, false))
+    return -EINVAL;
+  int r = query_member(filter, target);
+  if (r < 0)
+    return r;
+
+  target = "../../" + target;
+  if (size == 0)
+    return -ERANGE;
+  size_t len = std::min(target.size(), size - 1);
+  memcpy(buf, target.data(), len);
+  buf[len] = 0;
+  return 0;
+}
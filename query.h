@@ -0,0 +1,59 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __QUERY_H
+#define __QUERY_H
+
+#include <string>
+#include <mongo/bson/bson.h>
+
+#include "operations.h"
+
+/* /.query/<filter> is a directory listing, as symlinks, whatever one
+   query on the files collection finds. The filter is URL encoded, as
+   in a query string:
+
+     path=<glob>           whole path; a literal prefix uses the filename index
+     name=<glob>           last path component
+     regex=<re>            regular expression on the path
+     min_size=, max_size=  bytes, optionally suffixed k, M or G
+     after=, before=       upload date, YYYY-MM-DD[THH:MM:SS] UTC or epoch seconds
+     meta.<attr>=<value>   value of extended attribute user.<attr>
+     limit=<n>             at most n entries
+
+   In globs * and ? don't match '/', ** does. Each entry is named after
+   a file's path with '%' and '/' percent encoded, and points at
+   ../../<path>, so it resolves wherever the mount is. A name that
+   isn't a file the filter finds doesn't exist, though one past the
+   limit does. /.query is not
+   listed in the root, so tree walks don't run into it. */
+
+inline bool is_query_path(const char* path) {
+  return strncmp(path, "/.query", 7) == 0 && (path[7] == 0 || path[7] == '/');
+}
+
+int query_getattr(const char* path, struct stat* stbuf);
+
+int query_readdir(const char* path, void* buf, fuse_fill_dir_t filler);
+
+int query_readlink(const char* path, char* buf, size_t size);
+
+//! The files collection filter and limit a /.query directory name asks
+//  for. False if it is malformed.
+bool parse_query(const std::string& text, mongo::BSONObj* filter, int* limit);
+
+#endif
@@ -0,0 +1,71 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SINGLEFLIGHT_H
+#define __SINGLEFLIGHT_H
+
+#include <exception>
+#include <future>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/* Collapses concurrent identical requests. The first caller for a key
+   runs the fetch; anyone asking for the same key before it finishes
+   waits for that result instead of issuing their own. Nothing is kept
+   once the fetch is done; caching is the caller's business. */
+template <typename T>
+class SingleFlight {
+public:
+  template <typename F>
+  T run(const std::string& key, F fetch) {
+    std::promise<T> result;
+    std::shared_future<T> pending;
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      auto i = _calls.find(key);
+      if (i != _calls.end())
+        pending = i->second;
+      else
+        _calls.insert(std::make_pair(key, result.get_future().share()));
+    }
+    if (pending.valid())
+      return pending.get();
+
+    try {
+      T value = fetch();
+      forget(key);
+      result.set_value(value);
+      return value;
+    } catch (...) {
+      forget(key);
+      result.set_exception(std::current_exception());
+      throw;
+    }
+  }
+
+private:
+  void forget(const std::string& key) {
+    std::lock_guard<std::mutex> guard(_lock);
+    _calls.erase(key);
+  }
+
+  std::mutex _lock;
+  std::unordered_map<std::string, std::shared_future<T> > _calls;
+};
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "stats.h"
+#include "operations.h"
+#include "gc.h"
+#include "writeback.h"
+
+namespace {
+
+/* Log-linear buckets in the spirit of HdrHistogram: values below 8 ns
+   are exact, above that each power of two is split into 8 buckets, so
+   every bucket is within 12.5% of the values it holds. Latencies are
+   clamped at 2^40 ns (about 18 minutes). */
+const int SUB_BITS = 3;
+const int SUB_BUCKETS = 1 << SUB_BITS;
+const int MAX_EXP = 40;
+const int BUCKETS = (MAX_EXP - SUB_BITS + 1) * SUB_BUCKETS;
+
+const char* op_names[OP_COUNT] = {
+  "getattr", "readlink", "mkdir", "unlink", "rmdir", "symlink", "rename",
+  "chmod", "chown", "truncate", "open", "read", "write", "flush", "release",
+  "setxattr", "getxattr", "listxattr", "removexattr", "readdir", "create",
+  "utimens", "statfs"
+};
+
+const char* db_names[DB_COUNT] = {
+  "findOne", "getChunk", "query", "insert", "update", "remove", "command"
+};
+
+int bucket_of(uint64_t v) {
+  if (v >= (1ULL << MAX_EXP))
+    v = (1ULL << MAX_EXP) - 1;
+  if (v < (uint64_t)SUB_BUCKETS)
+    return v;
+  int exp = 63 - __builtin_clzll(v);
+  return (exp - SUB_BITS + 1) * SUB_BUCKETS + ((v >> (exp - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t bucket_floor(int i) {
+  if (i < SUB_BUCKETS)
+    return i;
+  int exp = i / SUB_BUCKETS + SUB_BITS - 1;
+  return (uint64_t)(SUB_BUCKETS + i % SUB_BUCKETS) << (exp - SUB_BITS);
+}
+
+/* Every thread only ever writes its own histograms, so plain loads and
+   stores are enough; the atomics just make the reader's view well
+   defined. A reset can lose to a concurrent increment, which is fine. */
+struct Histogram {
+  std::atomic<uint64_t> buckets[BUCKETS];
+  std::atomic<uint64_t> count, errors, sum_ns, max_ns;
+
+  static void bump(std::atomic<uint64_t>& a, uint64_t by) {
+    a.store(a.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+  }
+
+  void record(uint64_t ns, bool failed) {
+    bump(buckets[bucket_of(ns)], 1);
+    bump(count, 1);
+    bump(sum_ns, ns);
+    if (failed)
+      bump(errors, 1);
+    if (ns > max_ns.load(std::memory_order_relaxed))
+      max_ns.store(ns, std::memory_order_relaxed);
+  }
+
+  void reset() {
+    for (auto& b : buckets)
+      b.store(0, std::memory_order_relaxed);
+    count = errors = sum_ns = max_ns = 0;
+  }
+};
+
+struct ThreadStats {
+  Histogram ops[OP_COUNT];
+  Histogram db[DB_COUNT];
+};
+
+std::mutex registry_lock;
+std::vector<ThreadStats*> registry;    // every slot, in use or not
+std::vector<ThreadStats*> free_slots;
+
+/* A thread's slot, handed back when the thread exits. fuse_loop_mt
+   lets idle workers go and starts new ones on the next burst, so slots
+   are reused instead of one being allocated for every thread ever
+   started. A reused slot keeps its counts and goes on adding to them;
+   they are only ever read summed over all slots. */
+struct Slot {
+  ThreadStats* stats;
+
+  Slot() {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    if (free_slots.empty()) {
+      stats = new ThreadStats();
+      registry.push_back(stats);
+    } else {
+      stats = free_slots.back();
+      free_slots.pop_back();
+    }
+  }
+
+  ~Slot() {
+    std::lock_guard<std::mutex> guard(registry_lock);
+    free_slots.push_back(stats);
+  }
+};
+
+ThreadStats& mine() {
+  thread_local Slot slot;
+  return *slot.stats;
+}
+
+struct Summary {
+  uint64_t count, errors, sum_ns, max_ns;
+  std::vector<uint64_t> buckets;
+
+  Summary() : count(0), errors(0), sum_ns(0), max_ns(0), buckets(BUCKETS) {}
+
+  void add(const Histogram& h) {
+    count += h.count;
+    errors += h.errors;
+    sum_ns += h.sum_ns;
+    max_ns = std::max<uint64_t>(max_ns, h.max_ns);
+    for (int i = 0; i < BUCKETS; i++)
+      buckets[i] += h.buckets[i];
+  }
+
+  double mean_us() const { return count ? sum_ns / 1000.0 / count : 0; }
+
+  double percentile_us(double p) const {
+    uint64_t want = count * p;
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; i++) {
+      seen += buckets[i];
+      if (seen > want)
+        return bucket_floor(i) / 1000.0;
+    }
+    return max_ns / 1000.0;
+  }
+};
+
+template <typename Pick>
+Summary summarize(Pick pick) {
+  Summary s;
+  std::lock_guard<std::mutex> guard(registry_lock);
+  for (ThreadStats* t : registry)
+    s.add(pick(*t));
+  return s;
+}
+
+void text_line(std::ostringstream& out, const char* name, const Summary& s) {
+  char line[160];
+  snprintf(line, sizeof(line), "%-14s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           name, (unsigned long long)s.count, (unsigned long long)s.errors,
+           s.mean_us(), s.percentile_us(0.5), s.percentile_us(0.9),
+           s.percentile_us(0.99), s.max_ns / 1000.0);
+  out << line;
+}
+
+void json_entry(std::ostringstream& out, const char* name, const Summary& s, bool last) {
+  char entry[256];
+  snprintf(entry, sizeof(entry),
+           "    \"%s\": {\"count\": %llu, \"errors\": %llu, \"mean_us\": %.1f, "
+           "\"p50_us\": %.1f, \"p90_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}%s\n",
+           name, (unsigned long long)s.count, (unsigned long long)s.errors,
+           s.mean_us(), s.percentile_us(0.5), s.percentile_us(0.9),
+           s.percentile_us(0.99), s.max_ns / 1000.0, last ? "" : ",");
+  out << entry;
+}
+
+}
+
+const char* fuse_op_name(fuse_op op) {
+  return op_names[op];
+}
+
+const char* db_op_name(db_op op) {
+  return db_names[op];
+}
+
+void op_extent(uint64_t& offset, uint32_t& size, const char*, fuse_bufvec* buf,
+               off_t off, fuse_file_info*) {
+  offset = off;
+  size = fuse_buf_size(buf);
+}
+
+void record_op(fuse_op op, uint64_t ns, bool failed) {
+  mine().ops[op].record(ns, failed);
+}
+
+void record_db(db_op op, uint64_t ns) {
+  mine().db[op].record(ns, false);
+}
+
+std::string stats_text() {
+  std::ostringstream out;
+  out << "op                  count   errors    mean_us     p50_us     p90_us     p99_us     max_us\n";
+  for (int op = 0; op < OP_COUNT; op++)
+    text_line(out, op_names[op], summarize([op](ThreadStats& t) -> Histogram& { return t.ops[op]; }));
+
+  out << "\nmongo\n";
+  for (int op = 0; op < DB_COUNT; op++)
+    text_line(out, db_names[op], summarize([op](ThreadStats& t) -> Histogram& { return t.db[op]; }));
+
+  gc_stats gc = chunk_gc_stats();
+  out << "\ngc pending_files=" << gc.pending_files
+      << " pending_chunks=" << gc.pending_chunks
+      << " collected_files=" << gc.collected_files
+      << " collected_chunks=" << gc.collected_chunks << "\n";
+
+  WriteBudget::usage wb = write_budget.stats();
+  out << "write_buffers bytes=" << wb.bytes
+      << " peak=" << wb.peak
+      << " capacity=" << wb.capacity
+      << " spilled=" << wb.spilled
+      << " waits=" << wb.waits << "\n";
+
+  WriteBack::usage wbq = write_back.stats();
+  out << "write_back files=" << wbq.files
+      << " bytes=" << wbq.bytes
+      << " stored=" << wbq.stored
+      << " retries=" << wbq.retries
+      << " failed=" << wbq.failed << "\n";
+
+  return out.str();
+}
+
+std::string stats_json() {
+  std::ostringstream out;
+  out << "{\n  \"ops\": {\n";
+  for (int op = 0; op < OP_COUNT; op++)
+    json_entry(out, op_names[op], summarize([op](ThreadStats& t) -> Histogram& { return t.ops[op]; }),
+               op == OP_COUNT - 1);
+
+  out << "  },\n  \"mongo\": {\n";
+  for (int op = 0; op < DB_COUNT; op++)
+    json_entry(out, db_names[op], summarize([op](ThreadStats& t) -> Histogram& { return t.db[op]; }),
+               op == DB_COUNT - 1);
+
+  gc_stats gc = chunk_gc_stats();
+  out << "  },\n  \"gc\": {\"pending_files\": " << gc.pending_files
+      << ", \"pending_chunks\": " << gc.pending_chunks
+      << ", \"collected_files\": " << gc.collected_files
+      << ", \"collected_chunks\": " << gc.collected_chunks << "},\n";
+
+  WriteBudget::usage wb = write_budget.stats();
+  out << "  \"write_buffers\": {\"bytes\": " << wb.bytes
+      << ", \"peak\": " << wb.peak
+      << ", \"capacity\": " << wb.capacity
+      << ", \"spilled\": " << wb.spilled
+      << ", \"waits\": " << wb.waits << "},\n";
+
+  WriteBack::usage wbq = write_back.stats();
+  out << "  \"write_back\": {\"files\": " << wbq.files
+      << ", \"bytes\": " << wbq.bytes
+      << ", \"stored\": " << wbq.stored
+      << ", \"retries\": " << wbq.retries
+      << ", \"failed\": " << wbq.failed << "}\n}\n";
+
+  return out.str();
+}
+
+void reset_stats() {
+  std::lock_guard<std::mutex> guard(registry_lock);
+  for (ThreadStats* t : registry) {
+    for (auto& h : t->ops)
+      h.reset();
+    for (auto& h : t->db)
+      h.reset();
+  }
+  write_budget.reset_stats();
+}
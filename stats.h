@@ -0,0 +1,156 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STATS_H
+#define __STATS_H
+
+#include <chrono>
+#include <string>
+#include <stdint.h>
+
+#include "tracing.h"
+#include "oplog.h"
+
+struct fuse_file_info;
+struct fuse_bufvec;
+
+enum fuse_op {
+  OP_GETATTR,
+  OP_READLINK,
+  OP_MKDIR,
+  OP_UNLINK,
+  OP_RMDIR,
+  OP_SYMLINK,
+  OP_RENAME,
+  OP_CHMOD,
+  OP_CHOWN,
+  OP_TRUNCATE,
+  OP_OPEN,
+  OP_READ,
+  OP_WRITE,
+  OP_FLUSH,
+  OP_RELEASE,
+  OP_SETXATTR,
+  OP_GETXATTR,
+  OP_LISTXATTR,
+  OP_REMOVEXATTR,
+  OP_READDIR,
+  OP_CREATE,
+  OP_UTIMENS,
+  OP_STATFS,
+  OP_COUNT
+};
+
+enum db_op {
+  DB_FINDONE,
+  DB_GETCHUNK,
+  DB_QUERY,
+  DB_INSERT,
+  DB_UPDATE,
+  DB_REMOVE,
+  DB_COMMAND,
+  DB_COUNT
+};
+
+inline uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+const char* fuse_op_name(fuse_op op);
+const char* db_op_name(db_op op);
+
+void record_op(fuse_op op, uint64_t ns, bool failed);
+void record_db(db_op op, uint64_t ns);
+
+//! Text and JSON renderings of everything recorded since the last reset.
+std::string stats_text();
+std::string stats_json();
+void reset_stats();
+
+//! Times one Mongo round trip for as long as it is in scope.
+class DbTimer {
+public:
+  explicit DbTimer(db_op op) : _op(op), _start(now_ns()) {}
+  ~DbTimer() {
+    uint64_t end = now_ns();
+    record_db(_op, end - _start);
+    if (tracing_enabled())
+      trace_event("mongo", db_op_name(_op), _start, end, NULL);
+  }
+
+private:
+  db_op _op;
+  uint64_t _start;
+};
+
+//! Evaluate a driver call as one timed round trip:
+//    BSONObj o = DB_TIMED(DB_FINDONE, client.findOne(ns, query));
+#define DB_TIMED(op, expr) ([&]() { DbTimer _db_timer(op); return (expr); }())
+
+// Every handler's first argument is a path
+template <typename... Rest>
+inline const char* first_path(const char* path, Rest...) { return path; }
+
+// Offset and size of the handlers that have them, for the op log
+template <typename... Args>
+inline void op_extent(uint64_t&, uint32_t&, Args...) {}
+
+inline void op_extent(uint64_t& offset, uint32_t& size, const char*, char*,
+                      size_t n, off_t off, fuse_file_info*) {
+  offset = off;
+  size = n;
+}
+
+inline void op_extent(uint64_t& offset, uint32_t& size, const char*, const char*,
+                      size_t n, off_t off, fuse_file_info*) {
+  offset = off;
+  size = n;
+}
+
+void op_extent(uint64_t& offset, uint32_t& size, const char*, fuse_bufvec* buf,
+               off_t off, fuse_file_info*);
+
+inline void op_extent(uint64_t& offset, uint32_t&, const char*, off_t length) {
+  offset = length;
+}
+
+//! Wraps a FUSE handler so every call is timed; see main.cpp.
+template <fuse_op Op, typename Sig, Sig* F> struct timed_op;
+
+template <fuse_op Op, typename... Args, int (*F)(Args...)>
+struct timed_op<Op, int(Args...), F> {
+  static int call(Args... args) {
+    uint64_t start = now_ns();
+    int r = F(args...);
+    uint64_t end = now_ns();
+    record_op(Op, end - start, r < 0);
+    if (tracing_enabled())
+      trace_event("fuse", fuse_op_name(Op), start, end, first_path(args...));
+    if (oplog_enabled()) {
+      uint64_t offset = 0;
+      uint32_t size = 0;
+      op_extent(offset, size, args...);
+      oplog_append(Op, start, end, r, first_path(args...), offset, size);
+    }
+    return r;
+  }
+};
+
+#define TIMED(op, fn) timed_op<op, decltype(fn), fn>::call
+
+#endif
@@ -0,0 +1,596 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <mongo/bson/bson.h>
+
+#include "store.h"
+#include "singleflight.h"
+#include "hash.h"
+#include "codec.h"
+#include "attr_cache.h"
+#include "idmap.h"
+#include "dedup.h"
+#include "disk_cache.h"
+#include "executor.h"
+#include "gc.h"
+#include "operations.h"
+#include "options.h"
+#include "stats.h"
+
+namespace {
+
+/* A failed aggregate that only means this server can't $merge the way
+   copy_stored_file asks: too old for the stage, or 4.2, which won't
+   $merge into the collection it reads. */
+bool merge_unsupported(const mongo::BSONObj& info) {
+  switch (info["code"].numberInt()) {
+  case 16436:  // Unrecognized pipeline stage name, before 3.6
+  case 40324:  // Unrecognized pipeline stage name
+  case 51188:  // $merge into the collection being aggregated
+    return true;
+  }
+  return false;
+}
+
+size_t chunk_len(const LocalGridFile& lgf, size_t chunk_size, size_t n) {
+  return std::min<size_t>(chunk_size, lgf.Length() - n * chunk_size);
+}
+
+// Automatic chunk sizes keep a file at about this many chunks
+const size_t TARGET_CHUNKS = 1024;
+
+/* The chunk size lgf is stored with. user.gridfs.chunk_size set on the
+   file decides, then the nearest directory that has a chunkSize, and
+   otherwise the size grows in powers of two with the file's length.
+   Either way it ends up within --min-chunk-size and --max-chunk-size.
+   Blobs only dedupe between files chunked alike, so --dedup always
+   uses the buffer size. */
+size_t stored_chunk_size(Backend& backend, const std::string& path, const LocalGridFile& lgf) {
+  if (gridfs_options.dedup)
+    return lgf.ChunkSize();
+
+  size_t size = lgf.StoredChunkSize();
+  for (std::string dir = path; !size && dir.find('/') != std::string::npos; ) {
+    dir.erase(dir.rfind('/'));
+    mongo::BSONObj dir_obj = lookup_file(backend, dir);
+    if (!dir_obj.isEmpty())
+      size = std::max(0LL, dir_obj["chunkSize"].numberLong());
+  }
+
+  if (!size) {
+    size = 1;
+    while (size < lgf.Length() / TARGET_CHUNKS)
+      size <<= 1;
+  }
+
+  size_t min_size = (size_t)gridfs_options.min_chunk_size << 10;
+  size_t max_size = (size_t)gridfs_options.max_chunk_size << 10;
+  return std::min(std::max(size, min_size), max_size);
+}
+
+/* XXH64 over the little endian concatenation of each chunk's XXH64.
+   Chunks are independent so stripes of them are hashed on the workers. */
+std::string chunk_tree_hash(const LocalGridFile& lgf, size_t chunk_size) {
+  size_t num_chunks = (lgf.Length() + chunk_size - 1) / chunk_size;
+  std::vector<uint64_t> digests(num_chunks);
+
+  auto hash_stripe = [&](size_t first, size_t step) {
+    std::vector<char> scratch;
+    for (size_t n = first; n < num_chunks; n += step) {
+      size_t len = chunk_len(lgf, chunk_size, n);
+      digests[n] = xxh64(lgf.range(n * chunk_size, len, scratch), len);
+    }
+  };
+
+  size_t workers = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()),
+                                    num_chunks);
+  std::vector<std::future<void> > stripes;
+  for (size_t i = 1; i < workers; i++)
+    stripes.push_back(io_executor.submit([&hash_stripe, i, workers]() { hash_stripe(i, workers); }));
+  hash_stripe(0, std::max<size_t>(workers, 1));
+  for (auto& s : stripes)
+    io_executor.wait(s);
+
+  std::string packed;
+  packed.reserve(num_chunks * 8);
+  for (uint64_t d : digests)
+    for (int i = 0; i < 8; i++)
+      packed.push_back((char)(d >> (i * 8)));
+
+  return hex64(xxh64(packed.data(), packed.size()));
+}
+
+std::string chunk_key(const mongo::BSONElement& files_id, int n) {
+  return files_id.toString(false) + "#" + std::to_string(n);
+}
+
+/* Chunk n on a worker, or right away when it is cached. The task holds
+   its own copy of file_obj. */
+std::future<StoredChunk::ptr> fetch_chunk_async(Backend& backend,
+                                                const mongo::BSONObj& file_obj, int n) {
+  StoredChunk::ptr cached = chunk_cache.get(chunk_key(file_obj["_id"], n));
+  if (cached && cached->blob.empty()) {
+    std::promise<StoredChunk::ptr> ready;
+    ready.set_value(cached);
+    return ready.get_future();
+  }
+
+  return io_executor.submit([&backend, file_obj, n]() {
+    return fetch_chunk(backend, file_obj, n);
+  });
+}
+
+/* Where the last read of each file ended and how far ahead of it chunks
+   have been requested. A read starting where the previous one ended
+   extends the window to --readahead chunks past its own last chunk. */
+struct read_state {
+  off_t next;
+  int ahead;
+};
+
+std::mutex read_states_lock;
+std::unordered_map<std::string, read_state> read_states;
+
+void read_ahead(Backend& backend, const mongo::BSONObj& file_obj,
+                off_t offset, size_t len, int chunk_size, int num_chunks) {
+  if (!gridfs_options.readahead)
+    return;
+
+  int last = (offset + len - 1) / chunk_size;
+  int from, to;
+  {
+    std::lock_guard<std::mutex> guard(read_states_lock);
+    // Only a bound on memory; forgetting a file just restarts its window
+    if (read_states.size() > 4096)
+      read_states.clear();
+
+    read_state& s = read_states[file_obj["_id"].toString(false)];
+    bool sequential = s.next == offset && offset > 0;
+    s.next = offset + len;
+    if (!sequential) {
+      s.ahead = last;
+      return;
+    }
+
+    from = std::max(s.ahead, last) + 1;
+    to = std::min<int>(last + gridfs_options.readahead, num_chunks - 1);
+    s.ahead = std::max(s.ahead, to);
+  }
+
+  // Nobody waits for these; they only warm the chunk cache
+  for (int n = from; n <= to; n++)
+    fetch_chunk_async(backend, file_obj, n);
+}
+
+/* Compress and insert chunks [first, last) of lgf as one batch. */
+void upload_chunks(Backend& backend, const mongo::OID& id, const LocalGridFile& lgf,
+                   size_t chunk_size, size_t first, size_t last) {
+  std::vector<mongo::BSONObj> batch;
+  std::string packed;
+  std::vector<char> scratch;
+  for (size_t n = first; n < last; n++) {
+    mongo::BSONObjBuilder chunk;
+    mongo::OID chunk_id;
+    chunk_id.init();
+    chunk << "_id" << chunk_id
+          << "files_id" << id
+          << "n" << (int)n;
+    size_t len = chunk_len(lgf, chunk_size, n);
+    append_chunk_data(chunk, lgf.range(n * chunk_size, len, scratch), len, packed);
+    batch.push_back(chunk.obj());
+  }
+  backend.put_chunks(batch);
+}
+
+}
+
+mongo::BSONObj store_local_file(Backend& backend,
+                                const std::string& path,
+                                const LocalGridFile& lgf,
+                                const mongo::OID& file_id) {
+  mongo::OID id = file_id;
+  if (!id.isSet())
+    id.init();
+
+  // Spilling would free buffers the workers are reading
+  LocalGridFile::Pin pin(lgf);
+
+  size_t length = lgf.Length();
+  size_t chunk_size = stored_chunk_size(backend, path, lgf);
+
+  if (gridfs_options.dedup) {
+    std::vector<std::string> blobs;
+    {
+      auto sdc = make_ScopedDbConnection();
+      blobs = store_blobs(sdc->conn(), lgf);
+    }
+    std::vector<mongo::BSONObj> batch;
+    for (size_t n = 0; n < blobs.size(); n++) {
+      mongo::OID chunk_id;
+      chunk_id.init();
+      batch.push_back(BSON("_id" << chunk_id
+                           << "files_id" << id
+                           << "n" << (int)n
+                           << "blob" << blobs[n]));
+      if (batch.size() == 1000 || n + 1 == blobs.size()) {
+        backend.put_chunks(batch);
+        batch.clear();
+      }
+    }
+  } else {
+    // All batches have to be acknowledged before the files document
+    // makes the new version visible
+    size_t num_chunks = (length + chunk_size - 1) / chunk_size;
+    run_uploads(num_chunks, std::max<size_t>(1, UPLOAD_BATCH_BYTES / chunk_size),
+                [&backend, &lgf, id, chunk_size](size_t first, size_t last) {
+      upload_chunks(backend, id, lgf, chunk_size, first, last);
+    });
+  }
+
+  mongo::BSONObjBuilder file;
+  file << "_id" << id
+       << "filename" << path
+       << "version" << mongo::OID::gen()
+       << "chunkSize" << (int)chunk_size;
+  if (lgf.MTime())
+    file << "uploadDate" << mongo::Date_t(lgf.MTime());
+  else
+    file << "uploadDate" << mongo::DATENOW;
+
+  // Same int/long split as the driver's GridFS::storeFile
+  if (length < 1024 * 1024 * 1024)
+    file << "length" << (int)length;
+  else
+    file << "length" << (long long)length;
+
+  switch (gridfs_options.hashing) {
+  case HASH_MD5:
+    file << "md5" << lgf.md5();
+    break;
+  case HASH_XXH64:
+  case HASH_NONE:
+    break;
+  }
+
+  // Extended attributes set while the file was open, and the tree hash
+  {
+    mongo::BSONObjBuilder metadata;
+    metadata.appendElements(lgf.Metadata().removeField("xxh64tree"));
+    if (gridfs_options.hashing == HASH_XXH64)
+      metadata << "xxh64tree" << chunk_tree_hash(lgf, chunk_size);
+    mongo::BSONObj m = metadata.obj();
+    if (!m.isEmpty())
+      file << "metadata" << m;
+  }
+
+  if (gridfs_options.compression != CODEC_NONE)
+    file << "compression" << codec_name(gridfs_options.compression);
+  if (gridfs_options.dedup)
+    file << "dedup" << true;
+
+  append_owner(file, lgf.Uid(), lgf.Gid());
+  file << "mode" << lgf.Mode();
+
+  // The version stored as path now stays readable until this one is in
+  mongo::BSONObj file_obj = file.obj();
+  backend.replace_file(file_obj, gridfs_options.retire_delay);
+  attr_cache.put(path, file_obj);
+
+  return file_obj;
+}
+
+void run_uploads(size_t count, size_t per_batch,
+                 const std::function<void(size_t, size_t)>& upload) {
+  size_t parallel = std::max(1u, gridfs_options.upload_parallel);
+  std::deque<std::future<void> > inflight;
+  std::exception_ptr failed;
+  auto settle = [&]() {
+    try {
+      io_executor.wait(inflight.front());
+    } catch (...) {
+      if (!failed)
+        failed = std::current_exception();
+    }
+    inflight.pop_front();
+  };
+
+  for (size_t first = 0; first < count && !failed; first += per_batch) {
+    if (inflight.size() >= parallel)
+      settle();
+    size_t last = std::min(first + per_batch, count);
+    inflight.push_back(io_executor.submit([&upload, first, last]() {
+      upload(first, last);
+    }));
+  }
+  // Nothing may still be reading the caller's data when this returns or throws
+  while (!inflight.empty())
+    settle();
+  if (failed)
+    std::rethrow_exception(failed);
+}
+
+void append_chunk_data(mongo::BSONObjBuilder& b, const char* data, size_t len,
+                       std::string& scratch) {
+  // Chunks that don't shrink are stored raw, exactly like a plain GridFS chunk
+  chunk_codec codec = gridfs_options.compression;
+  if (codec != CODEC_NONE && compress_chunk(codec, data, len, scratch)) {
+    b << "codec" << codec_name(codec)
+      << "rawLength" << (int)len;
+    b.appendBinData("data", scratch.size(), mongo::BinDataGeneral, scratch.data());
+  } else {
+    b.appendBinData("data", len, mongo::BinDataGeneral, data);
+  }
+}
+
+StoredChunk::ptr parse_stored_chunk(const mongo::BSONObj& obj) {
+  auto chunk = std::make_shared<StoredChunk>();
+  int len;
+  const char* data = obj["data"].binData(len);
+  chunk->data.assign(data, len);
+  chunk->codec = CODEC_NONE;
+  chunk->raw_len = len;
+
+  if (obj.hasField("codec")) {
+    if (!parse_codec(obj["codec"].String(), &chunk->codec))
+      return StoredChunk::ptr();
+    chunk->raw_len = obj["rawLength"].numberLong();
+  }
+
+  return chunk;
+}
+
+// Lookups already on their way to the backend. A reader arriving while
+// one is in flight waits for it rather than asking again, which is what
+// keeps N processes opening the same cold file down to one round trip.
+static SingleFlight<StoredChunk::ptr> chunk_flights;
+static SingleFlight<mongo::BSONObj> file_flights;
+
+mongo::BSONObj lookup_file(Backend& backend, const std::string& path) {
+  mongo::BSONObj file_obj;
+  if (attr_cache.get(path, &file_obj))
+    return file_obj;
+
+  return file_flights.run(path, [&]() {
+    uint64_t since = attr_cache.generation(path);
+    mongo::BSONObj found = backend.find_file(path).getOwned();
+    attr_cache.fill(path, found, since);
+    return found;
+  });
+}
+
+/* Disk cache entries outlive the mount, so besides _id and n their key
+   names the version of the file: its checksum if it has one, and the
+   upload time in any case. */
+std::string disk_key(const mongo::BSONObj& file_obj, const std::string& key) {
+  mongo::BSONElement uploaded = file_obj["uploadDate"];
+  std::string version = key + "@";
+  if (uploaded.type() == mongo::Date)
+    version += std::to_string(uploaded.date().millis);
+  if (file_obj.hasField("md5"))
+    version += "@" + file_obj["md5"].str();
+  else if (file_obj.getObjectField("metadata").hasField("xxh64tree"))
+    version += "@" + file_obj.getObjectField("metadata")["xxh64tree"].str();
+  return version;
+}
+
+StoredChunk::ptr fetch_chunk(Backend& backend, const mongo::BSONObj& file_obj, int n) {
+  std::string key = chunk_key(file_obj["_id"], n);
+  StoredChunk::ptr chunk = chunk_cache.get(key);
+  if (!chunk) {
+    chunk = chunk_flights.run(key, [&]() {
+      std::string on_disk;
+      if (disk_cache.enabled()) {
+        on_disk = disk_key(file_obj, key);
+        StoredChunk::ptr cached = disk_cache.get(on_disk);
+        if (cached) {
+          chunk_cache.put(key, cached);
+          return cached;
+        }
+      }
+
+      mongo::BSONObj chunk_obj = backend.get_chunk(file_obj["_id"], n);
+      if (chunk_obj.isEmpty())
+        return StoredChunk::ptr();
+
+      // Deduplicated chunks are cached as a small reference to their blob,
+      // so identical content shares one cache entry across files. On disk
+      // there is no such sharing and the blob itself is stored.
+      StoredChunk::ptr loaded;
+      if (chunk_obj.hasField("blob")) {
+        auto ref = std::make_shared<StoredChunk>();
+        ref->codec = CODEC_NONE;
+        ref->raw_len = 0;
+        ref->blob = chunk_obj["blob"].String();
+        loaded = ref;
+        if (disk_cache.enabled()) {
+          StoredChunk::ptr blob = fetch_blob(ref->blob);
+          if (blob)
+            disk_cache.put(on_disk, *blob);
+        }
+      } else {
+        loaded = parse_stored_chunk(chunk_obj);
+        if (loaded && disk_cache.enabled())
+          disk_cache.put(on_disk, *loaded);
+      }
+      if (loaded)
+        chunk_cache.put(key, loaded);
+      return loaded;
+    });
+  }
+
+  if (chunk && !chunk->blob.empty())
+    return fetch_blob(chunk->blob);
+  return chunk;
+}
+
+int read_stored_file(Backend& backend, const mongo::BSONObj& file_obj,
+                     char* buf, size_t size, off_t offset) {
+  long long length = file_obj["length"].numberLong();
+  int chunk_size = file_obj["chunkSize"].numberInt();
+  if (offset >= length || chunk_size <= 0)
+    return 0;
+
+  size = std::min<long long>(size, length - offset);
+  int first = offset / chunk_size;
+  int last_chunk = (offset + size - 1) / chunk_size;
+
+  // Cached chunks stay compressed. Keep the last one this thread expanded
+  // so a run of small sequential reads only decompresses it once.
+  thread_local StoredChunk::ptr last;
+  thread_local std::string last_raw;
+
+  // The first chunk is fetched here, up to --read-parallel - 1 of the
+  // following ones on the workers, each over its own pooled connection.
+  // They are copied out strictly in order.
+  std::deque<std::future<StoredChunk::ptr> > ahead;
+  int queued = first;
+  int parallel = std::max(1u, gridfs_options.read_parallel);
+
+  size_t len = 0;
+  int result = 0;
+  for (int n = first; len < size; n++) {
+    while (queued < last_chunk && (int)ahead.size() + 1 < parallel)
+      ahead.push_back(fetch_chunk_async(backend, file_obj, ++queued));
+
+    StoredChunk::ptr chunk;
+    if (n > first && !ahead.empty()) {
+      chunk = io_executor.wait(ahead.front());
+      ahead.pop_front();
+    } else {
+      chunk = fetch_chunk(backend, file_obj, n);
+    }
+    if (!chunk) {
+      result = -EIO;
+      break;
+    }
+
+    size_t in_chunk = (offset + len) % chunk_size;
+    const char* raw = chunk->data.data();
+    if (chunk->codec != CODEC_NONE) {
+      if (last != chunk) {
+        last_raw.resize(chunk->raw_len);
+        if (!decompress_chunk(chunk->codec, chunk->data.data(), chunk->data.size(),
+                              &last_raw[0], chunk->raw_len)) {
+          last.reset();
+          result = -EIO;
+          break;
+        }
+        last = chunk;
+      }
+      raw = last_raw.data();
+    }
+
+    if (in_chunk >= chunk->raw_len)
+      break;
+
+    size_t to_read = std::min<size_t>(chunk->raw_len - in_chunk, size - len);
+    memcpy(buf + len, raw + in_chunk, to_read);
+    len += to_read;
+  }
+
+  for (auto& f : ahead)
+    io_executor.wait(f);
+
+  if (result < 0)
+    return result;
+
+  read_ahead(backend, file_obj, offset, len, chunk_size,
+             (length + chunk_size - 1) / chunk_size);
+
+  return len;
+}
+
+int copy_stored_file(mongo::DBClientBase& client, const std::string& src_path,
+                     const std::string& dst_path) {
+  mongo::BSONObj src = DB_TIMED(DB_FINDONE, client.findOne(db_name() + ".files",
+                                                           mongo::Query(BSON("filename" << src_path))
+                                                             .sort(newest_first())));
+  if (src.isEmpty())
+    return -ENOENT;
+
+  mongo::OID id;
+  id.init();
+
+  std::string chunks = std::string(gridfs_options.prefix) + ".chunks";
+  mongo::BSONObj pipeline = BSON_ARRAY(
+    BSON("$match" << BSON("files_id" << src["_id"])) <<
+    BSON("$project" << BSON("_id" << 0
+                            << "files_id" << BSON("$literal" << id)
+                            << "n" << 1 << "data" << 1 << "codec" << 1
+                            << "rawLength" << 1 << "blob" << 1)) <<
+    BSON("$merge" << BSON("into" << chunks
+                          << "whenMatched" << "fail"
+                          << "whenNotMatched" << "insert")));
+
+  mongo::BSONObj info;
+  if (!DB_TIMED(DB_COMMAND, client.runCommand(gridfs_options.db,
+                                              BSON("aggregate" << chunks
+                                                   << "pipeline" << pipeline
+                                                   << "cursor" << mongo::BSONObj()),
+                                              info))) {
+    // Whatever a partial run left is never referenced
+    DB_TIMED(DB_REMOVE, client.remove(db_name() + ".chunks", BSON("files_id" << id)));
+    if (!merge_unsupported(info))
+      return -EIO;
+
+    // Copy the chunk documents through here instead
+
+    std::unique_ptr<mongo::DBClientCursor> cursor =
+      DB_TIMED(DB_QUERY, client.query(db_name() + ".chunks", BSON("files_id" << src["_id"])));
+    while (cursor->more()) {
+      mongo::BSONObj chunk = cursor->next();
+      mongo::BSONObjBuilder copy;
+      mongo::OID chunk_id;
+      chunk_id.init();
+      copy << "_id" << chunk_id << "files_id" << id;
+      mongo::BSONObjIterator i(chunk);
+      while (i.more()) {
+        mongo::BSONElement e = i.next();
+        if (strcmp(e.fieldName(), "_id") != 0 && strcmp(e.fieldName(), "files_id") != 0)
+          copy.append(e);
+      }
+      DB_TIMED(DB_INSERT, client.insert(db_name() + ".chunks", copy.obj()));
+    }
+  }
+
+  mongo::BSONObjBuilder file;
+  file << "_id" << id
+       << "filename" << dst_path
+       << "version" << mongo::OID::gen()
+       << "uploadDate" << mongo::DATENOW;
+  mongo::BSONObjIterator i(src);
+  while (i.more()) {
+    mongo::BSONElement e = i.next();
+    if (!file.hasField(e.fieldName()))
+      file.append(e);
+  }
+
+  replace_stored_file(client, file.obj(), gridfs_options.retire_delay);
+
+  return 0;
+}
@@ -0,0 +1,85 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STORE_H
+#define __STORE_H
+
+#include <functional>
+#include <string>
+#include <mongo/client/dbclient.h>
+
+#include "local_gridfile.h"
+#include "chunk_cache.h"
+#include "backend.h"
+
+//! Upload a LocalGridFile as `path`, replacing any file stored under
+//  that name, and return its files document. The old version stays
+//  readable throughout and for --retire-delay seconds after. Chunks go straight from
+//  the local buffers, and the checksum selected by --hash is taken from
+//  the file instead of a server side filemd5. The stored chunk size is
+//  picked per file, see stored_chunk_size in store.cpp. The files
+//  document gets id as its _id when that is set, a new one otherwise.
+mongo::BSONObj store_local_file(Backend& backend,
+                                const std::string& path,
+                                const LocalGridFile& lgf,
+                                const mongo::OID& id = mongo::OID());
+
+//! Chunk data per multi-document insert or bulk upsert
+const size_t UPLOAD_BATCH_BYTES = 4 * 1024 * 1024;
+
+//! Call upload(first, last) on io_executor for [0, count) in batches of
+//  per_batch, with at most --upload-parallel in flight, and return once
+//  every one has finished. After a failure no more batches start, and
+//  the first exception is rethrown.
+void run_uploads(size_t count, size_t per_batch,
+                 const std::function<void(size_t, size_t)>& upload);
+
+//! Append a chunk's data field, compressed with --compress when that
+//  pays off. scratch holds the compressed bytes until the builder is done.
+void append_chunk_data(mongo::BSONObjBuilder& b, const char* data, size_t len,
+                       std::string& scratch);
+
+//! Decode a chunk or blob document. Empty pointer for unknown codecs.
+StoredChunk::ptr parse_stored_chunk(const mongo::BSONObj& obj);
+
+//! The files document stored under path, or an empty object. Served
+//  from the attribute cache while it is fresh; concurrent lookups of the
+//  same path share a single backend query.
+mongo::BSONObj lookup_file(Backend& backend, const std::string& path);
+
+//! Chunk n of the file a files document describes. Looks in the chunk
+//  cache, then in the --disk-cache, then asks the backend; concurrent
+//  misses on the same chunk share one fetch. Returns an empty pointer
+//  if the chunk can't be loaded.
+StoredChunk::ptr fetch_chunk(Backend& backend, const mongo::BSONObj& file_obj, int n);
+
+//! Read from a stored file described by its files document, expanding
+//  compressed chunks. Chunks a large read spans are fetched in parallel,
+//  and sequential readers get the following --readahead chunks fetched
+//  into the chunk cache. Returns the number of bytes read or -errno.
+int read_stored_file(Backend& backend, const mongo::BSONObj& file_obj,
+                     char* buf, size_t size, off_t offset);
+
+//! Copy a stored file to dst_path without its data leaving the server.
+//  Chunks are duplicated by an aggregation ending in $merge, falling
+//  back to copying them through this process on servers before 4.4.
+//  Any other aggregation failure is -EIO. This is
+//  MongoBackend::copy_file. Returns 0 or -errno.
+int copy_stored_file(mongo::DBClientBase& client, const std::string& src_path,
+                     const std::string& dst_path);
+
+#endif
@@ -14,7 +14,7 @@ class BasicGridfsFUSETestCase(unittest.TestCase):
                                   'mount')
         os.mkdir('tests/mount')
         subprocess.check_call(['./mount_gridfs', '--db=gridfstest',
-                               self.mount])
+                               '--retire-delay=1', self.mount])
 
         # wait for mount to complete
         time.sleep(1)
@@ -113,6 +113,55 @@ class BasicGridfsFUSETestCase(unittest.TestCase):
         with open(path2, 'r') as r:
             self.assertEquals('file1', r.read())
 
+    def test_replace(self):
+        path = os.path.join(self.mount, 'config')
+        tmp = os.path.join(self.mount, 'config.tmp')
+        with open(path, 'w') as w:
+            w.write('old')
+
+        # A reader stays on the version it opened
+        with open(path, 'r') as r:
+            with open(tmp, 'w') as w:
+                w.write('newer')
+            os.rename(tmp, path)
+            self.assertEquals('old', r.read())
+
+        with open(path, 'r') as r:
+            self.assertEquals('newer', r.read())
+        self.assertEquals(['config'], [f for f in os.listdir(self.mount) if f.startswith('config')])
+
+        # A source written before the file it replaces
+        older = os.path.join(self.mount, 'config.older')
+        with open(older, 'w') as w:
+            w.write('older')
+        os.remove(path)
+        with open(path, 'w') as w:
+            w.write('newest')
+        os.rename(older, path)
+        with open(path, 'r') as r:
+            self.assertEquals('older', r.read())
+        self.assert_('config.older' not in os.listdir(self.mount))
+
+    def test_read_after_retire(self):
+        path = os.path.join(self.mount, 'held')
+        tmp = os.path.join(self.mount, 'held.tmp')
+        size = 8 * 1024 * 1024
+        with open(path, 'w') as w:
+            w.write('A' * size)
+
+        # Past --retire-delay and a collector pass, which come every 10s.
+        # The tail is far enough in to not have been read ahead.
+        with open(path, 'r') as r:
+            with open(tmp, 'w') as w:
+                w.write('B')
+            os.rename(tmp, path)
+            time.sleep(12)
+            r.seek(size - 4096)
+            self.assertEquals('A' * 4096, r.read())
+
+        with open(path, 'r') as r:
+            self.assertEquals('B', r.read())
+
     def test_big_file(self):
         # Test creation/reading of a file that's bigger than
         # the chunk size
@@ -146,6 +195,93 @@ class BasicGridfsFUSETestCase(unittest.TestCase):
 
         self.assertEquals(size2, os.stat(path).st_size)
 
+    def test_xattr(self):
+        path = os.path.join(self.mount, 'tagged')
+
+        def getfattr(*args):
+            return subprocess.Popen(['getfattr'] + list(args) + [path],
+                                    stdout=subprocess.PIPE,
+                                    stderr=subprocess.PIPE).communicate()[0]
+
+        with open(path, 'w') as w:
+            w.write('tagged')
+            # Kept with the open file and stored when it is closed
+            subprocess.check_call(['setfattr', '-n', 'user.color', '-v', 'red', path])
+
+        subprocess.check_call(['setfattr', '-n', 'user.size', '-v', 'large', path])
+        attrs = getfattr('-d')
+        self.assert_('user.color="red"' in attrs)
+        self.assert_('user.size="large"' in attrs)
+
+        subprocess.check_call(['setfattr', '-x', 'user.color', path])
+        self.assert_('user.color' not in getfattr('-d'))
+
+    def test_chunk_size(self):
+        # Files below a directory with a chunk size are stored with it
+        d = os.path.join(self.mount, 'archive')
+        path = os.path.join(d, 'big')
+        os.mkdir(d)
+        subprocess.check_call(['setfattr', '-n', 'user.gridfs.chunk_size', '-v', '1048576', d])
+
+        data = ''.join(chr(i % 251) for i in range(3 * 1024 * 1024 + 100))
+        with open(path, 'w') as w:
+            w.write(data)
+
+        with open(path, 'r') as r:
+            self.assertEquals(data, r.read())
+        self.assertEquals('1048576', subprocess.Popen(
+            ['getfattr', '--only-values', '-n', 'user.gridfs.chunk_size', path],
+            stdout=subprocess.PIPE).communicate()[0].rstrip('\0'))
+
+        os.remove(path)
+        os.rmdir(d)
+
+    def test_query(self):
+        for name, data in [('a.csv', 'a'), ('b.csv', 'b'), ('c.txt', 'longer')]:
+            with open(os.path.join(self.mount, name), 'w') as w:
+                w.write(data)
+
+        found = os.path.join(self.mount, '.query', 'name=*.csv')
+        self.assertEquals(['a.csv', 'b.csv'], sorted(os.listdir(found)))
+        with open(os.path.join(found, 'a.csv'), 'r') as r:
+            self.assertEquals('a', r.read())
+
+        bigger = os.path.join(self.mount, '.query', 'min_size=2&path=*')
+        self.assertEquals(['c.txt'], os.listdir(bigger))
+
+    def test_usage(self):
+        d = os.path.join(self.mount, 'usage')
+        os.mkdir(d)
+        for name, data in [('a', 'x' * 1000), ('b', 'y' * 24)]:
+            with open(os.path.join(d, name), 'w') as w:
+                w.write(data)
+
+        def getfattr(name):
+            return subprocess.Popen(['getfattr', '--only-values', '-n', name, d],
+                                    stdout=subprocess.PIPE).communicate()[0].rstrip('\0')
+        self.assertEquals('1024', getfattr('user.gridfs.bytes'))
+        self.assertEquals('2', getfattr('user.gridfs.files'))
+        self.assert_(os.statvfs(self.mount).f_blocks > 0)
+
+        for name in ['a', 'b']:
+            os.remove(os.path.join(d, name))
+        os.rmdir(d)
+
+    def test_stats(self):
+        path = os.path.join(self.mount, '.gridfs', 'stats')
+        os.listdir(self.mount)
+
+        with open(path, 'r') as r:
+            stats = r.read()
+        self.assert_('readdir' in stats)
+        self.assert_('findOne' in stats)
+
+        with open(path, 'w') as w:
+            w.write('reset')
+
+        with open(path + '.json', 'r') as r:
+            self.assert_('"readdir": {"count": 0' in r.read())
+
 def suite():
     suite = unittest.TestSuite()
     suite.addTest(BasicGridfsFUSETestCase())
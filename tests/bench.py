@@ -0,0 +1,306 @@
+#!/usr/bin/env python
+"""Throughput and metadata benchmarks against a fresh mount.
+
+    $ make bench                      # in-memory backend, results in bench.json
+    $ python tests/bench.py --backend=mongo --db=gridfsbench --output=run.json
+
+Every workload is repeatable (fixed sizes and random seeds) and reports
+wall time, throughput, per-operation latency percentiles where they make
+sense, and the mount's own /.gridfs/stats.json taken over just that
+workload. The mount uses -o direct_io so read block sizes reach the
+filesystem instead of being rounded to the kernel's readahead.
+"""
+from __future__ import print_function, with_statement
+import json
+import optparse
+import os
+import platform
+import random
+import shutil
+import subprocess
+import sys
+import threading
+import time
+
+ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+MB = 1024 * 1024
+
+
+def percentiles(samples):
+    if not samples:
+        return {}
+    samples = sorted(samples)
+    pick = lambda q: samples[min(len(samples) - 1, int(q * len(samples)))]
+    return {'p50_us': pick(0.50) * 1e6, 'p90_us': pick(0.90) * 1e6,
+            'p99_us': pick(0.99) * 1e6, 'max_us': samples[-1] * 1e6}
+
+
+class Mount(object):
+
+    def __init__(self, options):
+        self.path = os.path.join(ROOT, 'tests', 'bench-mount')
+        self.args = [os.path.join(ROOT, 'mount_gridfs'),
+                     '--db=' + options.db,
+                     '--backend=' + options.backend,
+                     '-o', 'direct_io']
+        if options.latency:
+            self.args.append('--backend-latency=%d' % options.latency)
+        self.args += options.mount_args
+
+    def __enter__(self):
+        os.mkdir(self.path)
+        subprocess.check_call(self.args + [self.path])
+        deadline = time.time() + 10
+        while not os.path.ismount(self.path):
+            if time.time() > deadline:
+                raise RuntimeError('mount did not come up')
+            time.sleep(0.1)
+        return self
+
+    def __exit__(self, *exc):
+        if sys.platform.startswith('linux'):
+            subprocess.call(['fusermount', '-u', self.path])
+        else:
+            subprocess.call(['umount', self.path])
+        os.rmdir(self.path)
+
+    def join(self, *parts):
+        return os.path.join(self.path, *parts)
+
+    def reset_stats(self):
+        with open(self.join('.gridfs', 'stats.json'), 'w') as w:
+            w.write('reset')
+
+    def stats(self):
+        with open(self.join('.gridfs', 'stats.json'), 'r') as r:
+            return json.loads(r.read())
+
+
+class Bench(object):
+
+    def __init__(self, mount, options):
+        self.mount = mount
+        self.options = options
+        self.results = []
+        self.run_dir = 'bench-%d-%d' % (os.getpid(), int(time.time()))
+        self.big = None
+
+    def path(self, *parts):
+        return self.mount.join(self.run_dir, *parts)
+
+    def record(self, name, seconds, ops=0, nbytes=0, latencies=None, **params):
+        result = {'name': name, 'params': params, 'seconds': seconds,
+                  'ops': ops, 'bytes': nbytes}
+        if ops:
+            result['ops_per_sec'] = ops / seconds
+        if nbytes:
+            result['mb_per_sec'] = nbytes / float(MB) / seconds
+        if latencies:
+            result['latency'] = percentiles(latencies)
+        result['mount_stats'] = self.mount.stats()
+        self.results.append(result)
+        label = ' '.join([name] + ['%s=%s' % p for p in sorted(params.items())])
+        rate = ('%.1f MB/s' % result['mb_per_sec']) if nbytes else \
+               ('%.0f ops/s' % result.get('ops_per_sec', 0))
+        print('%-40s %8.3fs  %s' % (label, seconds, rate), file=sys.stderr)
+
+    def timed(self, fn):
+        self.mount.reset_stats()
+        start = time.time()
+        fn()
+        return time.time() - start
+
+    def write_large(self):
+        size = self.options.large_mb * MB
+        block = b'\xa5' * MB
+        self.big = self.path('large')
+
+        def run():
+            with open(self.big, 'wb') as w:
+                for _ in range(size // MB):
+                    w.write(block)
+        self.record('write_large', self.timed(run), nbytes=size, size_mb=self.options.large_mb)
+
+    def write_small(self):
+        count = self.options.small_files
+        data = b'x' * 4096
+        os.mkdir(self.path('small'))
+        latencies = []
+
+        def run():
+            for i in range(count):
+                start = time.time()
+                with open(self.path('small', 'f%06d' % i), 'wb') as w:
+                    w.write(data)
+                latencies.append(time.time() - start)
+        self.record('write_small', self.timed(run), ops=count, nbytes=count * len(data),
+                    latencies=latencies, files=count, size=len(data))
+
+    def read_seq(self, block):
+        size = os.stat(self.big).st_size
+
+        def run():
+            with open(self.big, 'rb') as r:
+                while r.read(block):
+                    pass
+        self.record('read_seq', self.timed(run), nbytes=size, block=block)
+
+    def read_random(self, block):
+        size = os.stat(self.big).st_size
+        count = self.options.random_reads
+        rng = random.Random(42)
+        offsets = [rng.randrange(0, size - block) for _ in range(count)]
+        latencies = []
+
+        def run():
+            fd = os.open(self.big, os.O_RDONLY)
+            try:
+                for off in offsets:
+                    start = time.time()
+                    os.lseek(fd, off, os.SEEK_SET)
+                    os.read(fd, block)
+                    latencies.append(time.time() - start)
+            finally:
+                os.close(fd)
+        self.record('read_random', self.timed(run), ops=count, nbytes=count * block,
+                    latencies=latencies, block=block)
+
+    def ls_l(self, entries):
+        d = self.path('ls%d' % entries)
+        os.mkdir(d)
+
+        def create():
+            for i in range(entries):
+                open(os.path.join(d, 'e%07d' % i), 'wb').close()
+        self.record('create_empty', self.timed(create), ops=entries, entries=entries)
+
+        def run():
+            for name in os.listdir(d):
+                os.lstat(os.path.join(d, name))
+        self.record('ls_l', self.timed(run), ops=entries, entries=entries)
+
+    def stat_missing(self):
+        count = self.options.stats
+        latencies = []
+
+        def run():
+            for i in range(count):
+                start = time.time()
+                try:
+                    os.stat(self.path('missing-%d' % i))
+                except OSError:
+                    pass
+                latencies.append(time.time() - start)
+        self.record('stat_missing', self.timed(run), ops=count, latencies=latencies, count=count)
+
+    def concurrent_read(self, threads):
+        size = os.stat(self.big).st_size
+        block = 128 * 1024
+
+        def reader():
+            with open(self.big, 'rb') as r:
+                while r.read(block):
+                    pass
+
+        def run():
+            workers = [threading.Thread(target=reader) for _ in range(threads)]
+            for t in workers:
+                t.start()
+            for t in workers:
+                t.join()
+        self.record('concurrent_read', self.timed(run), nbytes=size * threads,
+                    threads=threads, block=block)
+
+    def run(self, only):
+        os.mkdir(self.path())
+        workloads = [
+            ('write_large', self.write_large),
+            ('write_small', self.write_small),
+            ('read_seq', lambda: [self.read_seq(b) for b in self.options.blocks]),
+            ('read_random', lambda: [self.read_random(b) for b in self.options.blocks]),
+            ('ls_l', lambda: [self.ls_l(n) for n in self.options.entries]),
+            ('stat_missing', self.stat_missing),
+            ('concurrent_read', lambda: [self.concurrent_read(t) for t in self.options.threads]),
+        ]
+        # The read workloads need the file write_large leaves behind
+        readers = set(['read_seq', 'read_random', 'concurrent_read'])
+        for name, fn in workloads:
+            if only and name not in only and not (name == 'write_large' and readers & set(only)):
+                continue
+            fn()
+
+    def cleanup(self):
+        # Only matters with the mongo backend, the memory one goes away on unmount
+        if self.options.backend != 'memory':
+            shutil.rmtree(self.path(), ignore_errors=True)
+
+
+def git_revision():
+    try:
+        return subprocess.check_output(['git', 'rev-parse', 'HEAD'], cwd=ROOT).decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def int_list(option, opt, value, parser):
+    setattr(parser.values, option.dest, [int(v) for v in value.split(',')])
+
+
+def main():
+    parser = optparse.OptionParser(usage='%prog [options] [workload ...]')
+    parser.add_option('--backend', default='memory', help='memory (default) or mongo')
+    parser.add_option('--latency', type='int', default=0,
+                      help='microseconds added per memory backend call')
+    parser.add_option('--db', default='gridfsbench')
+    parser.add_option('--output', help='write the JSON results here instead of stdout')
+    parser.add_option('--large-mb', type='int', default=256, dest='large_mb')
+    parser.add_option('--small-files', type='int', default=2000, dest='small_files')
+    parser.add_option('--random-reads', type='int', default=2000, dest='random_reads')
+    parser.add_option('--stats', type='int', default=20000)
+    parser.add_option('--blocks', type='string', action='callback', callback=int_list,
+                      default=[4096, 65536, MB])
+    parser.add_option('--entries', type='string', action='callback', callback=int_list,
+                      default=[10000, 100000])
+    parser.add_option('--threads', type='string', action='callback', callback=int_list,
+                      default=[4, 16])
+    parser.add_option('--quick', action='store_true',
+                      help='small sizes, for checking the harness itself')
+    parser.add_option('--mount-arg', action='append', default=[], dest='mount_args',
+                      help='extra mount_gridfs argument, may be repeated')
+    options, only = parser.parse_args()
+
+    if options.quick:
+        options.large_mb = 16
+        options.small_files = 200
+        options.random_reads = 200
+        options.stats = 1000
+        options.entries = [1000]
+        options.threads = [4]
+
+    with Mount(options) as mount:
+        bench = Bench(mount, options)
+        try:
+            bench.run(only)
+        finally:
+            bench.cleanup()
+
+    report = {
+        'revision': git_revision(),
+        'time': time.strftime('%Y-%m-%dT%H:%M:%SZ', time.gmtime()),
+        'host': platform.node(),
+        'platform': platform.platform(),
+        'backend': options.backend,
+        'latency_us': options.latency,
+        'mount_args': options.mount_args,
+        'results': bench.results,
+    }
+    text = json.dumps(report, indent=2, sort_keys=True)
+    if options.output:
+        with open(options.output, 'w') as w:
+            w.write(text + '\n')
+    else:
+        print(text)
+
+
+if __name__ == '__main__':
+    main()
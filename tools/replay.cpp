@@ -0,0 +1,520 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Re-issue a log written by mount_gridfs --record against a mount:
+
+     replay_gridfs [--speed=N] [--no-prepare] [--json] log mountpoint/dir
+
+   Paths are only in the log as hashes, so each one becomes a synthetic
+   file named by its hash under the given directory. Files and
+   directories the log shows existing before the recording began are
+   created first, large enough for every read the log makes of them.
+   Each recording thread gets a replay thread, and operations start at
+   their recorded offsets divided by --speed (0 means as fast as
+   possible). Latencies are reported per operation next to the recorded
+   ones. */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "oplog.h"
+
+namespace {
+
+enum action {
+  A_STAT,
+  A_READLINK,
+  A_MKDIR,
+  A_UNLINK,
+  A_RMDIR,
+  A_CHMOD,
+  A_OPEN,
+  A_CREATE,
+  A_READ,
+  A_WRITE,
+  A_RELEASE,
+  A_GETXATTR,
+  A_LISTXATTR,
+  A_READDIR,
+  A_UTIMENS,
+  // Not replayable from a hash alone (rename, symlink, setxattr, ...)
+  // or implied by another one (flush happens on close).
+  A_SKIP
+};
+
+struct {
+  const char* name;
+  action act;
+} const actions[] = {
+  { "getattr", A_STAT },
+  { "readlink", A_READLINK },
+  { "mkdir", A_MKDIR },
+  { "unlink", A_UNLINK },
+  { "rmdir", A_RMDIR },
+  { "chmod", A_CHMOD },
+  { "open", A_OPEN },
+  { "create", A_CREATE },
+  { "read", A_READ },
+  { "write", A_WRITE },
+  { "release", A_RELEASE },
+  { "getxattr", A_GETXATTR },
+  { "listxattr", A_LISTXATTR },
+  { "readdir", A_READDIR },
+  { "utimens", A_UTIMENS },
+};
+
+struct Log {
+  std::vector<std::string> names;
+  std::vector<action> acts;
+  std::vector<oplog_record> records;
+};
+
+bool read_log(const char* path, Log& log) {
+  FILE* f = fopen(path, "rb");
+  if (!f) {
+    perror(path);
+    return false;
+  }
+
+  char magic[sizeof(OPLOG_MAGIC)];
+  uint32_t version, count;
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, OPLOG_MAGIC, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, f) != 1 || version != OPLOG_VERSION ||
+      fread(&count, sizeof(count), 1, f) != 1) {
+    fprintf(stderr, "%s: not a version %u operation log\n", path, OPLOG_VERSION);
+    fclose(f);
+    return false;
+  }
+
+  for (uint32_t i = 0; i < count; i++) {
+    std::string name;
+    int c;
+    while ((c = fgetc(f)) > 0)
+      name.push_back(c);
+    log.names.push_back(name);
+
+    action act = A_SKIP;
+    for (auto& a : actions)
+      if (name == a.name)
+        act = a.act;
+    log.acts.push_back(act);
+  }
+
+  oplog_record rec;
+  while (fread(&rec, sizeof(rec), 1, f) == 1)
+    if (rec.op < count)
+      log.records.push_back(rec);
+
+  fclose(f);
+  return true;
+}
+
+std::string hex64(uint64_t v) {
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)v);
+  return buf;
+}
+
+int result(int r) {
+  return r < 0 ? -errno : r;
+}
+
+/* Create what the log shows existing before its first write: anything
+   it looked at successfully without creating it first. */
+void prepare(const Log& log, const std::string& dir) {
+  struct shape {
+    bool dir, exists, created;
+    uint64_t extent;
+  };
+  std::map<uint64_t, shape> shapes;
+
+  for (auto& rec : log.records) {
+    if (!rec.path_hash)
+      continue;
+    action act = log.acts[rec.op];
+    bool first = !shapes.count(rec.path_hash);
+    shape& s = shapes[rec.path_hash];
+    if (first)
+      s = shape { false, false, act == A_CREATE || act == A_MKDIR, 0 };
+    if (s.created || rec.result < 0)
+      continue;
+
+    switch (act) {
+    case A_READDIR:
+      s.dir = s.exists = true;
+      break;
+    case A_READ:
+      s.exists = true;
+      s.extent = std::max<uint64_t>(s.extent, rec.offset + rec.result);
+      break;
+    case A_STAT: case A_OPEN: case A_READLINK: case A_GETXATTR: case A_LISTXATTR:
+      s.exists = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  std::vector<char> fill(1 << 20, 'r');
+  size_t files = 0, dirs = 0;
+  for (auto& i : shapes) {
+    const shape& s = i.second;
+    std::string path = dir + "/" + hex64(i.first);
+    struct stat st;
+    if (!s.exists || lstat(path.c_str(), &st) == 0)
+      continue;
+
+    if (s.dir) {
+      if (mkdir(path.c_str(), 0755) == 0)
+        dirs++;
+      continue;
+    }
+
+    int fd = open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+    if (fd < 0) {
+      perror(path.c_str());
+      continue;
+    }
+    for (uint64_t done = 0; done < s.extent; ) {
+      size_t n = std::min<uint64_t>(fill.size(), s.extent - done);
+      if (write(fd, &fill[0], n) != (ssize_t)n)
+        break;
+      done += n;
+    }
+    close(fd);
+    files++;
+  }
+
+  fprintf(stderr, "prepared %zu files and %zu directories\n", files, dirs);
+}
+
+struct Handle {
+  explicit Handle(int f) : fd(f) {}
+  ~Handle() { close(fd); }
+  int fd;
+  typedef std::shared_ptr<Handle> ptr;
+};
+
+// Handles are shared between replay threads: the FUSE thread that
+// opened a file usually isn't the one that reads it.
+struct Handles {
+  std::mutex lock;
+  std::map<uint64_t, std::vector<Handle::ptr> > readers;
+  std::map<uint64_t, Handle::ptr> writers;
+};
+
+struct OpStats {
+  std::vector<uint32_t> replayed, recorded;
+  size_t skipped, errors, mismatched;
+  OpStats() : skipped(0), errors(0), mismatched(0) {}
+};
+
+class Replayer {
+public:
+  Replayer(const Log& log, const std::string& dir, Handles& handles)
+    : _log(log), _dir(dir), _handles(handles), _stats(log.names.size()) {}
+
+  void run(const std::vector<const oplog_record*>& records,
+           std::chrono::steady_clock::time_point base, double speed);
+
+  const std::vector<OpStats>& stats() const { return _stats; }
+
+private:
+  int issue(const oplog_record& rec, const std::string& path);
+  Handle::ptr reader(uint64_t hash, const std::string& path);
+
+  const Log& _log;
+  std::string _dir;
+  Handles& _handles;
+  std::vector<OpStats> _stats;
+  std::vector<char> _buf;
+};
+
+Handle::ptr Replayer::reader(uint64_t hash, const std::string& path) {
+  {
+    std::lock_guard<std::mutex> guard(_handles.lock);
+    auto& open = _handles.readers[hash];
+    if (!open.empty())
+      return open.back();
+  }
+
+  // A read with no open in the log: it began before the recording did
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return Handle::ptr();
+  Handle::ptr h = std::make_shared<Handle>(fd);
+  std::lock_guard<std::mutex> guard(_handles.lock);
+  _handles.readers[hash].push_back(h);
+  return h;
+}
+
+int Replayer::issue(const oplog_record& rec, const std::string& path) {
+  const char* p = path.c_str();
+
+  switch (_log.acts[rec.op]) {
+  case A_STAT: {
+    struct stat st;
+    return result(lstat(p, &st));
+  }
+  case A_READLINK: {
+    char target[4096];
+    return result(readlink(p, target, sizeof(target)) < 0 ? -1 : 0);
+  }
+  case A_MKDIR:
+    return result(mkdir(p, 0755));
+  case A_UNLINK:
+    return result(unlink(p));
+  case A_RMDIR:
+    return result(rmdir(p));
+  case A_CHMOD:
+    return result(chmod(p, 0644));
+  case A_UTIMENS:
+    return result(utimensat(AT_FDCWD, p, NULL, 0));
+  case A_OPEN: {
+    int fd = open(p, O_RDONLY);
+    if (fd < 0)
+      return -errno;
+    std::lock_guard<std::mutex> guard(_handles.lock);
+    _handles.readers[rec.path_hash].push_back(std::make_shared<Handle>(fd));
+    return 0;
+  }
+  case A_CREATE: {
+    int fd = open(p, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd < 0)
+      return -errno;
+    std::lock_guard<std::mutex> guard(_handles.lock);
+    _handles.writers[rec.path_hash] = std::make_shared<Handle>(fd);
+    return 0;
+  }
+  case A_READ: {
+    Handle::ptr h = reader(rec.path_hash, path);
+    if (!h)
+      return -errno;
+    _buf.resize(std::max<size_t>(_buf.size(), rec.size));
+    return result(pread(h->fd, &_buf[0], rec.size, rec.offset));
+  }
+  case A_WRITE: {
+    Handle::ptr h;
+    {
+      std::lock_guard<std::mutex> guard(_handles.lock);
+      auto i = _handles.writers.find(rec.path_hash);
+      if (i != _handles.writers.end())
+        h = i->second;
+    }
+    if (!h)
+      return -EBADF;
+    _buf.resize(std::max<size_t>(_buf.size(), rec.size), 'w');
+    return result(pwrite(h->fd, &_buf[0], rec.size, rec.offset));
+  }
+  case A_RELEASE: {
+    // The close, and with it the flush, happens when the last thread
+    // still using the handle lets go of it.
+    std::lock_guard<std::mutex> guard(_handles.lock);
+    auto w = _handles.writers.find(rec.path_hash);
+    if (w != _handles.writers.end()) {
+      _handles.writers.erase(w);
+      return 0;
+    }
+    auto& open = _handles.readers[rec.path_hash];
+    if (!open.empty())
+      open.pop_back();
+    return 0;
+  }
+  case A_GETXATTR: {
+#ifdef __APPLE__
+    return result(getxattr(p, "replay", NULL, 0, 0, XATTR_NOFOLLOW));
+#else
+    return result(lgetxattr(p, "user.replay", NULL, 0));
+#endif
+  }
+  case A_LISTXATTR: {
+    char names[4096];
+#ifdef __APPLE__
+    return result(listxattr(p, names, sizeof(names), XATTR_NOFOLLOW));
+#else
+    return result(llistxattr(p, names, sizeof(names)));
+#endif
+  }
+  case A_READDIR: {
+    DIR* d = opendir(p);
+    if (!d)
+      return -errno;
+    while (readdir(d))
+      ;
+    closedir(d);
+    return 0;
+  }
+  case A_SKIP:
+    break;
+  }
+
+  return 0;
+}
+
+void Replayer::run(const std::vector<const oplog_record*>& records,
+                   std::chrono::steady_clock::time_point base, double speed) {
+  for (const oplog_record* rec : records) {
+    OpStats& s = _stats[rec->op];
+    if (_log.acts[rec->op] == A_SKIP || !rec->path_hash) {
+      s.skipped++;
+      continue;
+    }
+
+    if (speed > 0)
+      std::this_thread::sleep_until(base + std::chrono::microseconds((uint64_t)(rec->start_us / speed)));
+
+    std::string path = _dir + "/" + hex64(rec->path_hash);
+    auto start = std::chrono::steady_clock::now();
+    int r = issue(*rec, path);
+    auto took = std::chrono::steady_clock::now() - start;
+
+    s.replayed.push_back(std::chrono::duration_cast<std::chrono::microseconds>(took).count());
+    s.recorded.push_back(rec->duration_us);
+    if (r < 0)
+      s.errors++;
+    if ((r < 0) != (rec->result < 0))
+      s.mismatched++;
+  }
+}
+
+uint32_t percentile(std::vector<uint32_t>& v, double q) {
+  if (v.empty())
+    return 0;
+  size_t i = std::min(v.size() - 1, (size_t)(q * v.size()));
+  std::nth_element(v.begin(), v.begin() + i, v.end());
+  return v[i];
+}
+
+void usage() {
+  fprintf(stderr, "usage: replay_gridfs [--speed=N] [--no-prepare] [--json] log dir\n"
+                  "\t--speed=N\treplay N times faster than recorded, 0 for no waits (default 1)\n"
+                  "\t--no-prepare\tdon't create the files the log expects to exist\n"
+                  "\t--json\t\treport as JSON\n");
+  exit(2);
+}
+
+}
+
+int main(int argc, char* argv[]) {
+  double speed = 1;
+  bool do_prepare = true, json = false;
+  std::vector<const char*> args;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--speed=", 8) == 0)
+      speed = atof(argv[i] + 8);
+    else if (strcmp(argv[i], "--no-prepare") == 0)
+      do_prepare = false;
+    else if (strcmp(argv[i], "--json") == 0)
+      json = true;
+    else if (argv[i][0] == '-')
+      usage();
+    else
+      args.push_back(argv[i]);
+  }
+  if (args.size() != 2 || speed < 0)
+    usage();
+
+  Log log;
+  if (!read_log(args[0], log))
+    return 1;
+  std::string dir = args[1];
+
+  if (do_prepare)
+    prepare(log, dir);
+
+  std::map<uint16_t, std::vector<const oplog_record*> > by_thread;
+  for (auto& rec : log.records)
+    by_thread[rec.thread].push_back(&rec);
+
+  Handles handles;
+  std::vector<std::unique_ptr<Replayer> > replayers;
+  std::vector<std::thread> threads;
+  auto base = std::chrono::steady_clock::now();
+  for (auto& t : by_thread) {
+    replayers.emplace_back(new Replayer(log, dir, handles));
+    threads.push_back(std::thread(&Replayer::run, replayers.back().get(),
+                                  std::cref(t.second), base, speed));
+  }
+  for (auto& t : threads)
+    t.join();
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - base).count();
+  double recorded = log.records.empty() ? 0 :
+    (log.records.back().start_us + log.records.back().duration_us) / 1e6;
+
+  if (json)
+    printf("{\"records\": %zu, \"threads\": %zu, \"recorded_seconds\": %.3f, "
+           "\"replay_seconds\": %.3f, \"ops\": {", log.records.size(), threads.size(), recorded, wall);
+  else
+    printf("%zu records on %zu threads, recorded over %.3fs, replayed in %.3fs\n\n"
+           "%-12s %8s %8s %8s %8s %9s %9s %9s %9s %9s %9s\n",
+           log.records.size(), threads.size(), recorded, wall,
+           "op", "count", "skipped", "errors", "mismatch",
+           "p50us", "p90us", "p99us", "max us", "rec p50", "rec p99");
+
+  bool first = true;
+  for (size_t op = 0; op < log.names.size(); op++) {
+    OpStats total;
+    for (auto& r : replayers) {
+      const OpStats& s = r->stats()[op];
+      total.replayed.insert(total.replayed.end(), s.replayed.begin(), s.replayed.end());
+      total.recorded.insert(total.recorded.end(), s.recorded.begin(), s.recorded.end());
+      total.skipped += s.skipped;
+      total.errors += s.errors;
+      total.mismatched += s.mismatched;
+    }
+    size_t count = total.replayed.size();
+    if (!count && !total.skipped)
+      continue;
+
+    uint32_t p50 = percentile(total.replayed, 0.5), p90 = percentile(total.replayed, 0.9),
+      p99 = percentile(total.replayed, 0.99), max = percentile(total.replayed, 1),
+      r50 = percentile(total.recorded, 0.5), r99 = percentile(total.recorded, 0.99);
+
+    if (json)
+      printf("%s\"%s\": {\"count\": %zu, \"skipped\": %zu, \"errors\": %zu, \"mismatched\": %zu, "
+             "\"p50_us\": %u, \"p90_us\": %u, \"p99_us\": %u, \"max_us\": %u, "
+             "\"recorded_p50_us\": %u, \"recorded_p99_us\": %u}",
+             first ? "" : ", ", log.names[op].c_str(), count, total.skipped, total.errors,
+             total.mismatched, p50, p90, p99, max, r50, r99);
+    else
+      printf("%-12s %8zu %8zu %8zu %8zu %9u %9u %9u %9u %9u %9u\n", log.names[op].c_str(),
+             count, total.skipped, total.errors, total.mismatched, p50, p90, p99, max, r50, r99);
+    first = false;
+  }
+
+  if (json)
+    printf("}}\n");
+
+  return 0;
+}
@@ -0,0 +1,177 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "tracing.h"
+
+std::atomic<bool> trace_on(false);
+
+namespace {
+
+const size_t RING_EVENTS = 16384;
+const size_t PATH_MAX_LEN = 55;
+
+struct Event {
+  const char* cat;
+  const char* name;
+  uint64_t start_ns, end_ns;
+  char path[PATH_MAX_LEN + 1];
+};
+
+/* Single producer ring. The owning thread fills slot head % RING_EVENTS
+   and then publishes head + 1. A reader copies the slots and re-reads
+   head afterwards, discarding any slot the producer may have been
+   rewriting meanwhile; those copies are racy by design but never used. */
+struct Ring {
+  int tid;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> tail;  // first index still wanted, moved by clear_trace
+  Event events[RING_EVENTS];
+};
+
+std::mutex rings_lock;
+std::vector<Ring*> rings;       // every ring, in use or not
+std::vector<Ring*> free_rings;
+int next_tid = 1;
+
+/* A thread's ring, taken the first time it records while tracing is on
+   and handed back when it exits. fuse_loop_mt lets idle workers go and
+   starts new ones on the next burst, so rings are reused rather than
+   one allocated per thread ever started. A reused ring gets a new tid
+   and starts out empty, so nothing the last owner recorded is shown as
+   the new thread's. */
+struct RingSlot {
+  Ring* ring;
+
+  RingSlot() {
+    std::lock_guard<std::mutex> guard(rings_lock);
+    if (free_rings.empty()) {
+      ring = new Ring();
+      rings.push_back(ring);
+    } else {
+      ring = free_rings.back();
+      free_rings.pop_back();
+      ring->tail.store(ring->head.load());
+    }
+    ring->tid = next_tid++;
+  }
+
+  ~RingSlot() {
+    std::lock_guard<std::mutex> guard(rings_lock);
+    free_rings.push_back(ring);
+  }
+};
+
+Ring& my_ring() {
+  thread_local RingSlot slot;
+  return *slot.ring;
+}
+
+void json_string(std::ostringstream& out, const char* s) {
+  out << '"';
+  for (; *s; s++) {
+    unsigned char c = *s;
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", c);
+      out << esc;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+}
+
+}
+
+void set_tracing(bool on) {
+  trace_on.store(on, std::memory_order_relaxed);
+}
+
+void trace_event(const char* cat, const char* name, uint64_t start_ns, uint64_t end_ns,
+                 const char* path) {
+  Ring& ring = my_ring();
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  Event& e = ring.events[head % RING_EVENTS];
+  e.cat = cat;
+  e.name = name;
+  e.start_ns = start_ns;
+  e.end_ns = end_ns;
+  if (path) {
+    strncpy(e.path, path, PATH_MAX_LEN);
+    e.path[PATH_MAX_LEN] = 0;
+  } else {
+    e.path[0] = 0;
+  }
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+std::string trace_json() {
+  std::ostringstream out;
+  out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+  bool first = true;
+
+  std::lock_guard<std::mutex> guard(rings_lock);
+  for (Ring* ring : rings) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t from = std::max<uint64_t>(ring->tail.load(), head > RING_EVENTS ? head - RING_EVENTS : 0);
+
+    std::vector<Event> copy;
+    for (uint64_t i = from; i < head; i++)
+      copy.push_back(ring->events[i % RING_EVENTS]);
+
+    // Slots at or below new_head - RING_EVENTS may have been rewritten
+    uint64_t new_head = ring->head.load(std::memory_order_acquire);
+    uint64_t valid_from = new_head >= RING_EVENTS ? new_head - RING_EVENTS + 1 : 0;
+
+    for (uint64_t i = from; i < head; i++) {
+      if (i < valid_from)
+        continue;
+      const Event& e = copy[i - from];
+      char times[96];
+      snprintf(times, sizeof(times), "\"ts\": %.3f, \"dur\": %.3f",
+               e.start_ns / 1000.0, (e.end_ns - e.start_ns) / 1000.0);
+
+      out << (first ? "" : ",\n") << "{\"ph\": \"X\", \"pid\": 1, \"tid\": " << ring->tid
+          << ", \"cat\": \"" << e.cat << "\", \"name\": \"" << e.name << "\", " << times;
+      if (e.path[0]) {
+        out << ", \"args\": {\"path\": ";
+        json_string(out, e.path);
+        out << "}";
+      }
+      out << "}";
+      first = false;
+    }
+  }
+
+  out << "\n]}\n";
+  return out.str();
+}
+
+void clear_trace() {
+  std::lock_guard<std::mutex> guard(rings_lock);
+  for (Ring* ring : rings)
+    ring->tail.store(ring->head.load());
+}
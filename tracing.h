@@ -0,0 +1,48 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __TRACING_H
+#define __TRACING_H
+
+#include <atomic>
+#include <string>
+#include <stdint.h>
+
+/* Optional event recording for chrome://tracing and Perfetto. Every
+   timed FUSE handler and Mongo round trip becomes one complete ("X")
+   event carrying its begin and end. Each thread appends to its own ring
+   buffer with no locks, and the oldest events are overwritten. While
+   disabled the only cost is the relaxed load in tracing_enabled(). */
+
+extern std::atomic<bool> trace_on;
+
+inline bool tracing_enabled() {
+  return trace_on.load(std::memory_order_relaxed);
+}
+
+void set_tracing(bool on);
+
+//! Record one event. cat and name must be string literals or otherwise
+//  live forever; path (may be NULL) is copied, truncated if long.
+void trace_event(const char* cat, const char* name, uint64_t start_ns, uint64_t end_ns,
+                 const char* path);
+
+//! Everything still in the ring buffers as Chrome trace-event JSON.
+std::string trace_json();
+void clear_trace();
+
+#endif
@@ -0,0 +1,86 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <mutex>
+#include <unordered_map>
+
+#include "usage.h"
+#include "stats.h"
+
+namespace {
+
+uint64_t timeout_ns = 0;
+
+struct dir_entry {
+  long long bytes, files;
+  uint64_t expires;
+};
+
+std::mutex lock;
+std::unordered_map<std::string, dir_entry> dirs;
+Backend::usage bucket;
+uint64_t bucket_expires = 0;
+
+}
+
+void set_usage_timeout(unsigned seconds) {
+  timeout_ns = seconds * 1000000000ULL;
+}
+
+int dir_usage(const std::string& dir, long long* bytes, long long* files) {
+  std::string prefix = dir.empty() ? dir : dir + "/";
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    auto i = dirs.find(prefix);
+    if (i != dirs.end() && i->second.expires > now_ns()) {
+      *bytes = i->second.bytes;
+      *files = i->second.files;
+      return 0;
+    }
+  }
+
+  int r = get_backend().tree_usage(prefix, bytes, files);
+  if (r < 0 || !timeout_ns)
+    return r;
+
+  std::lock_guard<std::mutex> guard(lock);
+  // Only a bound on memory
+  if (dirs.size() > 4096)
+    dirs.clear();
+  dir_entry e = { *bytes, *files, now_ns() + timeout_ns };
+  dirs[prefix] = e;
+  return 0;
+}
+
+int bucket_usage(Backend::usage* u) {
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if (bucket_expires > now_ns()) {
+      *u = bucket;
+      return 0;
+    }
+  }
+
+  int r = get_backend().store_usage(u);
+  if (r < 0 || !timeout_ns)
+    return r;
+
+  std::lock_guard<std::mutex> guard(lock);
+  bucket = *u;
+  bucket_expires = now_ns() + timeout_ns;
+  return 0;
+}
@@ -0,0 +1,38 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __USAGE_H
+#define __USAGE_H
+
+#include <string>
+
+#include "backend.h"
+
+/* Space used below a directory, and by the whole bucket, as the server
+   adds it up. Answers are kept for --usage-timeout seconds so that
+   monitoring polls and repeated statfs calls don't redo the work. */
+
+void set_usage_timeout(unsigned seconds);
+
+//! Total length and number of the regular files below dir ("" for the
+//  whole mount), from one aggregation. Returns 0 or -errno.
+int dir_usage(const std::string& dir, long long* bytes, long long* files);
+
+//! What the bucket takes and how much room is left, for statfs.
+int bucket_usage(Backend::usage* u);
+
+#endif
@@ -0,0 +1,573 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+
+#include "writeback.h"
+#include "backend.h"
+#include "hash.h"
+#include "operations.h"
+#include "options.h"
+#include "store.h"
+
+WriteBack write_back;
+
+namespace {
+
+const char JOURNAL_MAGIC[8] = {'G', 'F', 'S', 'W', 'B', 'J', 'N', 'L'};
+const char JOURNAL_SUFFIX[] = ".journal";
+
+// Workers storing queued files. Each upload fans out over io_executor.
+const unsigned int DRAIN_THREADS = 4;
+
+// Longest an operation on a queued path waits for its upload
+const int SETTLE_SECONDS = 30;
+
+// Attempts at a file that keeps failing other than transiently
+const int PERMANENT_ATTEMPTS = 5;
+const char FAILED_SUFFIX[] = ".failed";
+
+enum {
+  REC_PATH = 1,
+  REC_WRITE = 2,
+  REC_COMMIT = 3
+};
+
+struct record_header {
+  uint32_t type;
+  uint32_t len;
+  uint64_t offset;
+  uint64_t check;  // xxh64 of the data, seeded with that of the fields above
+};
+
+uint64_t record_check(const record_header& h, const char* data) {
+  return xxh64(data, h.len, xxh64(&h, offsetof(record_header, check)));
+}
+
+// 0 or -errno, taken right at the failing write. One that writes
+// nothing without saying why is -EIO.
+int write_all(int fd, const void* buf, size_t len) {
+  const char* p = static_cast<const char*>(buf);
+  while (len) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -errno;
+    if (n == 0)
+      return -EIO;
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+bool pread_all(int fd, void* buf, size_t len, off_t offset) {
+  char* p = static_cast<char*>(buf);
+  while (len) {
+    ssize_t n = pread(fd, p, len, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    offset += n;
+    len -= n;
+  }
+  return true;
+}
+
+bool ends_with(const std::string& s, const char* suffix) {
+  size_t n = strlen(suffix);
+  return s.size() > n && s.compare(s.size() - n, n, suffix) == 0;
+}
+
+/* Failures that go away by themselves: the server is down, unreachable
+   or between primaries. Anything else, like a document over 16MB, a
+   refused login or a failed validation, fails the same way again. */
+bool transient(const std::exception& ex) {
+  if (dynamic_cast<const mongo::SocketException*>(&ex))
+    return true;
+  const mongo::DBException* db = dynamic_cast<const mongo::DBException*>(&ex);
+  if (!db)
+    return false;
+  switch (db->getCode()) {
+  case 6:      // HostUnreachable
+  case 7:      // HostNotFound
+  case 89:     // NetworkTimeout
+  case 91:     // ShutdownInProgress
+  case 189:    // PrimarySteppedDown
+  case 9001:   // SocketException
+  case 10107:  // NotMaster
+  case 11002:  // connection pool: connect failed
+  case 11600:  // InterruptedAtShutdown
+  case 11602:  // InterruptedDueToReplStateChange
+  case 13328:  // connection pool: connect failed
+  case 13435:  // NotMasterNoSlaveOk
+  case 13436:  // NotMasterOrSecondary
+    return true;
+  }
+  return false;
+}
+
+}
+
+bool parse_journal_sync(const char* name, journal_sync* sync) {
+  if (strcmp(name, "close") == 0)
+    *sync = SYNC_CLOSE;
+  else if (strcmp(name, "write") == 0)
+    *sync = SYNC_WRITE;
+  else if (strcmp(name, "none") == 0)
+    *sync = SYNC_NONE;
+  else
+    return false;
+  return true;
+}
+
+std::shared_ptr<Journal> Journal::create(const std::string& dir, int dir_fd,
+                                         journal_sync sync, const std::string& path) {
+  mongo::OID name;
+  name.init();
+  std::string file = dir + "/" + name.toString() + JOURNAL_SUFFIX;
+  int fd = ::open(file.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_APPEND, 0600);
+  if (fd < 0)
+    return std::shared_ptr<Journal>();
+
+  std::shared_ptr<Journal> journal = std::make_shared<Journal>(fd, file, sync, dir_fd);
+  if (write_all(fd, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) < 0 ||
+      journal->record(REC_PATH, 0, path.data(), path.size()) < 0) {
+    journal->remove();
+    return std::shared_ptr<Journal>();
+  }
+  return journal;
+}
+
+Journal::Journal(int fd, const std::string& file, journal_sync sync, int dir_fd,
+                 const mongo::OID& id) :
+  _fd(fd), _file(file), _sync(sync), _dir_fd(dir_fd), _dir_synced(false), _id(id) {}
+
+Journal::~Journal() {
+  if (_fd >= 0)
+    close(_fd);
+}
+
+int Journal::record(uint32_t type, uint64_t offset, const char* data, size_t len) {
+  if (_fd < 0)
+    return -EBADF;
+
+  record_header h;
+  h.type = type;
+  h.len = len;
+  h.offset = offset;
+  h.check = record_check(h, data);
+
+  // A record torn half way would hide every later one from replay
+  int r = write_all(_fd, &h, sizeof(h));
+  if (r == 0)
+    r = write_all(_fd, data, len);
+  if (r < 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  return r;
+}
+
+int Journal::append(off_t offset, const char* data, size_t len) {
+  std::lock_guard<std::mutex> guard(_lock);
+  int r = record(REC_WRITE, offset, data, len);
+  if (r == 0 && _sync == SYNC_WRITE && fdatasync(_fd) < 0)
+    return -errno;
+  return r;
+}
+
+int Journal::commit(const LocalGridFile& lgf) {
+  mongo::OID id;
+  id.init();
+
+  mongo::BSONObjBuilder b;
+  b << "_id" << id
+    << "uid" << (long long)lgf.Uid()
+    << "gid" << (long long)lgf.Gid()
+    << "mode" << (int)lgf.Mode()
+    << "chunkSize" << (long long)lgf.StoredChunkSize()
+    << "mtime" << (long long)lgf.MTime()
+    << "metadata" << lgf.Metadata();
+  mongo::BSONObj commit = b.obj();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  int r = record(REC_COMMIT, 0, commit.objdata(), commit.objsize());
+  if (r < 0)
+    return r;
+  if (_sync != SYNC_NONE) {
+    if (fdatasync(_fd) < 0)
+      return -errno;
+    // The journal's own directory entry has to survive the crash too
+    if (!_dir_synced && fsync(_dir_fd) == 0)
+      _dir_synced = true;
+  }
+  _id = id;
+  return 0;
+}
+
+mongo::OID Journal::id() const {
+  std::lock_guard<std::mutex> guard(_lock);
+  return _id;
+}
+
+void Journal::remove() {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  unlink(_file.c_str());
+}
+
+std::string Journal::set_aside() {
+  std::lock_guard<std::mutex> guard(_lock);
+  if (_fd >= 0) {
+    close(_fd);
+    _fd = -1;
+  }
+  std::string failed = _file + FAILED_SUFFIX;
+  if (rename(_file.c_str(), failed.c_str()) < 0)
+    return _file;
+  return failed;
+}
+
+bool WriteBack::open(const std::string& dir, journal_sync sync) {
+  // fuse_main changes to / when it daemonizes
+  char resolved[PATH_MAX];
+  if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+    return false;
+  if (!realpath(dir.c_str(), resolved))
+    return false;
+  _dir = resolved;
+  _sync = sync;
+  _dir_fd = ::open(_dir.c_str(), O_RDONLY | O_DIRECTORY);
+  return _dir_fd >= 0;
+}
+
+void WriteBack::start() {
+  replay();
+  for (unsigned int i = 0; i < DRAIN_THREADS; i++)
+    std::thread(&WriteBack::drain, this).detach();
+}
+
+std::shared_ptr<Journal> WriteBack::create(const std::string& path) {
+  return Journal::create(_dir, _dir_fd, _sync, path);
+}
+
+/* Queue every committed journal in the directory again, oldest commit
+   first, so versions of one path still land in order. */
+void WriteBack::replay() {
+  std::vector<std::string> files;
+  if (DIR* d = opendir(_dir.c_str())) {
+    while (struct dirent* e = readdir(d)) {
+      if (ends_with(e->d_name, JOURNAL_SUFFIX))
+        files.push_back(_dir + "/" + e->d_name);
+    }
+    closedir(d);
+  }
+
+  std::vector<std::pair<std::string, entry> > found;
+  for (const std::string& file : files) {
+    std::string path;
+    entry e;
+    if (replay_journal(file, &path, &e))
+      found.push_back(std::make_pair(path, e));
+    else
+      unlink(file.c_str());
+  }
+
+  std::sort(found.begin(), found.end(),
+            [](const std::pair<std::string, entry>& a, const std::pair<std::string, entry>& b) {
+              return a.second.journal->id() < b.second.journal->id();
+            });
+  for (auto& f : found)
+    enqueue(f.first, f.second);
+
+  if (!found.empty())
+    std::cerr << "write-back: " << found.size() << " file(s) from "
+              << _dir << " queued again" << std::endl;
+}
+
+/* Rebuild the file a journal describes as of its last commit. Writes
+   after that commit belong to a close that never happened. False if
+   the journal has no path or no commit. */
+bool WriteBack::replay_journal(const std::string& file, std::string* path, entry* e) {
+  int fd = ::open(file.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+
+  struct write_record {
+    uint64_t offset;
+    uint32_t len;
+    off_t at;
+  };
+  std::vector<write_record> writes;
+  size_t committed = 0;
+  mongo::BSONObj commit;
+
+  struct stat st;
+  char magic[sizeof(JOURNAL_MAGIC)];
+  off_t at = sizeof(magic);
+  std::vector<char> data;
+  bool ok = fstat(fd, &st) == 0 &&
+            pread_all(fd, magic, sizeof(magic), 0) &&
+            memcmp(magic, JOURNAL_MAGIC, sizeof(magic)) == 0;
+  while (ok) {
+    record_header h;
+    if (!pread_all(fd, &h, sizeof(h), at) ||
+        at + (off_t)sizeof(h) + (off_t)h.len > st.st_size)
+      break;
+    data.resize(h.len);
+    if (!pread_all(fd, data.data(), h.len, at + sizeof(h)) ||
+        record_check(h, data.data()) != h.check)
+      break;
+
+    if (h.type == REC_PATH) {
+      path->assign(data.data(), h.len);
+    } else if (h.type == REC_WRITE) {
+      write_record w = { h.offset, h.len, (off_t)(at + sizeof(h)) };
+      writes.push_back(w);
+    } else if (h.type == REC_COMMIT) {
+      commit = mongo::BSONObj(data.data()).getOwned();
+      committed = writes.size();
+    }
+    at += sizeof(h) + h.len;
+  }
+
+  if (path->empty() || commit.isEmpty()) {
+    close(fd);
+    return false;
+  }
+
+  LocalGridFile::ptr lgf = std::make_shared<LocalGridFile>(
+    (uid_t)commit["uid"].numberLong(), (gid_t)commit["gid"].numberLong(),
+    (mode_t)commit["mode"].Int());
+  if (gridfs_options.hashing != HASH_MD5)
+    lgf->disable_md5();
+  lgf->setStoredChunkSize(commit["chunkSize"].numberLong());
+  lgf->setMetadata(commit.getObjectField("metadata"));
+  lgf->setMTime(commit["mtime"].numberLong());
+  write_budget.track(lgf);
+
+  for (size_t i = 0; i < committed; i++) {
+    data.resize(writes[i].len);
+    if (!pread_all(fd, data.data(), writes[i].len, writes[i].at) ||
+        lgf->write(data.data(), writes[i].len, writes[i].offset) < 0) {
+      close(fd);
+      return false;
+    }
+  }
+  close(fd);
+
+  e->lgf = lgf;
+  e->journal = std::make_shared<Journal>(-1, file, _sync, _dir_fd, commit["_id"].__oid());
+  e->replayed = true;
+  lgf->setJournal(e->journal);
+  return true;
+}
+
+void WriteBack::submit(const std::string& path, const LocalGridFile::ptr& lgf) {
+  entry e = { lgf, lgf->journal(), false };
+  enqueue(path, e);
+}
+
+void WriteBack::enqueue(const std::string& path, const entry& e) {
+  {
+    std::lock_guard<std::mutex> guard(_lock);
+    std::deque<entry>& q = _queue[path];
+    q.push_back(e);
+    // Otherwise the path is ready or in progress already
+    if (q.size() == 1)
+      _ready.push_back(path);
+  }
+  _work.notify_one();
+}
+
+void WriteBack::drain() {
+  for (;;) {
+    std::string path;
+    entry e;
+    {
+      std::unique_lock<std::mutex> lock(_lock);
+      _work.wait(lock, [this]() { return !_ready.empty(); });
+      path = _ready.front();
+      _ready.pop_front();
+      e = _queue[path].front();
+    }
+
+    bool stored = store(path, e);
+
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      auto q = _queue.find(path);
+      q->second.pop_front();
+      if (q->second.empty())
+        _queue.erase(q);
+      else
+        _ready.push_back(path);
+      if (stored)
+        _stored++;
+      else
+        _failed++;
+    }
+    _work.notify_one();
+    _settled.notify_all();
+  }
+}
+
+/* Store one queued file. Transient failures are retried until the
+   server takes it, others PERMANENT_ATTEMPTS times, after which the
+   journal is set aside and the file leaves the queue. An attempt that
+   may have got as far as the files document is checked for first.
+   Retries use a fresh _id, so chunks a failed attempt left behind are
+   orphans for the collector instead of duplicates. False if the file
+   was given up on. */
+bool WriteBack::store(const std::string& path, const entry& e) {
+  mongo::OID id = e.journal ? e.journal->id() : mongo::OID();
+  bool checked = !e.replayed;
+  int failures = 0;
+  for (int attempt = 0;; attempt++) {
+    try {
+      Backend& backend = get_backend();
+      if (!checked && id.isSet()) {
+        mongo::BSONObj current = backend.find_file(path);
+        if (!current.isEmpty() && current["_id"].__oid() == id)
+          break;
+        id.init();
+      }
+      store_local_file(backend, path, *e.lgf, id);
+      break;
+    } catch (std::exception& ex) {
+      std::cerr << "write-back: storing " << path << " failed: " << ex.what() << std::endl;
+      if (!transient(ex) && ++failures == PERMANENT_ATTEMPTS) {
+        std::cerr << "write-back: giving up on " << path;
+        if (e.journal)
+          std::cerr << ", its journal is kept as " << e.journal->set_aside();
+        std::cerr << std::endl;
+        return false;
+      }
+      {
+        std::lock_guard<std::mutex> guard(_lock);
+        _retries++;
+      }
+      checked = false;
+      std::this_thread::sleep_for(std::chrono::seconds(std::min(1 << std::min(attempt, 6), 60)));
+    }
+  }
+
+  if (e.journal)
+    e.journal->remove();
+  return true;
+}
+
+LocalGridFile::ptr WriteBack::pending(const std::string& path) {
+  if (!enabled())
+    return LocalGridFile::ptr();
+
+  std::lock_guard<std::mutex> guard(_lock);
+  auto q = _queue.find(path);
+  if (q == _queue.end())
+    return LocalGridFile::ptr();
+  return q->second.back().lgf;
+}
+
+std::vector<std::string> WriteBack::pending_under(const std::string& prefix) {
+  std::vector<std::string> paths;
+  if (!enabled())
+    return paths;
+
+  std::lock_guard<std::mutex> guard(_lock);
+  for (auto q = _queue.lower_bound(prefix);
+       q != _queue.end() && q->first.compare(0, prefix.size(), prefix) == 0; ++q)
+    paths.push_back(q->first);
+  return paths;
+}
+
+bool WriteBack::queued_under(const std::string& path) const {
+  if (_queue.count(path))
+    return true;
+  std::string dir = path + "/";
+  auto q = _queue.lower_bound(dir);
+  return q != _queue.end() && q->first.compare(0, dir.size(), dir) == 0;
+}
+
+int WriteBack::amend(const std::string& path, const std::function<int(LocalGridFile&)>& change) {
+  if (!enabled())
+    return 1;
+
+  // Held throughout, so no worker starts on the entry meanwhile. The
+  // front one is being stored unless the path is still waiting its turn,
+  // and a replayed journal has no descriptor to commit to.
+  std::lock_guard<std::mutex> guard(_lock);
+  auto q = _queue.find(path);
+  if (q == _queue.end())
+    return 1;
+  entry& e = q->second.back();
+  bool started = q->second.size() == 1 &&
+                 std::find(_ready.begin(), _ready.end(), path) == _ready.end();
+  if (started || e.replayed || !e.journal)
+    return 1;
+
+  int r = change(*e.lgf);
+  if (r < 0)
+    return r;
+  return e.journal->commit(*e.lgf);
+}
+
+int WriteBack::settle(const std::string& path) {
+  if (!enabled())
+    return 0;
+
+  std::unique_lock<std::mutex> lock(_lock);
+  if (!_settled.wait_for(lock, std::chrono::seconds(SETTLE_SECONDS),
+                         [this, &path]() { return !queued_under(path); }))
+    return -EAGAIN;
+  return 0;
+}
+
+WriteBack::usage WriteBack::stats() const {
+  std::lock_guard<std::mutex> guard(_lock);
+  usage u = { 0, 0, _stored, _retries, _failed };
+  for (auto& q : _queue) {
+    u.files += q.second.size();
+    for (const entry& e : q.second)
+      u.bytes += e.lgf->Length();
+  }
+  return u;
+}
+
+LocalGridFile::ptr local_file(const std::string& path) {
+  auto file_iter = open_files.find(path);
+  if (file_iter != open_files.end())
+    return file_iter->second;
+  return write_back.pending(path);
+}
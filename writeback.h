@@ -0,0 +1,178 @@
+/*
+ *  Copyright 2009 Michael Stephens
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __WRITEBACK_H
+#define __WRITEBACK_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <mongo/bson/bson.h>
+
+#include "local_gridfile.h"
+
+enum journal_sync {
+  SYNC_CLOSE,  // fdatasync when a file is closed (default)
+  SYNC_WRITE,  // and after every write
+  SYNC_NONE    // leave it to the kernel
+};
+
+//! Parse a --journal-sync value. False if it isn't one.
+bool parse_journal_sync(const char* name, journal_sync* sync);
+
+/* Append-only record of one file written in --write-back mode: its
+   path, then every write as it happens, then a commit each time the
+   file is closed. A commit holds the attributes the file is stored with
+   and the files _id it is stored under. Every record carries a checksum,
+   so a journal torn by a crash is read up to its last whole record. */
+class Journal {
+public:
+  //! A new journal for path in dir, or an empty pointer.
+  static std::shared_ptr<Journal> create(const std::string& dir, int dir_fd,
+                                         journal_sync sync, const std::string& path);
+
+  Journal(int fd, const std::string& file, journal_sync sync, int dir_fd,
+          const mongo::OID& id = mongo::OID());
+  ~Journal();
+
+  //! Returns 0 or -errno.
+  int append(off_t offset, const char* data, size_t len);
+
+  //! Record lgf's attributes under a new _id and sync as --journal-sync
+  //  says. From here on a crash doesn't lose the file. 0 or -errno.
+  int commit(const LocalGridFile& lgf);
+
+  //! The _id of the last commit.
+  mongo::OID id() const;
+
+  //! Delete the journal, once the file it describes is stored.
+  void remove();
+
+  //! Rename the journal out of replay's way, once storing its file has
+  //  been given up on. Returns its new name.
+  std::string set_aside();
+
+private:
+  int record(uint32_t type, uint64_t offset, const char* data, size_t len);
+
+  mutable std::mutex _lock;
+  int _fd;
+  std::string _file;
+  journal_sync _sync;
+  int _dir_fd;
+  bool _dir_synced;
+  mongo::OID _id;
+};
+
+/* With --write-back=<dir>, closing a file doesn't wait for its upload.
+   Files being written are journaled in dir, and once closed they queue
+   for background workers that store them and delete the journal. Until
+   then the local copy answers getattr, open, read and readdir, and
+   takes chmod, chown, utimens and xattr changes, which are committed
+   to its journal. Anything else that would change the stored file
+   waits a while for it to land, and fails with EAGAIN if it doesn't.
+   Uploads of one path keep the order the files were closed in.
+
+   At mount, the journals a crash left behind are replayed: committed
+   files queue again, journals never committed are dropped, like the
+   unclosed files they belonged to. A file whose committed _id is
+   already stored isn't stored twice.
+
+   A file the server keeps refusing for reasons other than being
+   unreachable is given up on, and its journal kept with a .failed
+   suffix for someone to look at. */
+class WriteBack {
+public:
+  WriteBack() : _dir_fd(-1), _sync(SYNC_CLOSE), _stored(0), _retries(0), _failed(0) {}
+
+  //! Use dir, creating it if needed. False if it can't be used.
+  bool open(const std::string& dir, journal_sync sync);
+  bool enabled() const { return _dir_fd >= 0; }
+
+  //! Replay what a crash left and start the workers. From gridfs_init.
+  void start();
+
+  //! A journal for a new file at path, or an empty pointer.
+  std::shared_ptr<Journal> create(const std::string& path);
+
+  //! Queue a closed file for upload. Its journal has to be committed.
+  void submit(const std::string& path, const LocalGridFile::ptr& lgf);
+
+  //! The newest queued version of path, or an empty pointer.
+  LocalGridFile::ptr pending(const std::string& path);
+
+  //! Queued paths starting with prefix.
+  std::vector<std::string> pending_under(const std::string& prefix);
+
+  //! Apply change to the queued copy of path and commit its journal
+  //  again, so chmod and the like don't wait for the upload. Returns
+  //  what change returned, or -errno from the journal, or 1 when no
+  //  queued copy can still be changed and the stored file has to be.
+  int amend(const std::string& path, const std::function<int(LocalGridFile&)>& change);
+
+  //! Wait until nothing is queued at path or below it, for at most
+  //  SETTLE_SECONDS. 0, or -EAGAIN when the uploads are still going.
+  int settle(const std::string& path);
+
+  struct usage {
+    size_t files;
+    size_t bytes;
+    unsigned long long stored;
+    unsigned long long retries;
+    unsigned long long failed;
+  };
+
+  //! Queued files and their size, and totals since mount.
+  usage stats() const;
+
+private:
+  struct entry {
+    LocalGridFile::ptr lgf;
+    std::shared_ptr<Journal> journal;
+    bool replayed;
+  };
+
+  void replay();
+  bool replay_journal(const std::string& file, std::string* path, entry* e);
+  void enqueue(const std::string& path, const entry& e);
+  void drain();
+  bool store(const std::string& path, const entry& e);
+  bool queued_under(const std::string& path) const;
+
+  std::string _dir;
+  int _dir_fd;
+  journal_sync _sync;
+
+  mutable std::mutex _lock;
+  std::condition_variable _work, _settled;
+  std::map<std::string, std::deque<entry> > _queue;
+  std::deque<std::string> _ready;  // paths with a file to store, none in progress
+  unsigned long long _stored, _retries, _failed;
+};
+
+extern WriteBack write_back;
+
+//! The file open for writing at path, or else its queued copy.
+LocalGridFile::ptr local_file(const std::string& path);
+
+#endif